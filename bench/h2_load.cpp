@@ -0,0 +1,258 @@
+// HTTP/2 load generator (h2c, prior knowledge) for a running server, the
+// multiplexed counterpart of http_load's latency mode; see bench/README.md.
+//
+//   --clients n   connections, one thread each
+//   --streams s   requests kept in flight on every connection
+//   --requests r  small GETs per connection; reports p50/p99/p999/max
+//   --pid p       also report the server's voluntary context switches
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <print>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+struct load_options {
+    std::string m_host = "127.0.0.1";
+    int m_port = 8080;
+    int m_clients = 1;
+    int m_streams = 32;
+    int m_requests = 40000;
+    int m_pid = 0;
+};
+
+using clock_type = std::chrono::steady_clock;
+
+static int connect_to(load_options const &opts) {
+    struct sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(static_cast<uint16_t>(opts.m_port));
+    inet_pton(AF_INET, opts.m_host.c_str(), &addr.sin_addr);
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0) {
+        std::println(stderr, "connect {}:{}: {}", opts.m_host, opts.m_port, std::strerror(errno));
+        std::exit(1);
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+static bool write_all(int fd, std::string_view data) {
+    while (!data.empty()) {
+        ssize_t n = write(fd, data.data(), data.size());
+        if (n <= 0) {
+            return false;
+        }
+        data.remove_prefix(static_cast<size_t>(n));
+    }
+    return true;
+}
+
+static void put32(std::string &out, uint32_t value) {
+    out += static_cast<char>(value >> 24);
+    out += static_cast<char>(value >> 16);
+    out += static_cast<char>(value >> 8);
+    out += static_cast<char>(value);
+}
+
+static void frame(std::string &out, uint8_t type, uint8_t flags, uint32_t stream_id, std::string_view payload) {
+    out += static_cast<char>(payload.size() >> 16);
+    out += static_cast<char>(payload.size() >> 8);
+    out += static_cast<char>(payload.size());
+    out += static_cast<char>(type);
+    out += static_cast<char>(flags);
+    put32(out, stream_id);
+    out += payload;
+}
+
+static void window_update(std::string &out, uint32_t stream_id, uint32_t increment) {
+    std::string payload;
+    put32(payload, increment);
+    frame(out, 8, 0, stream_id, payload);
+}
+
+static uint32_t get32(char const *p) {
+    auto *u = reinterpret_cast<uint8_t const *>(p);
+    return uint32_t(u[0]) << 24 | uint32_t(u[1]) << 16 | uint32_t(u[2]) << 8 | u[3];
+}
+
+static long voluntary_switches(int pid) {
+    if (pid == 0) {
+        return 0;
+    }
+    std::ifstream status("/proc/" + std::to_string(pid) + "/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.starts_with("voluntary_ctxt_switches:")) {
+            return std::strtol(line.c_str() + 24, nullptr, 10);
+        }
+    }
+    return 0;
+}
+
+static double percentile(std::vector<double> const &sorted, double p) {
+    size_t i = static_cast<size_t>(p * static_cast<double>(sorted.size()));
+    return sorted[std::min(i, sorted.size() - 1)];
+}
+
+// one connection: keeps m_streams GETs in flight until m_requests are answered
+static std::vector<double> run_connection(load_options const &opts) {
+    // :method GET, :scheme http, :path / from the static table, then
+    // :authority as a literal without indexing, so every block is the same
+    static constexpr std::string_view k_block = "\x82\x86\x84\x01\x05" "bench";
+    constexpr uint8_t k_end_stream = 0x1, k_end_headers = 0x4;
+
+    int fd = connect_to(opts);
+    std::string out = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+    frame(out, 4, 0, 0, {});
+
+    std::map<uint32_t, clock_type::time_point> in_flight;
+    std::vector<double> latencies;
+    latencies.reserve(static_cast<size_t>(opts.m_requests));
+    uint32_t next_id = 1;
+    int issued = 0;
+    auto issue = [&] {
+        in_flight.emplace(next_id, clock_type::now());
+        frame(out, 1, k_end_stream | k_end_headers, next_id, k_block);
+        next_id += 2;
+        ++issued;
+    };
+    while (issued < std::min(opts.m_streams, opts.m_requests)) {
+        issue();
+    }
+
+    std::string in;
+    char chunk[65536];
+    while (static_cast<int>(latencies.size()) < opts.m_requests) {
+        if (!out.empty()) {
+            if (!write_all(fd, out)) {
+                break;
+            }
+            out.clear();
+        }
+        ssize_t n = read(fd, chunk, sizeof(chunk));
+        if (n <= 0) {
+            break;
+        }
+        in.append(chunk, static_cast<size_t>(n));
+
+        size_t pos = 0;
+        uint32_t data_bytes = 0;
+        while (in.size() - pos >= 9) {
+            auto *h = reinterpret_cast<uint8_t const *>(in.data() + pos);
+            size_t length = size_t(h[0]) << 16 | size_t(h[1]) << 8 | h[2];
+            if (in.size() - pos < 9 + length) {
+                break;
+            }
+            uint8_t type = h[3], flags = h[4];
+            uint32_t stream_id = get32(in.data() + pos + 5) & 0x7fffffff;
+            pos += 9 + length;
+            if (type == 4 && !(flags & 0x1)) {
+                frame(out, 4, 0x1, 0, {});
+            }
+            else if (type == 7) {
+                std::println(stderr, "GOAWAY, error {}", get32(in.data() + pos - length + 4));
+                std::exit(1);
+            }
+            else if (type == 3) {
+                std::println(stderr, "stream {} reset, error {}", stream_id, get32(in.data() + pos - length));
+                std::exit(1);
+            }
+            if (type == 0) {
+                data_bytes += static_cast<uint32_t>(length);
+            }
+            if ((type == 0 || type == 1) && (flags & k_end_stream)) {
+                auto it = in_flight.find(stream_id);
+                if (it != in_flight.end()) {
+                    latencies.push_back(std::chrono::duration<double, std::micro>(clock_type::now() - it->second).count());
+                    in_flight.erase(it);
+                    if (issued < opts.m_requests) {
+                        issue();
+                    }
+                }
+            }
+        }
+        in.erase(0, pos);
+        // streams end with their DATA, so only the connection window needs credit
+        if (data_bytes != 0) {
+            window_update(out, 0, data_bytes);
+        }
+    }
+    close(fd);
+    return latencies;
+}
+
+int main(int argc, char **argv) {
+    load_options opts;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        std::string_view flag = argv[i];
+        char const *value = argv[i + 1];
+        if (flag == "--host") {
+            opts.m_host = value;
+        }
+        else if (flag == "--port") {
+            opts.m_port = std::atoi(value);
+        }
+        else if (flag == "--clients") {
+            opts.m_clients = std::atoi(value);
+        }
+        else if (flag == "--streams") {
+            opts.m_streams = std::atoi(value);
+        }
+        else if (flag == "--requests") {
+            opts.m_requests = std::atoi(value);
+        }
+        else if (flag == "--pid") {
+            opts.m_pid = std::atoi(value);
+        }
+        else {
+            std::println(stderr, "unknown option {}", flag);
+            return 2;
+        }
+    }
+
+    long switches = voluntary_switches(opts.m_pid);
+    auto t0 = clock_type::now();
+    std::mutex mutex;
+    std::vector<double> latencies;
+    std::vector<std::thread> clients;
+    for (int c = 0; c < opts.m_clients; c++) {
+        clients.emplace_back([&] {
+            auto mine = run_connection(opts);
+            std::lock_guard lock(mutex);
+            latencies.insert(latencies.end(), mine.begin(), mine.end());
+        });
+    }
+    for (auto &t: clients) {
+        t.join();
+    }
+    double secs = std::chrono::duration<double>(clock_type::now() - t0).count();
+    long switched = voluntary_switches(opts.m_pid) - switches;
+    if (latencies.empty()) {
+        std::println(stderr, "no request completed");
+        return 1;
+    }
+    std::ranges::sort(latencies);
+    std::println("{} 个请求 ({} 个连接, 每连接 {} 个并发流), {:.0f} 请求/秒: p50 {:.0f}us p99 {:.0f}us p999 {:.0f}us max {:.0f}us",
+                 latencies.size(), opts.m_clients, opts.m_streams, static_cast<double>(latencies.size()) / secs,
+                 percentile(latencies, 0.5), percentile(latencies, 0.99), percentile(latencies, 0.999), latencies.back());
+    if (opts.m_pid) {
+        std::println("  服务端每请求 {:.2f} 次主动上下文切换",
+                     static_cast<double>(switched) / static_cast<double>(latencies.size()));
+    }
+    return 0;
+}
@@ -0,0 +1,387 @@
+// Load generator for a running server, see bench/README.md for recipes.
+//
+//   latency: --clients n keep-alive connections, each sending --requests
+//            small GETs one at a time; reports p50/p99/p999/max
+//   bulk:    --bulk m neighbours meanwhile streaming --bulk-size POSTs
+//   connect: --connect n short-lived connections, one request each
+//            (Connection: close); reports connections per second
+//   sweep:   --sweep 4k,64k,1m POSTs of each body size on --clients
+//            connections for --duration seconds each; the server echoes the
+//            body, so reports responses/s, MB/s and (with --pid) server CPU
+//            per MB, to find the size where CO_HTTP_ZEROCOPY starts to win
+//   --unix path: connect to the server's Unix domain socket (CO_HTTP_UNIX)
+//            instead of --host/--port, "@name" for the abstract namespace
+//   --pid p: also report the server's voluntary context switches (its
+//            sleeps in epoll_wait) per request or per connection
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <print>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+struct load_options {
+    std::string m_host = "127.0.0.1";
+    int m_port = 8080;
+    std::string m_unix;
+    int m_clients = 8;
+    int m_requests = 5000;
+    int m_bulk = 0;
+    size_t m_bulk_size = 4 << 20;
+    int m_connect = 0;
+    std::vector<size_t> m_sweep;
+    double m_duration = 2;
+    int m_pid = 0;
+};
+
+// a leading '@' is the abstract namespace: a NUL first, no file
+static int connect_unix(load_options const &opts) {
+    struct sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    size_t len = std::min(opts.m_unix.size(), sizeof(addr.sun_path) - 1);
+    std::memcpy(addr.sun_path, opts.m_unix.data(), len);
+    if (opts.m_unix.starts_with('@')) {
+        addr.sun_path[0] = '\0';
+    }
+    auto addrlen = static_cast<socklen_t>(offsetof(struct sockaddr_un, sun_path) + len);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, reinterpret_cast<struct sockaddr *>(&addr), addrlen) < 0) {
+        std::println(stderr, "connect unix:{}: {}", opts.m_unix, std::strerror(errno));
+        std::exit(1);
+    }
+    return fd;
+}
+
+static int connect_to(load_options const &opts) {
+    if (!opts.m_unix.empty()) {
+        return connect_unix(opts);
+    }
+    struct sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(static_cast<uint16_t>(opts.m_port));
+    inet_pton(AF_INET, opts.m_host.c_str(), &addr.sin_addr);
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0) {
+        std::println(stderr, "connect {}:{}: {}", opts.m_host, opts.m_port, std::strerror(errno));
+        std::exit(1);
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+static bool write_all(int fd, std::string_view data) {
+    while (!data.empty()) {
+        ssize_t n = write(fd, data.data(), data.size());
+        if (n <= 0) {
+            return false;
+        }
+        data.remove_prefix(static_cast<size_t>(n));
+    }
+    return true;
+}
+
+// one response, framed by Content-Length
+static bool read_response(int fd, std::string &buf) {
+    buf.clear();
+    char chunk[16384];
+    while (true) {
+        size_t header_end = buf.find("\r\n\r\n");
+        if (header_end != std::string::npos) {
+            size_t length = 0;
+            size_t pos = buf.find("ontent-Length: ");
+            if (pos == std::string::npos) {
+                pos = buf.find("ontent-length: ");
+            }
+            if (pos != std::string::npos && pos < header_end) {
+                length = std::strtoul(buf.c_str() + pos + 15, nullptr, 10);
+            }
+            if (buf.size() >= header_end + 4 + length) {
+                return true;
+            }
+        }
+        ssize_t n = read(fd, chunk, sizeof(chunk));
+        if (n <= 0) {
+            return false;
+        }
+        buf.append(chunk, static_cast<size_t>(n));
+    }
+}
+
+static long voluntary_switches(int pid) {
+    if (pid == 0) {
+        return 0;
+    }
+    std::ifstream status("/proc/" + std::to_string(pid) + "/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.starts_with("voluntary_ctxt_switches:")) {
+            return std::strtol(line.c_str() + 24, nullptr, 10);
+        }
+    }
+    return 0;
+}
+
+// user plus system time of the whole process, in seconds
+static double cpu_seconds(int pid) {
+    if (pid == 0) {
+        return 0;
+    }
+    std::ifstream stat("/proc/" + std::to_string(pid) + "/stat");
+    std::string line;
+    std::getline(stat, line);
+    // the fields after the parenthesised name; utime and stime are 14 and 15
+    size_t pos = line.rfind(')');
+    if (pos == std::string::npos) {
+        return 0;
+    }
+    std::istringstream fields(line.substr(pos + 2));
+    std::string skip;
+    for (int field = 3; field < 14; field++) {
+        fields >> skip;
+    }
+    double utime = 0, stime = 0;
+    fields >> utime >> stime;
+    double ticks = utime + stime;
+    return ticks / static_cast<double>(sysconf(_SC_CLK_TCK));
+}
+
+// "4k,64k,1m" into byte counts
+static std::vector<size_t> parse_sizes(std::string_view list) {
+    std::vector<size_t> sizes;
+    while (!list.empty()) {
+        size_t comma = list.find(',');
+        std::string item(list.substr(0, comma));
+        char *end = nullptr;
+        size_t size = std::strtoul(item.c_str(), &end, 10);
+        if (*end == 'k' || *end == 'K') {
+            size <<= 10;
+        }
+        else if (*end == 'm' || *end == 'M') {
+            size <<= 20;
+        }
+        if (size > 0) {
+            sizes.push_back(size);
+        }
+        list.remove_prefix(comma == std::string_view::npos ? list.size() : comma + 1);
+    }
+    return sizes;
+}
+
+static double percentile(std::vector<double> const &sorted, double p) {
+    size_t i = static_cast<size_t>(p * static_cast<double>(sorted.size()));
+    return sorted[std::min(i, sorted.size() - 1)];
+}
+
+static void run_connect(load_options const &opts) {
+    std::string const request = "GET / HTTP/1.1\r\nHost: bench\r\nConnection: close\r\n\r\n";
+    long switches = voluntary_switches(opts.m_pid);
+    auto t0 = std::chrono::steady_clock::now();
+    std::string buf;
+    for (int i = 0; i < opts.m_connect; i++) {
+        int fd = connect_to(opts);
+        if (!write_all(fd, request) || !read_response(fd, buf)) {
+            std::println(stderr, "connection {} failed", i);
+            std::exit(1);
+        }
+        close(fd);
+    }
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    std::println("{} 个连接, {:.0f} 连接/秒", opts.m_connect, opts.m_connect / secs);
+    if (opts.m_pid) {
+        std::println("  服务端每连接 {:.2f} 次主动上下文切换",
+                     static_cast<double>(voluntary_switches(opts.m_pid) - switches) / opts.m_connect);
+    }
+}
+
+static void run_sweep(load_options const &opts) {
+    std::println("{:>10} {:>12} {:>10} {:>16}", "字节", "响应/秒", "MB/s", "服务端 CPU ms/MB");
+    for (size_t size: opts.m_sweep) {
+        std::string request = "POST /sweep HTTP/1.1\r\nHost: bench\r\nContent-Length: "
+                            + std::to_string(size) + "\r\n\r\n";
+        request.append(size, 'x');
+        std::atomic<long> responses{0};
+        std::atomic<size_t> bytes{0};
+        double cpu = cpu_seconds(opts.m_pid);
+        auto t0 = std::chrono::steady_clock::now();
+        auto deadline = t0 + std::chrono::duration<double>(opts.m_duration);
+        std::vector<std::thread> clients;
+        for (int c = 0; c < opts.m_clients; c++) {
+            clients.emplace_back([&] {
+                int fd = connect_to(opts);
+                std::string buf;
+                while (std::chrono::steady_clock::now() < deadline) {
+                    if (!write_all(fd, request) || !read_response(fd, buf)) {
+                        std::println(stderr, "{} 字节的请求失败", size);
+                        std::exit(1);
+                    }
+                    ++responses;
+                    bytes += buf.size();
+                }
+                close(fd);
+            });
+        }
+        for (auto &t: clients) {
+            t.join();
+        }
+        double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        double mb = static_cast<double>(bytes.load()) / 1e6;
+        if (opts.m_pid) {
+            std::println("{:>10} {:>12.0f} {:>10.1f} {:>16.2f}", size, static_cast<double>(responses.load()) / secs,
+                         mb / secs, (cpu_seconds(opts.m_pid) - cpu) * 1e3 / mb);
+        }
+        else {
+            std::println("{:>10} {:>12.0f} {:>10.1f} {:>16}", size, static_cast<double>(responses.load()) / secs,
+                         mb / secs, "-");
+        }
+    }
+    // how many of those sends went out with MSG_ZEROCOPY, and how many the
+    // kernel copied anyway; /debug answers loopback peers only
+    int fd = connect_to(opts);
+    std::string buf;
+    if (write_all(fd, "GET /debug/zerocopy HTTP/1.1\r\nHost: bench\r\n\r\n") && read_response(fd, buf)
+        && buf.starts_with("HTTP/1.1 200")) {
+        std::print("/debug/zerocopy: {}", buf.substr(std::min(buf.size(), buf.find("\r\n\r\n") + 4)));
+    }
+    close(fd);
+}
+
+static void run_latency(load_options const &opts) {
+    std::atomic<bool> stop{false};
+    std::vector<std::thread> bulk;
+    std::atomic<size_t> bulk_requests{0};
+    for (int i = 0; i < opts.m_bulk; i++) {
+        bulk.emplace_back([&] {
+            int fd = connect_to(opts);
+            std::string request = "POST /upload HTTP/1.1\r\nHost: bench\r\nContent-Length: "
+                                + std::to_string(opts.m_bulk_size) + "\r\n\r\n";
+            request.append(opts.m_bulk_size, 'x');
+            std::string buf;
+            while (!stop && write_all(fd, request) && read_response(fd, buf)) {
+                ++bulk_requests;
+            }
+            close(fd);
+        });
+    }
+    if (opts.m_bulk) {
+        // let the neighbours fill their pipes first
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    }
+
+    long switches = voluntary_switches(opts.m_pid);
+    std::mutex mutex;
+    std::vector<double> latencies;
+    std::vector<std::thread> clients;
+    for (int c = 0; c < opts.m_clients; c++) {
+        clients.emplace_back([&] {
+            int fd = connect_to(opts);
+            std::string const request = "GET / HTTP/1.1\r\nHost: bench\r\n\r\n";
+            std::string buf;
+            std::vector<double> mine;
+            mine.reserve(static_cast<size_t>(opts.m_requests));
+            for (int i = 0; i < opts.m_requests; i++) {
+                auto t0 = std::chrono::steady_clock::now();
+                if (!write_all(fd, request) || !read_response(fd, buf)) {
+                    break;
+                }
+                mine.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count());
+            }
+            close(fd);
+            std::lock_guard lock(mutex);
+            latencies.insert(latencies.end(), mine.begin(), mine.end());
+        });
+    }
+    for (auto &t: clients) {
+        t.join();
+    }
+    long switched = voluntary_switches(opts.m_pid) - switches;
+    stop = true;
+    if (latencies.empty()) {
+        std::println(stderr, "no request completed");
+        std::exit(1);
+    }
+    std::ranges::sort(latencies);
+    std::println("{} 个请求 ({} 个客户端, {} 个大流量邻居): p50 {:.0f}us p99 {:.0f}us p999 {:.0f}us max {:.0f}us",
+                 latencies.size(), opts.m_clients, opts.m_bulk, percentile(latencies, 0.5),
+                 percentile(latencies, 0.99), percentile(latencies, 0.999), latencies.back());
+    if (opts.m_bulk) {
+        std::println("  邻居同时完成了 {} 次 {} 字节的上传", bulk_requests.load(), opts.m_bulk_size);
+    }
+    if (opts.m_pid) {
+        std::println("  服务端每请求 {:.2f} 次主动上下文切换",
+                     static_cast<double>(switched) / static_cast<double>(latencies.size()));
+    }
+    // bulk neighbours may be blocked mid-body: leave without joining them
+    std::fflush(stdout);
+    std::_Exit(0);
+}
+
+int main(int argc, char **argv) {
+    load_options opts;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        std::string_view flag = argv[i];
+        char const *value = argv[i + 1];
+        if (flag == "--host") {
+            opts.m_host = value;
+        }
+        else if (flag == "--port") {
+            opts.m_port = std::atoi(value);
+        }
+        else if (flag == "--unix") {
+            opts.m_unix = value;
+        }
+        else if (flag == "--clients") {
+            opts.m_clients = std::atoi(value);
+        }
+        else if (flag == "--requests") {
+            opts.m_requests = std::atoi(value);
+        }
+        else if (flag == "--bulk") {
+            opts.m_bulk = std::atoi(value);
+        }
+        else if (flag == "--bulk-size") {
+            opts.m_bulk_size = std::strtoul(value, nullptr, 10);
+        }
+        else if (flag == "--connect") {
+            opts.m_connect = std::atoi(value);
+        }
+        else if (flag == "--sweep") {
+            opts.m_sweep = parse_sizes(value);
+        }
+        else if (flag == "--duration") {
+            opts.m_duration = std::atof(value);
+        }
+        else if (flag == "--pid") {
+            opts.m_pid = std::atoi(value);
+        }
+        else {
+            std::println(stderr, "unknown option {}", flag);
+            return 2;
+        }
+    }
+    if (opts.m_connect) {
+        run_connect(opts);
+    }
+    else if (!opts.m_sweep.empty()) {
+        run_sweep(opts);
+    }
+    else {
+        run_latency(opts);
+    }
+    return 0;
+}
@@ -0,0 +1,95 @@
+// Cost of http_pipeline itself: a handler echoing a 5-byte body, run with
+// no stages and with 8 empty ones of each kind. Stages are types resolved at
+// compile time, so empty ones should inline away to the bare handler.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <memory_resource>
+#include <print>
+#include <string_view>
+
+#include "http_message.hpp"
+#include "middleware.hpp"
+
+struct echo_handler {
+    using ok_header = http_header_template<http_status::ok,
+        "Server: co_http",
+        "Connection: keep-alive">;
+
+    template <class Request, class Response>
+    static void handle(Request &req, Response &res, std::pmr::memory_resource *, bool) {
+        res.template write_header<ok_header>(req.body().size());
+        res.write_body(req.body());
+    }
+};
+
+template <int>
+struct empty_sync {
+    template <class Exchange>
+    bool operator()(Exchange &) {
+        return true;
+    }
+};
+
+template <int>
+struct empty_with_after {
+    template <class Exchange>
+    bool operator()(Exchange &) {
+        return true;
+    }
+
+    template <class Exchange>
+    void after(Exchange &) {}
+};
+
+template <int>
+struct empty_async {
+    template <class Exchange, class Next>
+    void operator()(Exchange &, Next next) {
+        return next();
+    }
+};
+
+template <template <int> class Stage, class Handler, int... I>
+auto eight(std::integer_sequence<int, I...>) -> http_pipeline<Handler, Stage<I>...>;
+
+template <template <int> class Stage>
+using eight_of = decltype(eight<Stage, echo_handler>(std::make_integer_sequence<int, 8>()));
+
+// best of several rounds, in ns per request
+template <class Pipeline>
+double run(char const *name, size_t count) {
+    std::pmr::monotonic_buffer_resource mr;
+    http_request_parser<> req;
+    req.push_chunk(std::string_view("POST / HTTP/1.1\r\nHost: bench\r\nContent-Length: 5\r\n\r\nhello"));
+    http_response_writer<> res;
+    size_t response_bytes = 0;
+    double best = 1e9;
+    for (int round = 0; round < 10; round++) {
+        auto t0 = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < count; i++) {
+            res.reset_state();
+            Pipeline::handle(req, res, &mr, false, false, [&] {
+                response_bytes += res.buffer().size();
+            });
+        }
+        auto t1 = std::chrono::steady_clock::now();
+        best = std::min(best, std::chrono::duration<double, std::nano>(t1 - t0).count() / static_cast<double>(count));
+    }
+    std::println("{:<24} {:6.2f} ns/请求 (响应共 {} 字节)", name, best, response_bytes);
+    return best;
+}
+
+int main(int argc, char **argv) {
+    size_t count = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 2000000;
+    run<http_pipeline<echo_handler>>("warmup", count);
+    double none = run<http_pipeline<echo_handler>>("no middleware", count);
+    double worst = std::max({
+        run<eight_of<empty_sync>>("8 empty sync", count),
+        run<eight_of<empty_with_after>>("8 empty sync + after", count),
+        run<eight_of<empty_async>>("8 empty async", count),
+    });
+    std::println("最慢的一组比没有中间件多 {:+.1f}%", (worst / none - 1) * 100);
+    return 0;
+}
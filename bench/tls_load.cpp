@@ -0,0 +1,234 @@
+// TLS load generator for a running server's HTTPS port, see bench/README.md.
+//
+//   handshakes: --handshakes n connections over --clients c threads, each a
+//               handshake, one GET and a close_notify; reports handshakes
+//               per second, full or (with --resume 1) resumed from a ticket
+//   bulk:       --bulk-size b POSTs on --clients keep-alive connections for
+//               --duration seconds; the server echoes the body, so reports
+//               MB/s each way with the negotiated cipher
+//
+// The certificate is not verified: this measures the server, not the PKI.
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <print>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+struct tls_options {
+    std::string m_host = "127.0.0.1";
+    int m_port = 8443;
+    int m_clients = 4;
+    int m_handshakes = 0;
+    bool m_resume = false;
+    size_t m_bulk_size = 0;
+    double m_duration = 3;
+};
+
+static int connect_to(tls_options const &opts) {
+    struct sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(static_cast<uint16_t>(opts.m_port));
+    inet_pton(AF_INET, opts.m_host.c_str(), &addr.sin_addr);
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0) {
+        std::println(stderr, "connect {}:{}: {}", opts.m_host, opts.m_port, std::strerror(errno));
+        std::exit(1);
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+// connected and handshaken, ALPN http/1.1; nullptr on failure
+static SSL *tls_connect(SSL_CTX *ctx, tls_options const &opts, SSL_SESSION *session) {
+    int fd = connect_to(opts);
+    SSL *ssl = SSL_new(ctx);
+    SSL_set_fd(ssl, fd);
+    SSL_set_alpn_protos(ssl, reinterpret_cast<unsigned char const *>("\x08http/1.1"), 9);
+    if (session) {
+        SSL_set_session(ssl, session);
+    }
+    if (SSL_connect(ssl) != 1) {
+        ERR_print_errors_fp(stderr);
+        SSL_free(ssl);
+        close(fd);
+        return nullptr;
+    }
+    return ssl;
+}
+
+static void tls_close(SSL *ssl) {
+    int fd = SSL_get_fd(ssl);
+    SSL_shutdown(ssl);
+    SSL_free(ssl);
+    close(fd);
+}
+
+static bool write_all(SSL *ssl, std::string_view data) {
+    size_t n = 0;
+    return SSL_write_ex(ssl, data.data(), data.size(), &n) == 1 && n == data.size();
+}
+
+// one response, framed by Content-Length; returns its size, 0 on failure
+static size_t read_response(SSL *ssl, std::string &buf) {
+    buf.clear();
+    char chunk[65536];
+    while (true) {
+        size_t header_end = buf.find("\r\n\r\n");
+        if (header_end != std::string::npos) {
+            size_t pos = buf.find("ontent-Length: ");
+            size_t length = pos < header_end ? std::strtoul(buf.c_str() + pos + 15, nullptr, 10) : 0;
+            if (buf.size() >= header_end + 4 + length) {
+                return buf.size();
+            }
+        }
+        size_t n = 0;
+        if (SSL_read_ex(ssl, chunk, sizeof(chunk), &n) != 1) {
+            return 0;
+        }
+        buf.append(chunk, n);
+    }
+}
+
+static void run_handshakes(SSL_CTX *ctx, tls_options const &opts) {
+    std::string_view const request = "GET / HTTP/1.1\r\nHost: bench\r\n\r\n";
+    std::atomic<int> next{0};
+    std::atomic<int> done{0};
+    std::atomic<int> resumed{0};
+    auto t0 = std::chrono::steady_clock::now();
+    std::vector<std::thread> clients;
+    for (int c = 0; c < opts.m_clients; c++) {
+        clients.emplace_back([&] {
+            SSL_SESSION *session = nullptr;
+            std::string buf;
+            while (next++ < opts.m_handshakes) {
+                SSL *ssl = tls_connect(ctx, opts, session);
+                if (!ssl || !write_all(ssl, request) || !read_response(ssl, buf)) {
+                    std::println(stderr, "TLS 连接失败");
+                    std::exit(1);
+                }
+                ++done;
+                resumed += SSL_session_reused(ssl);
+                // the ticket came along with the response; a TLS 1.3 client
+                // uses each one once, so keep the newest
+                if (opts.m_resume) {
+                    SSL_SESSION_free(session);
+                    session = SSL_get1_session(ssl);
+                }
+                tls_close(ssl);
+            }
+            SSL_SESSION_free(session);
+        });
+    }
+    for (auto &t: clients) {
+        t.join();
+    }
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    std::println("{} 次握手 ({} 个客户端, {} 次复用会话): {:.0f} 握手/秒", done.load(), opts.m_clients,
+                 resumed.load(), done.load() / secs);
+}
+
+static void run_bulk(SSL_CTX *ctx, tls_options const &opts) {
+    std::string request = "POST /upload HTTP/1.1\r\nHost: bench\r\nContent-Length: "
+                        + std::to_string(opts.m_bulk_size) + "\r\n\r\n";
+    request.append(opts.m_bulk_size, 'x');
+    std::atomic<size_t> received{0};
+    std::atomic<long> responses{0};
+    std::string cipher;
+    auto t0 = std::chrono::steady_clock::now();
+    auto deadline = t0 + std::chrono::duration<double>(opts.m_duration);
+    std::vector<std::thread> clients;
+    for (int c = 0; c < opts.m_clients; c++) {
+        clients.emplace_back([&, c] {
+            SSL *ssl = tls_connect(ctx, opts, nullptr);
+            if (!ssl) {
+                std::println(stderr, "TLS 连接失败");
+                std::exit(1);
+            }
+            if (c == 0) {
+                cipher = std::string(SSL_get_version(ssl)) + " " + SSL_get_cipher_name(ssl);
+            }
+            std::string buf;
+            while (std::chrono::steady_clock::now() < deadline) {
+                size_t n = write_all(ssl, request) ? read_response(ssl, buf) : 0;
+                if (n == 0) {
+                    std::println(stderr, "{} 字节的上传失败", opts.m_bulk_size);
+                    std::exit(1);
+                }
+                received += n;
+                ++responses;
+            }
+            tls_close(ssl);
+        });
+    }
+    for (auto &t: clients) {
+        t.join();
+    }
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    double up = static_cast<double>(responses.load()) * static_cast<double>(request.size());
+    std::println("{} 次 {} 字节的上传 ({} 个连接, {}): 上行 {:.1f} MB/s, 下行 {:.1f} MB/s", responses.load(),
+                 opts.m_bulk_size, opts.m_clients, cipher, up / secs / 1e6,
+                 static_cast<double>(received.load()) / secs / 1e6);
+}
+
+int main(int argc, char **argv) {
+    tls_options opts;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        std::string_view flag = argv[i];
+        char const *value = argv[i + 1];
+        if (flag == "--host") {
+            opts.m_host = value;
+        }
+        else if (flag == "--port") {
+            opts.m_port = std::atoi(value);
+        }
+        else if (flag == "--clients") {
+            opts.m_clients = std::max(1, std::atoi(value));
+        }
+        else if (flag == "--handshakes") {
+            opts.m_handshakes = std::atoi(value);
+        }
+        else if (flag == "--resume") {
+            opts.m_resume = std::atoi(value) != 0;
+        }
+        else if (flag == "--bulk-size") {
+            opts.m_bulk_size = std::strtoul(value, nullptr, 10);
+        }
+        else if (flag == "--duration") {
+            opts.m_duration = std::atof(value);
+        }
+        else {
+            std::println(stderr, "unknown option {}", flag);
+            return 2;
+        }
+    }
+    signal(SIGPIPE, SIG_IGN);
+    SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, nullptr);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT);
+    if (opts.m_handshakes > 0) {
+        run_handshakes(ctx, opts);
+    }
+    if (opts.m_bulk_size > 0) {
+        run_bulk(ctx, opts);
+    }
+    if (opts.m_handshakes == 0 && opts.m_bulk_size == 0) {
+        std::println(stderr, "--handshakes n 或 --bulk-size bytes");
+        return 2;
+    }
+    SSL_CTX_free(ctx);
+    return 0;
+}
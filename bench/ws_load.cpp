@@ -0,0 +1,329 @@
+// WebSocket load generator for a running server, see bench/README.md.
+//
+//   idle: --idle n upgraded connections that stay silent for the whole run;
+//         with --pid p reports the server's resident memory and the
+//         kernel's TCP buffer pages per idle connection
+//   echo: --clients c connections each sending --messages m binary
+//         messages of --size bytes, --window w of them in flight; reports
+//         messages per second (the server echoes), next to the idle ones
+//
+// Loopback has about 28k ephemeral ports per source address, so the idle
+// connections are spread over 127.0.0.1, 127.0.0.2, ... (--sources).
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <print>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+struct ws_options {
+    std::string m_host = "127.0.0.1";
+    int m_port = 8080;
+    int m_idle = 0;
+    int m_sources = 0;
+    int m_clients = 4;
+    int m_messages = 100000;
+    size_t m_size = 64;
+    int m_window = 16;
+    int m_pid = 0;
+};
+
+static int connect_to(ws_options const &opts, int source) {
+    struct sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(static_cast<uint16_t>(opts.m_port));
+    inet_pton(AF_INET, opts.m_host.c_str(), &addr.sin_addr);
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (source > 0) {
+        // pick the port at connect(), per destination, not at bind()
+        int one = 1;
+        setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+        struct sockaddr_in local{};
+        local.sin_family = AF_INET;
+        local.sin_addr.s_addr = htonl(INADDR_LOOPBACK + static_cast<uint32_t>(source));
+        if (bind(fd, reinterpret_cast<struct sockaddr *>(&local), sizeof(local)) < 0) {
+            close(fd);
+            return -1;
+        }
+    }
+    if (connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+static bool write_all(int fd, std::string_view data) {
+    while (!data.empty()) {
+        ssize_t n = write(fd, data.data(), data.size());
+        if (n <= 0) {
+            return false;
+        }
+        data.remove_prefix(static_cast<size_t>(n));
+    }
+    return true;
+}
+
+// the key is fixed: the accept value is not checked, only the 101
+static bool upgrade(int fd) {
+    std::string_view const request = "GET /ws HTTP/1.1\r\nHost: bench\r\nUpgrade: websocket\r\n"
+                                     "Connection: Upgrade\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                                     "Sec-WebSocket-Version: 13\r\n\r\n";
+    if (!write_all(fd, request)) {
+        return false;
+    }
+    std::string buf;
+    char chunk[1024];
+    while (buf.find("\r\n\r\n") == std::string::npos) {
+        // the server sends nothing behind the 101, so whole chunks are safe
+        ssize_t n = read(fd, chunk, sizeof(chunk));
+        if (n <= 0) {
+            return false;
+        }
+        buf.append(chunk, static_cast<size_t>(n));
+    }
+    return buf.starts_with("HTTP/1.1 101");
+}
+
+// one masked binary client frame
+static std::string client_frame(size_t size) {
+    std::string frame;
+    frame.push_back(static_cast<char>(0x82));
+    if (size < 126) {
+        frame.push_back(static_cast<char>(0x80 | size));
+    }
+    else if (size <= 0xffff) {
+        frame.push_back(static_cast<char>(0x80 | 126));
+        frame.push_back(static_cast<char>(size >> 8));
+        frame.push_back(static_cast<char>(size));
+    }
+    else {
+        frame.push_back(static_cast<char>(0x80 | 127));
+        for (int shift = 56; shift >= 0; shift -= 8) {
+            frame.push_back(static_cast<char>(uint64_t(size) >> shift));
+        }
+    }
+    char const key[4] = {0x12, 0x34, 0x56, 0x78};
+    frame.append(key, 4);
+    for (size_t i = 0; i < size; i++) {
+        frame.push_back(static_cast<char>('x' ^ key[i % 4]));
+    }
+    return frame;
+}
+
+// consumes whole server frames from buf, returns how many
+static int take_frames(std::string &buf) {
+    int count = 0;
+    size_t pos = 0;
+    while (buf.size() - pos >= 2) {
+        auto const *p = reinterpret_cast<uint8_t const *>(buf.data() + pos);
+        uint64_t len = p[1] & 0x7f;
+        size_t header = 2;
+        if (len == 126) {
+            header = 4;
+        }
+        else if (len == 127) {
+            header = 10;
+        }
+        if (buf.size() - pos < header) {
+            break;
+        }
+        if (header == 4) {
+            len = (uint64_t(p[2]) << 8) | p[3];
+        }
+        else if (header == 10) {
+            len = 0;
+            for (int i = 0; i < 8; i++) {
+                len = (len << 8) | p[2 + i];
+            }
+        }
+        if (buf.size() - pos - header < len) {
+            break;
+        }
+        pos += header + len;
+        ++count;
+    }
+    buf.erase(0, pos);
+    return count;
+}
+
+static long status_kib(int pid, std::string_view key) {
+    if (pid == 0) {
+        return 0;
+    }
+    std::ifstream status("/proc/" + std::to_string(pid) + "/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.starts_with(key)) {
+            return std::strtol(line.c_str() + key.size(), nullptr, 10);
+        }
+    }
+    return 0;
+}
+
+// pages of socket buffers held by all TCP sockets of the host
+static long tcp_mem_pages() {
+    std::ifstream sockstat("/proc/net/sockstat");
+    std::string line;
+    while (std::getline(sockstat, line)) {
+        size_t pos = line.find(" mem ");
+        if (line.starts_with("TCP:") && pos != std::string::npos) {
+            return std::strtol(line.c_str() + pos + 5, nullptr, 10);
+        }
+    }
+    return 0;
+}
+
+static void raise_fd_limit(size_t wanted) {
+    struct rlimit lim;
+    getrlimit(RLIMIT_NOFILE, &lim);
+    lim.rlim_cur = std::min<rlim_t>(lim.rlim_max, std::max<rlim_t>(lim.rlim_cur, wanted));
+    setrlimit(RLIMIT_NOFILE, &lim);
+}
+
+static std::vector<int> open_idle(ws_options const &opts) {
+    if (opts.m_idle == 0) {
+        return {};
+    }
+    int sources = opts.m_sources ? opts.m_sources
+                : opts.m_host.starts_with("127.") ? opts.m_idle / 25000 + 1 : 0;
+    long rss = status_kib(opts.m_pid, "VmRSS:");
+    long pages = tcp_mem_pages();
+    std::vector<int> fds;
+    fds.reserve(static_cast<size_t>(opts.m_idle));
+    auto t0 = std::chrono::steady_clock::now();
+    for (int i = 0; i < opts.m_idle; i++) {
+        int fd = connect_to(opts, sources ? i % sources : 0);
+        if (fd < 0 || !upgrade(fd)) {
+            std::println(stderr, "第 {} 个空闲连接失败: {} (ulimit -n? 服务端也要调)", i, std::strerror(errno));
+            break;
+        }
+        fds.push_back(fd);
+    }
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    // let the server finish its side of the last handshakes
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    std::println("{} 个空闲连接, 建立用时 {:.1f} 秒 ({:.0f} 连接/秒)", fds.size(), secs, fds.size() / secs);
+    if (opts.m_pid && !fds.empty()) {
+        double n = static_cast<double>(fds.size());
+        std::println("  服务端每连接常驻内存 {:.0f} 字节, 内核 TCP 缓冲 {:.2f} 页 (两端合计)",
+                     static_cast<double>(status_kib(opts.m_pid, "VmRSS:") - rss) * 1024 / n,
+                     static_cast<double>(tcp_mem_pages() - pages) / n);
+    }
+    return fds;
+}
+
+static void run_echo(ws_options const &opts) {
+    std::atomic<long> received{0};
+    std::vector<std::thread> clients;
+    auto t0 = std::chrono::steady_clock::now();
+    for (int c = 0; c < opts.m_clients; c++) {
+        clients.emplace_back([&] {
+            int fd = connect_to(opts, 0);
+            if (fd < 0 || !upgrade(fd)) {
+                std::println(stderr, "echo 连接失败: {}", std::strerror(errno));
+                std::exit(1);
+            }
+            auto const frame = client_frame(opts.m_size);
+            std::string burst;
+            for (int i = 0; i < opts.m_window; i++) {
+                burst += frame;
+            }
+            int sent = 0;
+            int got = 0;
+            std::string buf;
+            char chunk[65536];
+            while (got < opts.m_messages) {
+                // top the window up in one write
+                int room = std::min(opts.m_window - (sent - got), opts.m_messages - sent);
+                if (room > 0 && !write_all(fd, std::string_view(burst).substr(0, frame.size() * room))) {
+                    break;
+                }
+                sent += std::max(room, 0);
+                ssize_t n = read(fd, chunk, sizeof(chunk));
+                if (n <= 0) {
+                    break;
+                }
+                buf.append(chunk, static_cast<size_t>(n));
+                got += take_frames(buf);
+            }
+            received += got;
+            close(fd);
+        });
+    }
+    for (auto &t: clients) {
+        t.join();
+    }
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    double messages = static_cast<double>(received.load());
+    std::println("{} 条 {} 字节的消息 ({} 个连接, 每连接 {} 条在途): {:.0f} 消息/秒, {:.1f} MB/s",
+                 received.load(), opts.m_size, opts.m_clients, opts.m_window, messages / secs,
+                 messages * static_cast<double>(opts.m_size) / secs / 1e6);
+}
+
+int main(int argc, char **argv) {
+    ws_options opts;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        std::string_view flag = argv[i];
+        char const *value = argv[i + 1];
+        if (flag == "--host") {
+            opts.m_host = value;
+        }
+        else if (flag == "--port") {
+            opts.m_port = std::atoi(value);
+        }
+        else if (flag == "--idle") {
+            opts.m_idle = std::atoi(value);
+        }
+        else if (flag == "--sources") {
+            opts.m_sources = std::atoi(value);
+        }
+        else if (flag == "--clients") {
+            opts.m_clients = std::atoi(value);
+        }
+        else if (flag == "--messages") {
+            opts.m_messages = std::atoi(value);
+        }
+        else if (flag == "--size") {
+            opts.m_size = std::strtoul(value, nullptr, 10);
+        }
+        else if (flag == "--window") {
+            opts.m_window = std::max(1, std::atoi(value));
+        }
+        else if (flag == "--pid") {
+            opts.m_pid = std::atoi(value);
+        }
+        else {
+            std::println(stderr, "unknown option {}", flag);
+            return 2;
+        }
+    }
+    raise_fd_limit(static_cast<size_t>(opts.m_idle + opts.m_clients + 64));
+    auto idle = open_idle(opts);
+    if (opts.m_clients > 0) {
+        run_echo(opts);
+    }
+    if (opts.m_pid) {
+        std::println("  服务端峰值常驻内存 {} KiB", status_kib(opts.m_pid, "VmHWM:"));
+    }
+    for (int fd: idle) {
+        close(fd);
+    }
+    return 0;
+}
@@ -2,8 +2,17 @@
 #define ADDRESS_RESOLVER_HPP
 
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <chrono>
+#include <cstddef>
+#include <cstring>
+#include <string_view>
 
 #include "exception.hpp"
 
@@ -25,6 +34,115 @@ struct address_resolver {
         }
     };
 
+    // Listener and connection tuning; the defaults keep the kernel's behaviour.
+    // Everything is best effort: options a socket type or kernel lacks are
+    // skipped, e.g. the TCP ones on Unix domain sockets.
+    struct socket_options {
+        int m_backlog = SOMAXCONN;
+        // accept() only once the client sent data, or after this long
+        std::chrono::seconds m_defer_accept{0};
+        // server-side TCP Fast Open: how many TFO handshakes may be pending;
+        // needs bit 2 of net.ipv4.tcp_fastopen
+        int m_fastopen_queue = 0;
+        bool m_nodelay = false;
+        // ACK the request at once instead of after the delayed-ACK timer;
+        // the kernel drops back to delayed ACKs later, so it only covers
+        // the start of each connection
+        bool m_quickack = false;
+        // 0: autotuned
+        int m_rcvbuf = 0;
+        int m_sndbuf = 0;
+
+        // before listen(); buffer sizes are inherited by accepted sockets
+        void apply_listener(int sockfd, int family) const {
+            if (m_rcvbuf != 0) {
+                (void)setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &m_rcvbuf, sizeof(m_rcvbuf));
+            }
+            if (m_sndbuf != 0) {
+                (void)setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &m_sndbuf, sizeof(m_sndbuf));
+            }
+            if (family != AF_INET && family != AF_INET6) {
+                return;
+            }
+            if (m_defer_accept.count() != 0) {
+                int secs = static_cast<int>(m_defer_accept.count());
+                (void)setsockopt(sockfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &secs, sizeof(secs));
+            }
+            if (m_fastopen_queue != 0) {
+                (void)setsockopt(sockfd, IPPROTO_TCP, TCP_FASTOPEN, &m_fastopen_queue, sizeof(m_fastopen_queue));
+            }
+        }
+
+        // on every accepted socket
+        void apply_connection(int connfd) const {
+            int one = 1;
+            if (m_nodelay) {
+                (void)setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            }
+            if (m_quickack) {
+                (void)setsockopt(connfd, IPPROTO_TCP, TCP_QUICKACK, &one, sizeof(one));
+            }
+        }
+
+        [[nodiscard]] bool per_connection() const {
+            return m_nodelay || m_quickack;
+        }
+    };
+
+    // AF_UNIX address of path; a leading '@' selects the Linux abstract
+    // namespace (no file, gone with the last socket bound to it)
+    static address unix_address(std::string_view path) {
+        address addr;
+        auto &un = reinterpret_cast<struct sockaddr_un &>(addr.m_addr_storage);
+        std::memset(&un, 0, sizeof(un));
+        un.sun_family = AF_UNIX;
+        if (path.empty() || path.size() >= sizeof(un.sun_path)) {
+            throw std::invalid_argument("unix socket path empty or too long");
+        }
+        std::memcpy(un.sun_path, path.data(), path.size());
+        if (path[0] == '@') {
+            un.sun_path[0] = '\0';
+            addr.m_addrlen = offsetof(struct sockaddr_un, sun_path) + path.size();
+        }
+        else {
+            addr.m_addrlen = offsetof(struct sockaddr_un, sun_path) + path.size() + 1;
+        }
+        return addr;
+    }
+
+    // A socket file left behind by a dead server would make bind() fail with
+    // EADDRINUSE; remove it, but only when nobody is listening on it anymore.
+    // Anything at the path that is not a socket (a file, a symlink) stays,
+    // and bind() reports it.
+    static void _unlink_stale_unix(address addr, std::string_view path) {
+        if (path[0] == '@') {
+            return;
+        }
+        struct stat st;
+        if (lstat(std::string(path).c_str(), &st) < 0 || !S_ISSOCK(st.st_mode)) {
+            return;
+        }
+        int probe = CHECK_CALL(socket, AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (connect(probe, &addr.m_addr, addr.m_addrlen) < 0 && errno == ECONNREFUSED) {
+            unlink(std::string(path).c_str());
+        }
+        close(probe);
+    }
+
+    static int create_unix_socket_and_bind(std::string_view path) {
+        return create_unix_socket_and_bind(path, socket_options());
+    }
+
+    static int create_unix_socket_and_bind(std::string_view path, socket_options const &opts) {
+        auto addr = unix_address(path);
+        _unlink_stale_unix(addr, path);
+        int sockfd = CHECK_CALL(socket, AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        opts.apply_listener(sockfd, AF_UNIX);
+        CHECK_CALL(bind, sockfd, &addr.m_addr, addr.m_addrlen);
+        CHECK_CALL(listen, sockfd, opts.m_backlog);
+        return sockfd;
+    }
+
     struct address_info {
         struct addrinfo *m_curr = nullptr;
 
@@ -38,13 +156,18 @@ struct address_resolver {
         }
 
         int create_socket_and_bind() const {
+            return create_socket_and_bind(socket_options());
+        }
+
+        int create_socket_and_bind(socket_options const &opts) const {
             int sockfd = create_socket();
             address_ref serve_addr = get_address();
             int on = 1;
             setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
             setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+            opts.apply_listener(sockfd, m_curr->ai_family);
             CHECK_CALL(bind, sockfd, serve_addr.m_addr, serve_addr.m_addrlen);
-            CHECK_CALL(listen, sockfd, SOMAXCONN);
+            CHECK_CALL(listen, sockfd, opts.m_backlog);
             return sockfd;
         }
 
@@ -59,8 +182,16 @@ struct address_resolver {
 
     struct addrinfo *m_head = nullptr;
 
+    int try_resolve(std::string const &name, std::string const &service) noexcept {
+        if (m_head) {
+            freeaddrinfo(m_head);
+            m_head = nullptr;
+        }
+        return getaddrinfo(name.c_str(), service.c_str(), NULL, &m_head);
+    }
+
     address_info resolve(std::string const &name, std::string const &service) {
-        int err = getaddrinfo(name.c_str(), service.c_str(), NULL, &m_head);
+        int err = try_resolve(name, service);
         if (err != 0) {
             auto ec = std::error_code(err, gai_category());
             throw std::system_error(ec, name + ":" + service);
@@ -68,6 +199,10 @@ struct address_resolver {
         return {m_head};
     }
 
+    address_info first_entry() const {
+        return {m_head};
+    }
+
     address_resolver() = default;
 
     address_resolver(address_resolver &&that) : m_head(that.m_head) {
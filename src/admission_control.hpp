@@ -0,0 +1,198 @@
+#ifndef ADMISSION_CONTROL_HPP
+#define ADMISSION_CONTROL_HPP
+
+#include <sys/timerfd.h>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <vector>
+
+#include "exception.hpp"
+#include "callback.hpp"
+#include "io_context.hpp"
+#include "async_file.hpp"
+
+// Load shedding for one io_context, driven by its turn time (see
+// io_context::turn_time: how long dispatching one batch of events takes,
+// our stand-in for queueing delay) and by the bytes all connections of the
+// process hold buffered, closed ones still pinning zero-copy sends included.
+//
+// Turn time past m_shed_turn, or bytes past m_shed_bytes: new requests get
+// a fast 503 with Retry-After, so the ones already admitted still finish in
+// time. Bytes past m_pause_bytes, turn time past m_pause_turn: stop
+// accepting and close keep-alive connections idle for m_idle_age. Either
+// state ends once its inputs fall well below the threshold.
+//
+// Running out of fds is handled apart, by back_off(): a fixed pause of one
+// tick, since nothing measured here says when an fd frees up.
+struct admission_control {
+    struct limits {
+        std::chrono::milliseconds m_shed_turn{25};
+        std::chrono::milliseconds m_pause_turn{250};
+        size_t m_pause_bytes = 192 * 1024 * 1024;
+        size_t m_shed_bytes = 256 * 1024 * 1024;
+        // one request (header + body) may not buffer more than this: 413
+        size_t m_conn_bytes = 8 * 1024 * 1024;
+        std::chrono::milliseconds m_idle_age{1000};
+        std::chrono::milliseconds m_tick{50};
+    };
+
+    // bytes buffered by connections of all threads
+    inline static std::atomic<size_t> g_buffered{0};
+
+    inline static thread_local admission_control *g_instance = nullptr;
+
+    limits m_limits;
+    bool m_shedding = false;
+    bool m_paused = false;
+    async_file m_timer;
+    uint64_t m_expirations = 0;
+    bool m_ticking = false;
+    std::vector<callback<>> m_on_resume;
+    std::vector<callback<>> m_on_backoff;
+    callback<> m_on_pressure;
+
+    admission_control() {
+        g_instance = this;
+    }
+
+    explicit admission_control(limits const &lim) : m_limits(lim) {
+        g_instance = this;
+    }
+
+    admission_control(admission_control &&) = delete;
+
+    ~admission_control() {
+        g_instance = nullptr;
+    }
+
+    static admission_control &get() {
+        assert(g_instance);
+        return *g_instance;
+    }
+
+    static void charge(size_t old_bytes, size_t new_bytes) {
+        if (new_bytes > old_bytes) {
+            g_buffered.fetch_add(new_bytes - old_bytes, std::memory_order_relaxed);
+        }
+        else if (old_bytes > new_bytes) {
+            g_buffered.fetch_sub(old_bytes - new_bytes, std::memory_order_relaxed);
+        }
+    }
+
+    // runs when accepting pauses and on every tick while paused, meant to
+    // shut down idle keep-alive connections
+    void on_pressure(callback<> cb) {
+        m_on_pressure = std::move(cb);
+    }
+
+    // at or above the limit: on; below half of it: off; in between: unchanged
+    template <class T>
+    static bool _hysteresis(bool on, T value, T limit) {
+        if (value >= limit) {
+            return true;
+        }
+        if (value < limit / 2) {
+            return false;
+        }
+        return on;
+    }
+
+    void update() {
+        auto turn = io_context::get().turn_time();
+        size_t bytes = g_buffered.load(std::memory_order_relaxed)
+                     + zerocopy_tracker::g_lingering_bytes.load(std::memory_order_relaxed);
+        m_shedding = _hysteresis(m_shedding, turn, std::chrono::nanoseconds(m_limits.m_shed_turn))
+                  || bytes >= m_limits.m_shed_bytes;
+        bool paused = _hysteresis(m_paused, turn, std::chrono::nanoseconds(m_limits.m_pause_turn))
+                   || _hysteresis(m_paused, bytes, m_limits.m_pause_bytes);
+        if (paused && !m_paused) {
+            m_paused = true;
+            if (m_on_pressure.m_base) {
+                m_on_pressure();
+            }
+            _start_ticking();
+        }
+        else if (!paused && m_paused) {
+            m_paused = false;
+        }
+        if (!m_paused && !m_on_resume.empty()) {
+            auto resumes = std::move(m_on_resume);
+            m_on_resume.clear();
+            for (auto &resume: resumes) {
+                io_context::get().defer(std::move(resume));
+            }
+        }
+    }
+
+    [[nodiscard]] bool accepting() {
+        update();
+        return !m_paused;
+    }
+
+    [[nodiscard]] bool shedding() {
+        update();
+        return m_shedding;
+    }
+
+    // an acceptor that paused itself, resumed once accepting is allowed again
+    void wait_for_resume(callback<> resume) {
+        m_on_resume.push_back(std::move(resume));
+        _start_ticking();
+    }
+
+    // after EMFILE and friends: resumed by the next tick and nothing else, so
+    // requests calling update() meanwhile cannot turn it into a busy loop
+    void back_off(callback<> resume) {
+        m_on_backoff.push_back(std::move(resume));
+        _start_ticking();
+    }
+
+    // while paused, re-evaluate periodically: with accept stopped and
+    // connections idle nothing else would wake the loop to notice recovery
+    void _start_ticking() {
+        if (m_ticking) {
+            return;
+        }
+        if (m_timer.m_fd == -1) {
+            int tfd = CHECK_CALL(timerfd_create, CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+            m_timer = async_file::async_wrap(tfd);
+        }
+        auto tick = std::chrono::duration_cast<std::chrono::nanoseconds>(m_limits.m_tick).count();
+        struct itimerspec spec{};
+        spec.it_value.tv_sec = tick / 1000000000;
+        spec.it_value.tv_nsec = tick % 1000000000;
+        spec.it_interval = spec.it_value;
+        CHECK_CALL(timerfd_settime, m_timer.m_fd, 0, &spec, nullptr);
+        m_ticking = true;
+        _do_tick();
+    }
+
+    void _do_tick() {
+        bytes_view buf{reinterpret_cast<char *>(&m_expirations), sizeof(m_expirations)};
+        return m_timer.async_read(buf, [this] (exception<size_t> ret) {
+            if (ret.error()) {
+                m_ticking = false;
+                return;
+            }
+            update();
+            auto backoffs = std::move(m_on_backoff);
+            m_on_backoff.clear();
+            for (auto &resume: backoffs) {
+                resume();
+            }
+            if (!m_paused && m_on_resume.empty() && m_on_backoff.empty()) {
+                struct itimerspec spec{};
+                CHECK_CALL(timerfd_settime, m_timer.m_fd, 0, &spec, nullptr);
+                m_ticking = false;
+                return;
+            }
+            if (m_paused && m_on_pressure.m_base) {
+                m_on_pressure();
+            }
+            return _do_tick();
+        });
+    }
+};
+
+#endif
@@ -3,19 +3,53 @@
 
 #include <fcntl.h>
 #include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <netinet/in.h>
+#include <memory>
+#include <utility>
 
 #include "exception.hpp"
 #include "bytes_buffer.hpp"
 #include "callback.hpp"
 #include "io_context.hpp"
 #include "address_resolver.hpp"
+#include "tls_context.hpp"
+#include "trace.hpp"
+#include "memory_pipe.hpp"
+#include "zerocopy.hpp"
 
 struct async_file {
     int m_fd = -1;
+    uint64_t m_turn = 0;
+    size_t m_turn_ops = 0;
+    size_t m_turn_bytes = 0;
+#ifdef CO_HTTP_TLS
+    // set once async_tls_accept succeeded; reads always go through OpenSSL
+    // (it handles non-data records, also under kTLS), writes only without kTLS TX
+    SSL *m_ssl = nullptr;
+    bool m_ktls_send = false;
+    bool m_ktls_recv = false;
+#endif
+    // in-process transport instead of m_fd (which stays -1), see memory_socketpair
+    std::unique_ptr<memory_endpoint> m_mem;
+    // set by enable_zerocopy, see async_send_zerocopy
+    std::unique_ptr<zerocopy_tracker> m_zerocopy;
 
     async_file() = default;
     explicit async_file(int fd) : m_fd(fd) {}
 
+    // two connected ends driven by the current io_context without the kernel,
+    // for replaying traffic through the HTTP stack deterministically
+    static std::pair<async_file, async_file> memory_socketpair() {
+        auto a_to_b = std::make_shared<memory_pipe>();
+        auto b_to_a = std::make_shared<memory_pipe>();
+        async_file a, b;
+        a.m_mem = std::make_unique<memory_endpoint>(b_to_a, a_to_b);
+        b.m_mem = std::make_unique<memory_endpoint>(a_to_b, b_to_a);
+        return {std::move(a), std::move(b)};
+    }
+
     static async_file async_wrap(int fd) {
         int flags = CHECK_CALL(fcntl, fd, F_GETFL);
         flags |= O_NONBLOCK;
@@ -29,43 +63,362 @@ struct async_file {
         return async_file{fd};
     }
 
+    // false once this file used up its io_context::budget for the current turn
+    bool _take_budget() {
+        auto &ctx = io_context::get();
+        if (m_turn != ctx.m_turn) {
+            m_turn = ctx.m_turn;
+            m_turn_ops = 0;
+            m_turn_bytes = 0;
+        }
+        if (m_turn_ops >= ctx.m_budget.m_ops || m_turn_bytes >= ctx.m_budget.m_bytes) {
+            return false;
+        }
+        ++m_turn_ops;
+        return true;
+    }
+
+    void _wait(uint32_t events, callback<> resume) {
+        if (m_mem) {
+            if (events & EPOLLIN) {
+                return m_mem->m_in->wait_read(std::move(resume));
+            }
+            return m_mem->m_out->wait_write(std::move(resume));
+        }
+        // queued zero-copy completions raise EPOLLERR, which would end
+        // every wait at once until they are read
+        if (m_zerocopy && m_zerocopy->in_flight()) {
+            m_zerocopy->reap(m_fd);
+        }
+        struct epoll_event event;
+        event.events = events | EPOLLET | EPOLLONESHOT;
+        event.data.ptr = resume.leak_address();
+        CHECK_CALL(epoll_ctl, io_context::get().m_epfd, EPOLL_CTL_MOD, m_fd, &event);
+    }
+
+#ifdef CO_HTTP_TLS
+    // SSL_get_error() as -errno; -EAGAIN / -EWOULDBLOCK mean wait for EPOLLIN / EPOLLOUT
+    exception<size_t> _tls_error(int ret) {
+        switch (SSL_get_error(m_ssl, ret)) {
+        case SSL_ERROR_WANT_READ:
+            return -EAGAIN;
+        case SSL_ERROR_WANT_WRITE:
+            return -EINPROGRESS;
+        case SSL_ERROR_ZERO_RETURN:
+            return 0;
+        case SSL_ERROR_SYSCALL:
+            ERR_clear_error();
+            return errno != 0 ? -errno : -ECONNRESET;
+        default:
+            ERR_clear_error();
+            return -EPROTO;
+        }
+    }
+
+    // server side handshake on an already wrapped socket, then try kTLS
+    void async_tls_accept(tls_context const &tls, callback<exception<int>> cb) {
+        if (!m_ssl) {
+            m_ssl = tls.new_session(m_fd);
+        }
+        ERR_clear_error();
+        errno = 0;
+        int ret = SSL_do_handshake(m_ssl);
+        if (ret == 1) {
+            m_ktls_send = BIO_get_ktls_send(SSL_get_wbio(m_ssl));
+            m_ktls_recv = BIO_get_ktls_recv(SSL_get_rbio(m_ssl));
+            return cb(0);
+        }
+        auto err = _tls_error(ret);
+        if (!err.is_error(EAGAIN) && !err.is_error(EINPROGRESS)) {
+            return cb(err.error() ? -err.error() : -ECONNRESET);
+        }
+        return _wait(err.is_error(EAGAIN) ? EPOLLIN : EPOLLOUT,
+                     [this, &tls, cb = std::move(cb)] () mutable {
+            return async_tls_accept(tls, std::move(cb));
+        });
+    }
+
+    // ALPN result, empty when none was negotiated
+    std::string_view tls_alpn() const {
+        if (!m_ssl) {
+            return {};
+        }
+        unsigned char const *proto = nullptr;
+        unsigned int len = 0;
+        SSL_get0_alpn_selected(m_ssl, &proto, &len);
+        return {reinterpret_cast<char const *>(proto), len};
+    }
+
+    void _tls_read(bytes_view buf, callback<exception<size_t>> cb) {
+        size_t n = 0;
+        ERR_clear_error();
+        errno = 0;
+        exception<size_t> ret = SSL_read_ex(m_ssl, buf.data(), buf.size(), &n) == 1
+            ? exception<size_t>(n) : _tls_error(0);
+        if (ret.is_error(EAGAIN) || ret.is_error(EINPROGRESS)) {
+            TRACE_EVENT("eagain_read", m_fd, 0);
+            return _wait(ret.is_error(EAGAIN) ? EPOLLIN : EPOLLOUT,
+                         [this, buf, cb = std::move(cb)] () mutable {
+                TRACE_EVENT("resume", m_fd, 0);
+                return async_read(buf, std::move(cb));
+            });
+        }
+        if (!ret.error()) {
+            m_turn_bytes += ret.value_unsafe();
+        }
+        TRACE_EVENT("read", m_fd, ret.m_res);
+        TRACE_CONN(m_fd);
+        return cb(ret);
+    }
+
+    void _tls_write(bytes_const_view buf, callback<exception<size_t>> cb) {
+        size_t n = 0;
+        ERR_clear_error();
+        errno = 0;
+        exception<size_t> ret = SSL_write_ex(m_ssl, buf.data(), buf.size(), &n) == 1
+            ? exception<size_t>(n) : _tls_error(0);
+        if (ret.is_error(EAGAIN) || ret.is_error(EINPROGRESS)) {
+            TRACE_EVENT("eagain_write", m_fd, 0);
+            return _wait(ret.is_error(EAGAIN) ? EPOLLIN : EPOLLOUT,
+                         [this, buf, cb = std::move(cb)] () mutable {
+                TRACE_EVENT("resume", m_fd, 0);
+                return async_write(buf, std::move(cb));
+            });
+        }
+        if (!ret.error()) {
+            m_turn_bytes += ret.value_unsafe();
+        }
+        TRACE_EVENT("write", m_fd, ret.m_res);
+        return cb(ret);
+    }
+#endif
+
     void async_read(bytes_view buf, callback<exception<size_t>> cb) {
-        auto ret = convert_error<size_t>(read(m_fd, buf.data(), buf.size()));
+        if (!_take_budget()) {
+            return io_context::get().defer([this, buf, cb = std::move(cb)] () mutable {
+                return async_read(buf, std::move(cb));
+            });
+        }
+
+#ifdef CO_HTTP_TLS
+        if (m_ssl) {
+            return _tls_read(buf, std::move(cb));
+        }
+#endif
+
+        auto ret = m_mem ? m_mem->m_in->read(buf)
+                         : convert_error<size_t>(read(m_fd, buf.data(), buf.size()));
 
         if (!ret.is_error(EAGAIN)) {
+            if (!ret.error()) {
+                m_turn_bytes += ret.value_unsafe();
+            }
+            TRACE_EVENT("read", m_fd, ret.m_res);
+            TRACE_CONN(m_fd);
             cb(ret);
             return;
         }
 
-        callback<> resume = [this, buf, cb = std::move(cb)] () mutable {
+        TRACE_EVENT("eagain_read", m_fd, 0);
+        return _wait(EPOLLIN, [this, buf, cb = std::move(cb)] () mutable {
+            TRACE_EVENT("resume", m_fd, 0);
             return async_read(buf, std::move(cb));
-        };
-
-        struct epoll_event event;
-        event.events = EPOLLIN | EPOLLET | EPOLLONESHOT;
-        event.data.ptr = resume.leak_address();
-        CHECK_CALL(epoll_ctl, io_context::get().m_epfd, EPOLL_CTL_MOD, m_fd, &event);
+        });
     }
 
-    void async_write(bytes_const_view buf, callback<exception<size_t>> cb) {
-        auto ret = convert_error<size_t>(write(m_fd, buf.data(), buf.size()));
+    // more: MSG_MORE on sockets, buf is held back to leave with the next write
+    void async_write(bytes_const_view buf, callback<exception<size_t>> cb, bool more = false) {
+        if (!_take_budget()) {
+            return io_context::get().defer([this, buf, cb = std::move(cb), more] () mutable {
+                return async_write(buf, std::move(cb), more);
+            });
+        }
+
+#ifdef CO_HTTP_TLS
+        // with kTLS TX the kernel encrypts, so write(2) (and sendfile) just work
+        if (m_ssl && !m_ktls_send) {
+            return _tls_write(buf, std::move(cb));
+        }
+#endif
+
+        auto ret = m_mem ? m_mem->m_out->write(buf)
+                 : more ? convert_error<size_t>(send(m_fd, buf.data(), buf.size(), MSG_MORE))
+                         : convert_error<size_t>(write(m_fd, buf.data(), buf.size()));
 
         if (!ret.is_error(EAGAIN)) {
+            if (!ret.error()) {
+                m_turn_bytes += ret.value_unsafe();
+            }
+            TRACE_EVENT("write", m_fd, ret.m_res);
             cb(ret);
             return;
         }
 
-        callback<> resume = [this, buf, cb = std::move(cb)] () mutable {
+        TRACE_EVENT("eagain_write", m_fd, 0);
+        return _wait(EPOLLOUT, [this, buf, cb = std::move(cb), more] () mutable {
+            TRACE_EVENT("resume", m_fd, 0);
+            return async_write(buf, std::move(cb), more);
+        });
+    }
+
+    // Opt in to MSG_ZEROCOPY sends; false for transports that cannot (memory
+    // pipes, TLS in user space or kTLS, AF_UNIX). Decided once per file.
+    bool enable_zerocopy() {
+        if (!m_zerocopy) {
+            m_zerocopy = std::make_unique<zerocopy_tracker>();
+            bool tls = false;
+#ifdef CO_HTTP_TLS
+            tls = m_ssl != nullptr;
+#endif
+            m_zerocopy->m_enabled = !m_mem && !tls && zerocopy_tracker::enable(m_fd);
+        }
+        return m_zerocopy->m_enabled;
+    }
+
+    // Like async_write, but the kernel sends from buf's pages instead of
+    // copying them; pin owns buf and is kept until the kernel is done, which
+    // may be long after cb. Falls back to a plain write when zero-copy is off,
+    // turned itself off (see zerocopy_tracker), or out of notification memory.
+    void async_send_zerocopy(bytes_const_view buf, std::shared_ptr<void const> pin,
+                             callback<exception<size_t>> cb) {
+        if (!m_zerocopy || !m_zerocopy->m_enabled) {
+            return async_write(buf, std::move(cb));
+        }
+        if (!_take_budget()) {
+            return io_context::get().defer([this, buf, pin = std::move(pin), cb = std::move(cb)] () mutable {
+                return async_send_zerocopy(buf, std::move(pin), std::move(cb));
+            });
+        }
+
+        auto ret = convert_error<size_t>(send(m_fd, buf.data(), buf.size(), MSG_ZEROCOPY));
+
+        if (ret.is_error(ENOBUFS)) {
+            zerocopy_tracker::g_fallbacks.fetch_add(1, std::memory_order_relaxed);
             return async_write(buf, std::move(cb));
-        };
+        }
+        if (!ret.is_error(EAGAIN)) {
+            if (!ret.error()) {
+                m_turn_bytes += ret.value_unsafe();
+                m_zerocopy->sent(std::move(pin), ret.value_unsafe());
+            }
+            TRACE_EVENT("write_zerocopy", m_fd, ret.m_res);
+            cb(ret);
+            return;
+        }
+
+        TRACE_EVENT("eagain_write", m_fd, 0);
+        return _wait(EPOLLOUT, [this, buf, pin = std::move(pin), cb = std::move(cb)] () mutable {
+            TRACE_EVENT("resume", m_fd, 0);
+            return async_send_zerocopy(buf, std::move(pin), std::move(cb));
+        });
+    }
 
+    // A closed file whose zero-copy sends are still in flight: the socket
+    // stays open, owned by the io_context's epoll set, until the kernel has
+    // released every pinned buffer; its EPOLLERR wakeups reap the completions.
+    // A peer that stops reading would keep it there, so after
+    // zerocopy_tracker::k_linger_timeout the socket is reset and closed.
+    // Meanwhile its pinned bytes count as buffered for admission_control.
+    struct _zerocopy_linger : std::enable_shared_from_this<_zerocopy_linger> {
+        int m_fd = -1;
+        int m_timer = -1;
+        std::unique_ptr<zerocopy_tracker> m_zerocopy;
+        size_t m_charged = 0;
+        bool m_expired = false;
+
+        void _charge(size_t bytes) {
+            if (bytes > m_charged) {
+                zerocopy_tracker::g_lingering_bytes.fetch_add(bytes - m_charged, std::memory_order_relaxed);
+            }
+            else {
+                zerocopy_tracker::g_lingering_bytes.fetch_sub(m_charged - bytes, std::memory_order_relaxed);
+            }
+            m_charged = bytes;
+        }
+
+        // EPOLLERR with completions, or EPOLLHUP once _on_timer shut it down
+        void _on_socket() {
+            auto &ctx = io_context::get();
+            if (!m_expired) {
+                m_zerocopy->reap(m_fd);
+                if (m_zerocopy->in_flight()) {
+                    _charge(m_zerocopy->m_pinned_bytes);
+                    callback<> resume([self = shared_from_this()] {
+                        return self->_on_socket();
+                    });
+                    struct epoll_event event;
+                    event.events = EPOLLET | EPOLLONESHOT;
+                    event.data.ptr = resume.leak_address();
+                    epoll_ctl(ctx.m_epfd, EPOLL_CTL_MOD, m_fd, &event);
+                    return;
+                }
+            }
+            epoll_ctl(ctx.m_epfd, EPOLL_CTL_DEL, m_fd, nullptr);
+            close(m_fd);
+            m_fd = -1;
+            // the kernel has let go of the pages, or dropped them with the reset
+            m_zerocopy.reset();
+            _charge(0);
+            zerocopy_tracker::g_lingering.fetch_sub(1, std::memory_order_relaxed);
+            if (m_timer != -1) {
+                // fire the timer now, so that its callback lets go of us
+                struct itimerspec spec{};
+                spec.it_value.tv_nsec = 1;
+                (void)timerfd_settime(m_timer, 0, &spec, nullptr);
+            }
+        }
+
+        void _on_timer() {
+            epoll_ctl(io_context::get().m_epfd, EPOLL_CTL_DEL, m_timer, nullptr);
+            close(m_timer);
+            m_timer = -1;
+            if (m_fd == -1) {
+                return;
+            }
+            // close() will send RST and drop the unsent data; shutting both
+            // directions down first raises EPOLLHUP, which runs _on_socket
+            zerocopy_tracker::g_linger_timeouts.fetch_add(1, std::memory_order_relaxed);
+            m_expired = true;
+            struct linger reset{1, 0};
+            (void)setsockopt(m_fd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+            shutdown(m_fd, SHUT_RDWR);
+        }
+    };
+
+    static void _linger_zerocopy(int fd, std::unique_ptr<zerocopy_tracker> zerocopy) noexcept {
+        auto linger = std::make_shared<_zerocopy_linger>();
+        linger->m_fd = fd;
+        linger->m_zerocopy = std::move(zerocopy);
+        zerocopy_tracker::g_lingering.fetch_add(1, std::memory_order_relaxed);
+        int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (tfd == -1) {
+            // no timer, no waiting: reset now
+            struct linger reset{1, 0};
+            (void)setsockopt(fd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+            linger->m_expired = true;
+            return linger->_on_socket();
+        }
+        linger->m_timer = tfd;
+        struct itimerspec spec{};
+        spec.it_value.tv_sec = zerocopy_tracker::k_linger_timeout.count();
+        timerfd_settime(tfd, 0, &spec, nullptr);
+        callback<> expire([linger] {
+            return linger->_on_timer();
+        });
         struct epoll_event event;
-        event.events = EPOLLOUT | EPOLLET | EPOLLONESHOT;
-        event.data.ptr = resume.leak_address();
-        CHECK_CALL(epoll_ctl, io_context::get().m_epfd, EPOLL_CTL_MOD, m_fd, &event);
+        event.events = EPOLLIN | EPOLLET | EPOLLONESHOT;
+        event.data.ptr = expire.leak_address();
+        epoll_ctl(io_context::get().m_epfd, EPOLL_CTL_ADD, tfd, &event);
+        return linger->_on_socket();
     }
 
     void async_accept(address_resolver::address &addr, callback<exception<int>> cb) {
+        if (!_take_budget()) {
+            return io_context::get().defer([this, &addr, cb = std::move(cb)] () mutable {
+                return async_accept(addr, std::move(cb));
+            });
+        }
+
         auto ret = convert_error<int>(accept(m_fd, &addr.m_addr, &addr.m_addrlen));
 
         if (!ret.is_error(EAGAIN)) {
@@ -73,31 +426,96 @@ struct async_file {
             return;
         }
 
-        callback<> resume = [this, &addr, cb = std::move(cb)] () mutable {
+        return _wait(EPOLLIN, [this, &addr, cb = std::move(cb)] () mutable {
             return async_accept(addr, std::move(cb));
-        };
-
-        struct epoll_event event;
-        event.events = EPOLLIN | EPOLLET | EPOLLONESHOT;
-        event.data.ptr = resume.leak_address();
-        CHECK_CALL(epoll_ctl, io_context::get().m_epfd, EPOLL_CTL_MOD, m_fd, &event);
+        });
     }
 
-    async_file(async_file &&that) noexcept : m_fd(that.m_fd) {
+    async_file(async_file &&that) noexcept : m_fd(that.m_fd), m_mem(std::move(that.m_mem)),
+                                             m_zerocopy(std::move(that.m_zerocopy)) {
         that.m_fd = -1;
+#ifdef CO_HTTP_TLS
+        m_ssl = std::exchange(that.m_ssl, nullptr);
+        m_ktls_send = that.m_ktls_send;
+        m_ktls_recv = that.m_ktls_recv;
+#endif
     }
 
     async_file &operator=(async_file &&that) noexcept {
         std::swap(m_fd, that.m_fd);
+        std::swap(m_mem, that.m_mem);
+        std::swap(m_zerocopy, that.m_zerocopy);
+#ifdef CO_HTTP_TLS
+        std::swap(m_ssl, that.m_ssl);
+        std::swap(m_ktls_send, that.m_ktls_send);
+        std::swap(m_ktls_recv, that.m_ktls_recv);
+#endif
         return *this;
     }
 
+    // the peer is on this host: a loopback address, a Unix socket or an
+    // in-process memory pipe
+    bool peer_is_local() const {
+        if (m_mem) {
+            return true;
+        }
+        struct sockaddr_storage addr{};
+        socklen_t len = sizeof(addr);
+        if (getpeername(m_fd, reinterpret_cast<struct sockaddr *>(&addr), &len) < 0) {
+            return false;
+        }
+        if (addr.ss_family == AF_UNIX) {
+            return true;
+        }
+        if (addr.ss_family == AF_INET) {
+            auto &in = reinterpret_cast<struct sockaddr_in const &>(addr);
+            return (ntohl(in.sin_addr.s_addr) >> 24) == 127;
+        }
+        if (addr.ss_family == AF_INET6) {
+            auto &a = reinterpret_cast<struct sockaddr_in6 const &>(addr).sin6_addr;
+            return IN6_IS_ADDR_LOOPBACK(&a) || (IN6_IS_ADDR_V4MAPPED(&a) && a.s6_addr[12] == 127);
+        }
+        return false;
+    }
+
+    // Half-close: no more bytes from us. Under TLS the close_notify alert goes
+    // first, so the peer can tell the end of the stream from a truncation.
+    void shutdown_write() {
+#ifdef CO_HTTP_TLS
+        if (m_ssl && SSL_is_init_finished(m_ssl)) {
+            SSL_shutdown(m_ssl);
+            ERR_clear_error();
+        }
+#endif
+        if (m_mem) {
+            m_mem->m_out->close_writer();
+            return;
+        }
+        ::shutdown(m_fd, SHUT_WR);
+    }
+
     ~async_file() {
+#ifdef CO_HTTP_TLS
+        if (m_ssl) {
+            // best-effort close_notify, never waits on a non-blocking socket
+            if (SSL_is_init_finished(m_ssl)) {
+                SSL_shutdown(m_ssl);
+            }
+            SSL_free(m_ssl);
+            ERR_clear_error();
+        }
+#endif
         if (m_fd == -1) {
             return;
         }
-        close(m_fd);
+        if (m_zerocopy && m_zerocopy->in_flight()) {
+            _linger_zerocopy(m_fd, std::move(m_zerocopy));
+            return;
+        }
+        // deregister first: if the fd was dup'ed or passed to another process,
+        // close() alone leaves it in the epoll set
         epoll_ctl(io_context::get().m_epfd, EPOLL_CTL_DEL, m_fd, nullptr);
+        close(m_fd);
     }
 };
 
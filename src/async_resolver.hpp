@@ -0,0 +1,235 @@
+#ifndef ASYNC_RESOLVER_HPP
+#define ASYNC_RESOLVER_HPP
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "address_resolver.hpp"
+#include "callback.hpp"
+#include "io_context.hpp"
+
+// getaddrinfo on up to m_max_workers helper threads, so one slow name does not
+// hold up the others; completions resume on the caller's io_context.
+// The cache is only touched from that io_context's thread, so it needs no lock.
+// getaddrinfo does not report record TTLs, so entries live for a fixed positive
+// or negative ttl; lookups of a name already in flight join the pending query.
+// Expired entries are purged as lookups come in, and past m_max_entries the
+// least recently used completed entry goes first.
+//
+// Destroying the resolver waits for the lookups the helpers are in, and
+// completes every waiter still pending with operation_canceled on the next
+// loop turn; results the helpers posted afterwards are dropped.
+struct async_resolver {
+    using clock = std::chrono::steady_clock;
+    using result = std::shared_ptr<address_resolver const>;
+    using resolve_callback = callback<std::error_code, result>;
+    // runs on the helper thread; returns 0 or an EAI_* code like getaddrinfo
+    using lookup_function = int (*)(std::string const &name, std::string const &service, address_resolver &out);
+
+    struct _entry {
+        bool m_pending = true;
+        clock::time_point m_expires;
+        std::error_code m_error;
+        result m_result;
+        std::vector<resolve_callback> m_waiters;
+        // completed entries only, in m_lru
+        std::list<std::string>::iterator m_lru_pos;
+    };
+
+    struct _job {
+        std::string m_name;
+        std::string m_service;
+        std::string m_key;
+    };
+
+    inline static thread_local async_resolver *g_instance = nullptr;
+
+    io_context &m_ctx;
+    clock::duration m_ttl;
+    clock::duration m_negative_ttl;
+    size_t m_max_entries = 4096;
+    size_t m_max_workers = 4;
+    lookup_function m_lookup = &_getaddrinfo;
+    std::map<std::string, _entry> m_cache;
+    // keys of completed entries, most recently used first
+    std::list<std::string> m_lru;
+    clock::time_point m_next_purge;
+    // posted completions hold a weak reference: expired once we are gone
+    std::shared_ptr<async_resolver *> m_alive = std::make_shared<async_resolver *>(this);
+
+    std::mutex m_jobs_mutex;
+    std::condition_variable m_jobs_cv;
+    std::deque<_job> m_jobs;
+    bool m_stopped = false;
+    // helpers waiting for a job; another is started only when none is
+    size_t m_idle = 0;
+    std::vector<std::thread> m_workers;
+
+    explicit async_resolver(clock::duration ttl = std::chrono::seconds(30),
+                            clock::duration negative_ttl = std::chrono::seconds(5))
+        : m_ctx(io_context::get()), m_ttl(ttl), m_negative_ttl(negative_ttl) {
+        g_instance = this;
+    }
+
+    async_resolver(async_resolver &&) = delete;
+
+    // the resolver of the calling thread's loop
+    static async_resolver &get() {
+        assert(g_instance);
+        return *g_instance;
+    }
+
+    static int _getaddrinfo(std::string const &name, std::string const &service, address_resolver &out) {
+        return out.try_resolve(name, service);
+    }
+
+    void async_resolve(std::string const &name, std::string const &service, resolve_callback cb) {
+        std::string key = name + ":" + service;
+        auto now = clock::now();
+        auto it = m_cache.find(key);
+        if (it != m_cache.end()) {
+            auto &entry = it->second;
+            if (entry.m_pending) {
+                entry.m_waiters.push_back(std::move(cb));
+                return;
+            }
+            if (now < entry.m_expires) {
+                m_lru.splice(m_lru.begin(), m_lru, entry.m_lru_pos);
+                return cb(entry.m_error, entry.m_result);
+            }
+            _erase(it);
+        }
+        if (now >= m_next_purge) {
+            purge();
+            m_next_purge = now + m_negative_ttl;
+        }
+        if (m_cache.size() >= m_max_entries) {
+            _evict_one();
+        }
+
+        m_cache[key].m_waiters.push_back(std::move(cb));
+        {
+            std::lock_guard lock(m_jobs_mutex);
+            m_jobs.push_back({name, service, std::move(key)});
+            if (m_idle < m_jobs.size() && m_workers.size() < m_max_workers) {
+                m_workers.emplace_back([this] { _worker_main(); });
+            }
+        }
+        m_jobs_cv.notify_one();
+    }
+
+    // drop expired entries; pending lookups are kept
+    void purge() {
+        auto now = clock::now();
+        for (auto it = m_cache.begin(); it != m_cache.end(); ) {
+            auto next = std::next(it);
+            if (!it->second.m_pending && it->second.m_expires <= now) {
+                _erase(it);
+            }
+            it = next;
+        }
+    }
+
+    void _erase(std::map<std::string, _entry>::iterator it) {
+        if (!it->second.m_pending) {
+            m_lru.erase(it->second.m_lru_pos);
+        }
+        m_cache.erase(it);
+    }
+
+    // the least recently used completed entry; pending ones stay
+    void _evict_one() {
+        if (m_lru.empty()) {
+            return;
+        }
+        _erase(m_cache.find(m_lru.back()));
+    }
+
+    void _worker_main() {
+        while (true) {
+            _job job;
+            {
+                std::unique_lock lock(m_jobs_mutex);
+                ++m_idle;
+                m_jobs_cv.wait(lock, [this] { return m_stopped || !m_jobs.empty(); });
+                --m_idle;
+                if (m_stopped) {
+                    return;
+                }
+                job = std::move(m_jobs.front());
+                m_jobs.pop_front();
+            }
+
+            auto resolver = std::make_shared<address_resolver>();
+            std::error_code ec;
+            int err = m_lookup(job.m_name, job.m_service, *resolver);
+            if (err == EAI_SYSTEM) {
+                ec = std::error_code(errno, std::system_category());
+            }
+            else if (err != 0) {
+                ec = std::error_code(err, gai_category());
+            }
+            if (ec) {
+                resolver.reset();
+            }
+
+            m_ctx.post([alive = std::weak_ptr(m_alive), key = std::move(job.m_key), ec,
+                        resolver = std::move(resolver)] () mutable {
+                if (auto self = alive.lock()) {
+                    (*self)->_complete(key, ec, std::move(resolver));
+                }
+            });
+        }
+    }
+
+    void _complete(std::string const &key, std::error_code ec, result res) {
+        auto it = m_cache.find(key);
+        if (it == m_cache.end()) {
+            return;
+        }
+        auto &entry = it->second;
+        entry.m_pending = false;
+        entry.m_lru_pos = m_lru.insert(m_lru.begin(), key);
+        entry.m_expires = clock::now() + (ec ? m_negative_ttl : m_ttl);
+        entry.m_error = ec;
+        entry.m_result = res;
+        auto waiters = std::move(entry.m_waiters);
+        entry.m_waiters.clear();
+        for (auto &cb: waiters) {
+            cb(ec, res);
+        }
+    }
+
+    ~async_resolver() {
+        {
+            std::lock_guard lock(m_jobs_mutex);
+            m_stopped = true;
+        }
+        m_jobs_cv.notify_all();
+        for (auto &worker: m_workers) {
+            worker.join();
+        }
+        m_alive.reset();
+        auto canceled = std::make_error_code(std::errc::operation_canceled);
+        for (auto &[key, entry]: m_cache) {
+            for (auto &cb: entry.m_waiters) {
+                m_ctx.defer([cb = std::move(cb), canceled] {
+                    return cb(canceled, nullptr);
+                });
+            }
+        }
+        if (g_instance == this) {
+            g_instance = nullptr;
+        }
+    }
+};
+
+#endif
@@ -1,11 +1,13 @@
 #ifndef BYTES_BUFFER_HPP
 #define BYTES_BUFFER_HPP
 
+#include <algorithm>
 #include <cstddef>
 #include <stdexcept>
 #include <string_view>
 #include <vector>
 #include <array>
+#include <memory_resource>
 
 struct bytes_const_view {
     char const *m_data;
@@ -82,7 +84,7 @@ struct bytes_view {
 };
 
 struct bytes_buffer {
-    std::vector<char> m_data;
+    std::pmr::vector<char> m_data;
 
     bytes_buffer() = default;
     bytes_buffer(bytes_buffer &&) = default;
@@ -90,6 +92,7 @@ struct bytes_buffer {
     bytes_buffer &operator=(bytes_buffer &) = default;
     explicit bytes_buffer(bytes_buffer const &) = default;
     explicit bytes_buffer(size_t n) : m_data(n) {}
+    explicit bytes_buffer(std::pmr::memory_resource *mr) : m_data(mr) {}
 
     char const *data() const noexcept {
         return m_data.data();
@@ -163,6 +166,28 @@ struct bytes_buffer {
     void reserve(size_t n) {
         m_data.reserve(n);
     }
+
+    // replace len bytes at pos with chunk
+    void splice(size_t pos, size_t len, std::string_view chunk) {
+        auto at = m_data.begin() + pos;
+        size_t common = std::min(len, chunk.size());
+        std::copy_n(chunk.begin(), common, at);
+        if (len > common) {
+            m_data.erase(at + common, at + len);
+        }
+        else {
+            m_data.insert(at + common, chunk.begin() + common, chunk.end());
+        }
+    }
+
+    void erase_front(size_t n) {
+        m_data.erase(m_data.begin(), m_data.begin() + n);
+    }
+
+    // drop the storage too, not just the contents (needed before an arena reset)
+    void release() {
+        std::pmr::vector<char>(m_data.get_allocator()).swap(m_data);
+    }
 };
 
 template <size_t N>
@@ -0,0 +1,54 @@
+#ifndef CONNECTION_DRAIN_HPP
+#define CONNECTION_DRAIN_HPP
+
+#include <unordered_map>
+#include <vector>
+
+#include "callback.hpp"
+
+// Graceful drain of one loop. Every live connection, HTTP/1.1, HTTP/2 or
+// WebSocket, enters here with a callback that asks it to wind down in its
+// own protocol, and leaves when it is gone. begin() calls them all; its
+// on_drained runs once the last connection has left.
+struct connection_drain {
+    inline static thread_local std::unordered_map<void const *, callback<>> g_live;
+    inline static thread_local bool g_draining = false;
+    inline static thread_local callback<> g_on_drained;
+
+    // conn counts as live until leave(conn); one that enters while the loop
+    // drains already has to check draining() itself
+    static void enter(void const *conn, callback<> on_drain) {
+        g_live.insert_or_assign(conn, std::move(on_drain));
+    }
+
+    static void leave(void const *conn) {
+        if (g_live.erase(conn) && g_draining && g_live.empty()) {
+            g_on_drained();
+        }
+    }
+
+    [[nodiscard]] static bool draining() {
+        return g_draining;
+    }
+
+    // the callbacks must not destroy their connection before returning
+    static void begin(callback<> on_drained) {
+        g_draining = true;
+        g_on_drained = std::move(on_drained);
+        if (g_live.empty()) {
+            return g_on_drained();
+        }
+        std::vector<void const *> conns;
+        conns.reserve(g_live.size());
+        for (auto const &[conn, cb]: g_live) {
+            conns.push_back(conn);
+        }
+        for (auto const *conn: conns) {
+            if (auto it = g_live.find(conn); it != g_live.end()) {
+                it->second();
+            }
+        }
+    }
+};
+
+#endif
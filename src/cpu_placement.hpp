@@ -0,0 +1,138 @@
+#ifndef CPU_PLACEMENT_HPP
+#define CPU_PLACEMENT_HPP
+
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/filter.h>
+#include <linux/mempolicy.h>
+#include <atomic>
+#include <cstdint>
+#include <format>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "exception.hpp"
+
+// Keeping a connection on one core: the worker pinned to CPU n accepts the
+// connections whose packets the kernel processed on CPU n, and allocates
+// their buffers from n's NUMA node.
+struct cpu_placement {
+    // CPUs this process may run on, ascending
+    static std::vector<int> allowed_cpus() {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CHECK_CALL(sched_getaffinity, 0, sizeof(set), &set);
+        std::vector<int> cpus;
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &set)) {
+                cpus.push_back(cpu);
+            }
+        }
+        return cpus;
+    }
+
+    // pin the calling thread
+    static void pin_to_cpu(int cpu) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        CHECK_CALL(sched_setaffinity, 0, sizeof(set), &set);
+    }
+
+    // node of the CPU the calling thread runs on, 0 without NUMA
+    static int current_node() {
+        unsigned cpu = 0, node = 0;
+        if (getcpu(&cpu, &node) < 0) {
+            return 0;
+        }
+        return static_cast<int>(node);
+    }
+
+    // Prefer the calling thread's page allocations on node. glibc gives each
+    // thread its own malloc arena, so connection buffers allocated by a pinned
+    // worker land there. Best effort: kernels without NUMA return ENOSYS.
+    static bool prefer_node(int node) {
+        unsigned long mask = 1ul << node;
+        return syscall(SYS_set_mempolicy, MPOL_PREFERRED, &mask, sizeof(mask) * 8) == 0;
+    }
+
+    // A reuseport group picks the socket at the index the program returns.
+    // Listening sockets join the group in creation order, so listener i must
+    // belong to the worker on cpus[i]. Unknown CPUs spread by cpu % size.
+    static void attach_reuseport_cbpf(int listenfd, std::vector<int> const &cpus) {
+        std::vector<struct sock_filter> code;
+        code.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS, static_cast<uint32_t>(SKF_AD_OFF + SKF_AD_CPU)));
+        for (size_t i = 0; i < cpus.size(); i++) {
+            code.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, static_cast<uint32_t>(cpus[i]), 0, 1));
+            code.push_back(BPF_STMT(BPF_RET | BPF_K, static_cast<uint32_t>(i)));
+        }
+        code.push_back(BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, static_cast<uint32_t>(cpus.size())));
+        code.push_back(BPF_STMT(BPF_RET | BPF_A, 0));
+        struct sock_fprog prog{static_cast<unsigned short>(code.size()), code.data()};
+        CHECK_CALL(setsockopt, listenfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+    }
+
+    // CPU that processed the connection's packets, -1 if unknown
+    static int incoming_cpu(int connfd) {
+        int cpu = -1;
+        socklen_t len = sizeof(cpu);
+        if (getsockopt(connfd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) < 0) {
+            return -1;
+        }
+        return cpu;
+    }
+};
+
+// Per-worker accept counters, each written only by its own worker thread.
+// on_cpu / off_cpu compare SO_INCOMING_CPU with the worker's CPU: off_cpu
+// connections pay for cross-core wakeups and cache traffic.
+struct placement_stats {
+    int m_cpu = -1;
+    int m_node = -1;
+    std::atomic<uint64_t> m_accepted{0};
+    std::atomic<uint64_t> m_on_cpu{0};
+    std::atomic<uint64_t> m_off_cpu{0};
+    std::atomic<uint64_t> m_unknown{0};
+
+    // slots of all workers; set up before they start, read by /debug/workers
+    inline static std::vector<std::unique_ptr<placement_stats>> g_workers;
+    inline static thread_local placement_stats *g_current = nullptr;
+
+    // no-op outside of pinned workers
+    static void note_accept(int connfd) {
+        auto *self = g_current;
+        if (!self) {
+            return;
+        }
+        self->m_accepted.fetch_add(1, std::memory_order_relaxed);
+        int cpu = cpu_placement::incoming_cpu(connfd);
+        if (cpu < 0) {
+            self->m_unknown.fetch_add(1, std::memory_order_relaxed);
+        }
+        else if (cpu == self->m_cpu) {
+            self->m_on_cpu.fetch_add(1, std::memory_order_relaxed);
+        }
+        else {
+            self->m_off_cpu.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    static std::string dump_json() {
+        std::string out = "{\"workers\":[";
+        for (size_t i = 0; i < g_workers.size(); i++) {
+            auto const &w = *g_workers[i];
+            std::format_to(std::back_inserter(out),
+                R"({}{{"cpu":{},"node":{},"accepted":{},"on_cpu":{},"off_cpu":{},"unknown":{}}})",
+                i == 0 ? "\n" : ",\n", w.m_cpu, w.m_node,
+                w.m_accepted.load(std::memory_order_relaxed), w.m_on_cpu.load(std::memory_order_relaxed),
+                w.m_off_cpu.load(std::memory_order_relaxed), w.m_unknown.load(std::memory_order_relaxed));
+        }
+        out += "\n]}\n";
+        return out;
+    }
+};
+
+#endif
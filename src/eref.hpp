@@ -1,77 +1,198 @@
 #ifndef ENUM_REFLECTION
 #define ENUM_REFLECTION
 
-#include <string>
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <stdexcept>
+#include <string_view>
+#include <type_traits>
+#include <utility>
 
 /// @brief Hidden implementation details
 namespace details {
 template <typename T, T N>
-const char* get_enum_name_static() {
+constexpr std::string_view get_enum_name_static() {
 #if _MSC_VER
-    return __FUNCSIG__;
+    std::string_view s = __FUNCSIG__;
+    auto pos1 = s.find(",");
+    ++pos1;
+    auto pos2 = s.find_first_of(">(", pos1);
 #else
-    return __PRETTY_FUNCTION__;
+    std::string_view s = __PRETTY_FUNCTION__;
+    auto pos1 = s.find("N = ");
+    pos1 += 4;
+    auto pos2 = s.find_first_of("];", pos1);
 #endif
+    s = s.substr(pos1, pos2 - pos1);
+    auto colon = s.rfind("::");
+    if (colon != std::string_view::npos) {
+        s = s.substr(colon + 2);
+    }
+    // values without an enumerator print as "(T)5"
+    if (s.empty() || !(s[0] == '_' || (s[0] >= 'a' && s[0] <= 'z') || (s[0] >= 'A' && s[0] <= 'Z'))) {
+        return {};
+    }
+    return s;
+}
+
+template <typename T>
+constexpr int default_enum_end() {
+    using U = std::underlying_type_t<T>;
+    return static_cast<int>(std::min<long long>(256, static_cast<long long>(std::numeric_limits<U>::max()) + 1));
 }
 
-template<int Beg, int End, typename F>
-void static_for(F const& func) {
-    if constexpr (Beg == End) {
-        return;
+constexpr uint32_t enum_name_hash(std::string_view s, uint32_t seed) noexcept {
+    uint32_t h = 2166136261u ^ (seed * 0x9e3779b9u);
+    for (char c: s) {
+        h ^= static_cast<unsigned char>(c);
+        h *= 16777619u;
     }
-    else {
-        func(std::integral_constant<int, Beg>());
-        static_for<Beg + 1, End>(func);
+    return h ^ (h >> 15);
+}
+
+constexpr size_t enum_pow2_ceil(size_t n) {
+    size_t p = 1;
+    while (p < n) {
+        p <<= 1;
     }
+    return p;
 }
+
+// Name tables for the enumerators of T in [Beg, End), built at compile time,
+// plus a two-level (hash and displace) perfect hash for name -> value.
+template <typename T, int Beg, int End>
+struct enum_table {
+    static constexpr auto names = [] <int ...Is> (std::integer_sequence<int, Is...>) {
+        return std::array<std::string_view, sizeof...(Is)>{get_enum_name_static<T, static_cast<T>(Beg + Is)>()...};
+    }(std::make_integer_sequence<int, End - Beg>());
+
+    static constexpr size_t count = std::count_if(names.begin(), names.end(), [] (std::string_view s) {
+        return !s.empty();
+    });
+
+    static constexpr size_t buckets = enum_pow2_ceil(count / 2 + 1);
+    static constexpr size_t slots = enum_pow2_ceil(count + count / 4 + 1);
+    static constexpr uint16_t empty_slot = 0xffff;
+
+    struct hash_table {
+        std::array<uint32_t, buckets> m_seeds{};
+        std::array<uint16_t, slots> m_slots{};
+    };
+
+    static constexpr hash_table hash = [] {
+        hash_table table;
+        std::fill(table.m_slots.begin(), table.m_slots.end(), empty_slot);
+
+        std::array<size_t, buckets> sizes{};
+        for (auto s: names) {
+            if (!s.empty()) {
+                ++sizes[enum_name_hash(s, 0) & (buckets - 1)];
+            }
+        }
+        std::array<size_t, buckets> order{};
+        for (size_t b = 0; b < buckets; b++) {
+            order[b] = b;
+        }
+        std::sort(order.begin(), order.end(), [&] (size_t a, size_t b) {
+            return sizes[a] > sizes[b];
+        });
+
+        for (size_t b: order) {
+            if (sizes[b] == 0) {
+                break;
+            }
+            for (uint32_t seed = 1; ; seed++) {
+                std::array<size_t, slots> taken{};
+                size_t ntaken = 0;
+                bool ok = true;
+                for (size_t i = 0; i < names.size() && ok; i++) {
+                    if (names[i].empty() || (enum_name_hash(names[i], 0) & (buckets - 1)) != b) {
+                        continue;
+                    }
+                    size_t slot = enum_name_hash(names[i], seed) & (slots - 1);
+                    ok = table.m_slots[slot] == empty_slot;
+                    for (size_t j = 0; j < ntaken && ok; j++) {
+                        ok = taken[j] != slot;
+                    }
+                    taken[ntaken++] = slot;
+                }
+                if (!ok) {
+                    continue;
+                }
+                table.m_seeds[b] = seed;
+                for (size_t i = 0; i < names.size(); i++) {
+                    if (!names[i].empty() && (enum_name_hash(names[i], 0) & (buckets - 1)) == b) {
+                        table.m_slots[enum_name_hash(names[i], seed) & (slots - 1)] = static_cast<uint16_t>(i);
+                    }
+                }
+                break;
+            }
+        }
+        return table;
+    }();
+
+    static constexpr std::string_view name(T n) noexcept {
+        auto i = static_cast<long long>(n) - Beg;
+        if (i < 0 || i >= static_cast<long long>(names.size())) {
+            return {};
+        }
+        return names[i];
+    }
+
+    static constexpr std::optional<T> find(std::string_view s) noexcept {
+        if constexpr (count == 0) {
+            return std::nullopt;
+        }
+        else {
+            uint32_t seed = hash.m_seeds[enum_name_hash(s, 0) & (buckets - 1)];
+            uint16_t i = hash.m_slots[enum_name_hash(s, seed) & (slots - 1)];
+            if (i == empty_slot || names[i] != s) {
+                return std::nullopt;
+            }
+            return static_cast<T>(Beg + i);
+        }
+    }
+};
 }
 
 namespace eref {
 template<typename T, T Beg, T End>
-std::string get_enum_name(T n) {
-    std::string s;
-    details::static_for<Beg, End>([&] (auto ic) {
-        constexpr auto i = ic.value;
-        if (n == static_cast<T>(i)) {
-            s = details::get_enum_name_static<T, static_cast<T>(i)>();
-        }
-    });
-#if _MSC_VER
-    auto pos1 = s.find(",");
-#else
-    auto pos1 = s.find("N = ");
-#endif
-#if _MSC_VER
-    ++pos1;
-#else
-    pos1 += 4;
-#endif
-#if _MSC_VER
-    auto pos2 = s.find_first_of(">(", pos1);
-#else
-    auto pos2 = s.find_first_of("];", pos1);
-#endif
-    return std::move(s.substr(pos1, pos2 - pos1));
+constexpr std::string_view get_enum_name(T n) {
+    return details::enum_table<T, static_cast<int>(Beg), static_cast<int>(End)>::name(n);
+}
+
+template<typename T>
+constexpr std::string_view get_enum_name(T n) {
+    return details::enum_table<T, 0, details::default_enum_end<T>()>::name(n);
+}
+
+template<typename T, T Beg, T End>
+constexpr std::optional<T> try_enum_from_name(std::string_view s) {
+    return details::enum_table<T, static_cast<int>(Beg), static_cast<int>(End)>::find(s);
 }
 
 template<typename T>
-std::string get_enum_name(T n) {
-    return get_enum_name<T, static_cast<T>(0), static_cast<T>(256)>(n);
+constexpr std::optional<T> try_enum_from_name(std::string_view s) {
+    return details::enum_table<T, 0, details::default_enum_end<T>()>::find(s);
 }
 
 template<typename T, T Beg, T End>
 T enum_from_name(const std::string_view& s) {
-    for (int i = static_cast<int>(Beg); i != static_cast<int>(End); i++) {
-        if (s == get_enum_name(static_cast<T>(i))) {
-            return static_cast<T>(i);
-        }
+    if (auto e = try_enum_from_name<T, Beg, End>(s)) {
+        return *e;
     }
     throw std::runtime_error("Not found enum type");
 }
 
 template<typename T>
 T enum_from_name(const std::string_view& s) {
-    return enum_from_name<T, static_cast<T>(0), static_cast<T>(256)>(s);
+    if (auto e = try_enum_from_name<T>(s)) {
+        return *e;
+    }
+    throw std::runtime_error("Not found enum type");
 }
 }
 
@@ -1,6 +1,7 @@
 #ifndef EXCEPTION_HPP
 #define EXCEPTION_HPP
 
+#include <cassert>
 #include <type_traits>
 #include <stdexcept>
 #include <system_error>
@@ -0,0 +1,502 @@
+#ifndef HPACK_HPP
+#define HPACK_HPP
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include "bytes_buffer.hpp"
+
+// HPACK header compression for HTTP/2 (RFC 7541).
+
+struct hpack_huffman_code {
+    uint32_t m_code;
+    uint8_t m_bits;
+};
+
+// RFC 7541 Appendix B, indexed by symbol; 256 is EOS
+inline constexpr hpack_huffman_code k_hpack_huffman[257] = {
+    {0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28},
+    {0xfffffe4, 28}, {0xfffffe5, 28}, {0xfffffe6, 28}, {0xfffffe7, 28},
+    {0xfffffe8, 28}, {0xffffea, 24}, {0x3ffffffc, 30}, {0xfffffe9, 28},
+    {0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28}, {0xfffffec, 28},
+    {0xfffffed, 28}, {0xfffffee, 28}, {0xfffffef, 28}, {0xffffff0, 28},
+    {0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28},
+    {0xffffff4, 28}, {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28},
+    {0xffffff8, 28}, {0xffffff9, 28}, {0xffffffa, 28}, {0xffffffb, 28},
+    {0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12},
+    {0x1ff9, 13}, {0x15, 6}, {0xf8, 8}, {0x7fa, 11},
+    {0x3fa, 10}, {0x3fb, 10}, {0xf9, 8}, {0x7fb, 11},
+    {0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6},
+    {0x0, 5}, {0x1, 5}, {0x2, 5}, {0x19, 6},
+    {0x1a, 6}, {0x1b, 6}, {0x1c, 6}, {0x1d, 6},
+    {0x1e, 6}, {0x1f, 6}, {0x5c, 7}, {0xfb, 8},
+    {0x7ffc, 15}, {0x20, 6}, {0xffb, 12}, {0x3fc, 10},
+    {0x1ffa, 13}, {0x21, 6}, {0x5d, 7}, {0x5e, 7},
+    {0x5f, 7}, {0x60, 7}, {0x61, 7}, {0x62, 7},
+    {0x63, 7}, {0x64, 7}, {0x65, 7}, {0x66, 7},
+    {0x67, 7}, {0x68, 7}, {0x69, 7}, {0x6a, 7},
+    {0x6b, 7}, {0x6c, 7}, {0x6d, 7}, {0x6e, 7},
+    {0x6f, 7}, {0x70, 7}, {0x71, 7}, {0x72, 7},
+    {0xfc, 8}, {0x73, 7}, {0xfd, 8}, {0x1ffb, 13},
+    {0x7fff0, 19}, {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6},
+    {0x7ffd, 15}, {0x3, 5}, {0x23, 6}, {0x4, 5},
+    {0x24, 6}, {0x5, 5}, {0x25, 6}, {0x26, 6},
+    {0x27, 6}, {0x6, 5}, {0x74, 7}, {0x75, 7},
+    {0x28, 6}, {0x29, 6}, {0x2a, 6}, {0x7, 5},
+    {0x2b, 6}, {0x76, 7}, {0x2c, 6}, {0x8, 5},
+    {0x9, 5}, {0x2d, 6}, {0x77, 7}, {0x78, 7},
+    {0x79, 7}, {0x7a, 7}, {0x7b, 7}, {0x7ffe, 15},
+    {0x7fc, 11}, {0x3ffd, 14}, {0x1ffd, 13}, {0xffffffc, 28},
+    {0xfffe6, 20}, {0x3fffd2, 22}, {0xfffe7, 20}, {0xfffe8, 20},
+    {0x3fffd3, 22}, {0x3fffd4, 22}, {0x3fffd5, 22}, {0x7fffd9, 23},
+    {0x3fffd6, 22}, {0x7fffda, 23}, {0x7fffdb, 23}, {0x7fffdc, 23},
+    {0x7fffdd, 23}, {0x7fffde, 23}, {0xffffeb, 24}, {0x7fffdf, 23},
+    {0xffffec, 24}, {0xffffed, 24}, {0x3fffd7, 22}, {0x7fffe0, 23},
+    {0xffffee, 24}, {0x7fffe1, 23}, {0x7fffe2, 23}, {0x7fffe3, 23},
+    {0x7fffe4, 23}, {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23},
+    {0x3fffd9, 22}, {0x7fffe6, 23}, {0x7fffe7, 23}, {0xffffef, 24},
+    {0x3fffda, 22}, {0x1fffdd, 21}, {0xfffe9, 20}, {0x3fffdb, 22},
+    {0x3fffdc, 22}, {0x7fffe8, 23}, {0x7fffe9, 23}, {0x1fffde, 21},
+    {0x7fffea, 23}, {0x3fffdd, 22}, {0x3fffde, 22}, {0xfffff0, 24},
+    {0x1fffdf, 21}, {0x3fffdf, 22}, {0x7fffeb, 23}, {0x7fffec, 23},
+    {0x1fffe0, 21}, {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21},
+    {0x7fffed, 23}, {0x3fffe1, 22}, {0x7fffee, 23}, {0x7fffef, 23},
+    {0xfffea, 20}, {0x3fffe2, 22}, {0x3fffe3, 22}, {0x3fffe4, 22},
+    {0x7ffff0, 23}, {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23},
+    {0x3ffffe0, 26}, {0x3ffffe1, 26}, {0xfffeb, 20}, {0x7fff1, 19},
+    {0x3fffe7, 22}, {0x7ffff2, 23}, {0x3fffe8, 22}, {0x1ffffec, 25},
+    {0x3ffffe2, 26}, {0x3ffffe3, 26}, {0x3ffffe4, 26}, {0x7ffffde, 27},
+    {0x7ffffdf, 27}, {0x3ffffe5, 26}, {0xfffff1, 24}, {0x1ffffed, 25},
+    {0x7fff2, 19}, {0x1fffe3, 21}, {0x3ffffe6, 26}, {0x7ffffe0, 27},
+    {0x7ffffe1, 27}, {0x3ffffe7, 26}, {0x7ffffe2, 27}, {0xfffff2, 24},
+    {0x1fffe4, 21}, {0x1fffe5, 21}, {0x3ffffe8, 26}, {0x3ffffe9, 26},
+    {0xffffffd, 28}, {0x7ffffe3, 27}, {0x7ffffe4, 27}, {0x7ffffe5, 27},
+    {0xfffec, 20}, {0xfffff3, 24}, {0xfffed, 20}, {0x1fffe6, 21},
+    {0x3fffe9, 22}, {0x1fffe7, 21}, {0x1fffe8, 21}, {0x7ffff3, 23},
+    {0x3fffea, 22}, {0x3fffeb, 22}, {0x1ffffee, 25}, {0x1ffffef, 25},
+    {0xfffff4, 24}, {0xfffff5, 24}, {0x3ffffea, 26}, {0x7ffff4, 23},
+    {0x3ffffeb, 26}, {0x7ffffe6, 27}, {0x3ffffec, 26}, {0x3ffffed, 26},
+    {0x7ffffe7, 27}, {0x7ffffe8, 27}, {0x7ffffe9, 27}, {0x7ffffea, 27},
+    {0x7ffffeb, 27}, {0xffffffe, 28}, {0x7ffffec, 27}, {0x7ffffed, 27},
+    {0x7ffffee, 27}, {0x7ffffef, 27}, {0x7fffff0, 27}, {0x3ffffee, 26},
+    {0x3fffffff, 30},
+};
+
+// RFC 7541 Appendix A, index 1..61
+inline constexpr std::pair<std::string_view, std::string_view> k_hpack_static_table[61] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+// Huffman decoding tree, built at compile time from k_hpack_huffman.
+struct hpack_huffman_tree {
+    struct node {
+        int16_t m_child[2] = {-1, -1};
+        int16_t m_symbol = -1;
+    };
+
+    std::array<node, 513> m_nodes{};
+
+    constexpr hpack_huffman_tree() {
+        size_t count = 1;
+        for (int sym = 0; sym < 257; sym++) {
+            auto code = k_hpack_huffman[sym];
+            size_t n = 0;
+            for (int bit = code.m_bits - 1; bit >= 0; bit--) {
+                int b = (code.m_code >> bit) & 1;
+                if (m_nodes[n].m_child[b] < 0) {
+                    m_nodes[n].m_child[b] = static_cast<int16_t>(count++);
+                }
+                n = m_nodes[n].m_child[b];
+            }
+            m_nodes[n].m_symbol = static_cast<int16_t>(sym);
+        }
+    }
+};
+
+inline constexpr hpack_huffman_tree k_hpack_huffman_tree{};
+
+inline bool hpack_huffman_decode(std::string_view in, std::string &out) {
+    size_t n = 0;
+    int pad_bits = 0;
+    bool pad_ones = true;
+    for (unsigned char c: in) {
+        for (int bit = 7; bit >= 0; bit--) {
+            int b = (c >> bit) & 1;
+            int next = k_hpack_huffman_tree.m_nodes[n].m_child[b];
+            if (next < 0) {
+                return false;
+            }
+            n = next;
+            ++pad_bits;
+            pad_ones = pad_ones && b;
+            int sym = k_hpack_huffman_tree.m_nodes[n].m_symbol;
+            if (sym >= 0) {
+                if (sym == 256) {
+                    return false;
+                }
+                out.push_back(static_cast<char>(sym));
+                n = 0;
+                pad_bits = 0;
+                pad_ones = true;
+            }
+        }
+    }
+    // leftover must be a prefix of EOS, i.e. at most 7 one bits
+    return pad_bits <= 7 && pad_ones;
+}
+
+inline size_t hpack_huffman_size(std::string_view in) {
+    size_t bits = 0;
+    for (unsigned char c: in) {
+        bits += k_hpack_huffman[c].m_bits;
+    }
+    return (bits + 7) / 8;
+}
+
+inline void hpack_huffman_encode(std::string_view in, bytes_buffer &out) {
+    uint64_t acc = 0;
+    int acc_bits = 0;
+    char bytes[8];
+    for (unsigned char c: in) {
+        auto code = k_hpack_huffman[c];
+        acc = (acc << code.m_bits) | code.m_code;
+        acc_bits += code.m_bits;
+        size_t n = 0;
+        while (acc_bits >= 8) {
+            acc_bits -= 8;
+            bytes[n++] = static_cast<char>(acc >> acc_bits);
+        }
+        out.append(bytes_const_view{bytes, n});
+    }
+    if (acc_bits > 0) {
+        bytes[0] = static_cast<char>((acc << (8 - acc_bits)) | (0xff >> acc_bits));
+        out.append(bytes_const_view{bytes, 1});
+    }
+}
+
+inline void hpack_encode_int(bytes_buffer &out, uint8_t first, int prefix, uint64_t value) {
+    uint8_t max = static_cast<uint8_t>((1u << prefix) - 1);
+    char bytes[12];
+    size_t n = 0;
+    if (value < max) {
+        bytes[n++] = static_cast<char>(first | value);
+    }
+    else {
+        bytes[n++] = static_cast<char>(first | max);
+        value -= max;
+        while (value >= 128) {
+            bytes[n++] = static_cast<char>((value & 0x7f) | 0x80);
+            value >>= 7;
+        }
+        bytes[n++] = static_cast<char>(value);
+    }
+    out.append(bytes_const_view{bytes, n});
+}
+
+inline bool hpack_decode_int(uint8_t const *&p, uint8_t const *end, int prefix, uint64_t &value) {
+    if (p == end) {
+        return false;
+    }
+    uint8_t max = static_cast<uint8_t>((1u << prefix) - 1);
+    value = *p++ & max;
+    if (value < max) {
+        return true;
+    }
+    for (int shift = 0; shift <= 56; shift += 7) {
+        if (p == end) {
+            return false;
+        }
+        uint8_t b = *p++;
+        value += uint64_t(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+inline void hpack_encode_string(bytes_buffer &out, std::string_view s) {
+    size_t huffman_size = hpack_huffman_size(s);
+    if (huffman_size < s.size()) {
+        hpack_encode_int(out, 0x80, 7, huffman_size);
+        hpack_huffman_encode(s, out);
+    }
+    else {
+        hpack_encode_int(out, 0x00, 7, s.size());
+        out.append(s);
+    }
+}
+
+struct hpack_dynamic_table {
+    static constexpr size_t k_entry_overhead = 32;
+
+    std::deque<std::pair<std::string, std::string>> m_entries;  // newest first
+    size_t m_size = 0;
+    size_t m_max_size = 4096;
+
+    size_t count() const {
+        return m_entries.size();
+    }
+
+    std::pair<std::string, std::string> const &at(size_t i) const {
+        return m_entries[i];
+    }
+
+    void _evict(size_t room) {
+        while (!m_entries.empty() && m_size + room > m_max_size) {
+            auto &last = m_entries.back();
+            m_size -= last.first.size() + last.second.size() + k_entry_overhead;
+            m_entries.pop_back();
+        }
+    }
+
+    void set_max_size(size_t n) {
+        m_max_size = n;
+        _evict(0);
+    }
+
+    void add(std::string_view name, std::string_view value) {
+        size_t size = name.size() + value.size() + k_entry_overhead;
+        if (size > m_max_size) {
+            m_entries.clear();
+            m_size = 0;
+            return;
+        }
+        _evict(size);
+        m_entries.emplace_front(std::string(name), std::string(value));
+        m_size += size;
+    }
+};
+
+struct hpack_decoder {
+    hpack_dynamic_table m_table;
+    size_t m_max_table_size = 4096;  // what we advertise in SETTINGS_HEADER_TABLE_SIZE
+    std::string m_name_scratch;
+    std::string m_value_scratch;
+
+    bool _lookup(uint64_t index, std::string_view &name, std::string_view &value) const {
+        if (index == 0) {
+            return false;
+        }
+        if (index <= 61) {
+            name = k_hpack_static_table[index - 1].first;
+            value = k_hpack_static_table[index - 1].second;
+            return true;
+        }
+        index -= 62;
+        if (index >= m_table.count()) {
+            return false;
+        }
+        name = m_table.at(index).first;
+        value = m_table.at(index).second;
+        return true;
+    }
+
+    static bool _read_string(uint8_t const *&p, uint8_t const *end, std::string &scratch, std::string_view &out) {
+        if (p == end) {
+            return false;
+        }
+        bool huffman = *p & 0x80;
+        uint64_t len;
+        if (!hpack_decode_int(p, end, 7, len) || len > static_cast<uint64_t>(end - p)) {
+            return false;
+        }
+        std::string_view raw(reinterpret_cast<char const *>(p), len);
+        p += len;
+        if (!huffman) {
+            out = raw;
+            return true;
+        }
+        scratch.clear();
+        if (!hpack_huffman_decode(raw, scratch)) {
+            return false;
+        }
+        out = scratch;
+        return true;
+    }
+
+    // Calls on_field(name, value) for each header field, views valid only
+    // during the call. False on a compression error.
+    template <class OnField>
+    bool decode(bytes_const_view block, OnField &&on_field) {
+        auto const *p = reinterpret_cast<uint8_t const *>(block.data());
+        auto const *end = p + block.size();
+        bool fields_seen = false;
+        while (p != end) {
+            uint8_t b = *p;
+            uint64_t index;
+            std::string_view name, value;
+            if (b & 0x80) {
+                if (!hpack_decode_int(p, end, 7, index) || !_lookup(index, name, value)) {
+                    return false;
+                }
+                on_field(name, value);
+                fields_seen = true;
+                continue;
+            }
+            if ((b & 0xe0) == 0x20) {
+                // size updates are only allowed before the first field
+                if (fields_seen || !hpack_decode_int(p, end, 5, index) || index > m_max_table_size) {
+                    return false;
+                }
+                m_table.set_max_size(index);
+                continue;
+            }
+            bool incremental = (b & 0xc0) == 0x40;
+            if (!hpack_decode_int(p, end, incremental ? 6 : 4, index)) {
+                return false;
+            }
+            if (index != 0) {
+                std::string_view unused;
+                if (!_lookup(index, name, unused)) {
+                    return false;
+                }
+                // the name may live in the dynamic table, which add() can evict
+                m_name_scratch.assign(name);
+                name = m_name_scratch;
+            }
+            else if (!_read_string(p, end, m_name_scratch, name)) {
+                return false;
+            }
+            if (!_read_string(p, end, m_value_scratch, value)) {
+                return false;
+            }
+            if (incremental) {
+                m_table.add(name, value);
+            }
+            on_field(name, value);
+            fields_seen = true;
+        }
+        return true;
+    }
+};
+
+struct hpack_encoder {
+    hpack_dynamic_table m_table;
+    size_t m_pending_size_update = 0;
+    bool m_size_update = false;
+
+    // peer's SETTINGS_HEADER_TABLE_SIZE; announced at the start of the next block
+    void set_max_table_size(size_t n) {
+        n = std::min<size_t>(n, 4096);
+        if (n != m_table.m_max_size) {
+            m_table.set_max_size(n);
+            m_pending_size_update = n;
+            m_size_update = true;
+        }
+    }
+
+    void begin_block(bytes_buffer &out) {
+        if (m_size_update) {
+            hpack_encode_int(out, 0x20, 5, m_pending_size_update);
+            m_size_update = false;
+        }
+    }
+
+    // index=false for fields that change on every response (date, length)
+    void encode(bytes_buffer &out, std::string_view name, std::string_view value, bool index = true) {
+        size_t name_index = 0;
+        for (size_t i = 0; i < 61; i++) {
+            if (k_hpack_static_table[i].first == name) {
+                if (k_hpack_static_table[i].second == value) {
+                    return hpack_encode_int(out, 0x80, 7, i + 1);
+                }
+                if (name_index == 0) {
+                    name_index = i + 1;
+                }
+            }
+        }
+        for (size_t i = 0; i < m_table.count(); i++) {
+            auto const &entry = m_table.at(i);
+            if (entry.first == name) {
+                if (entry.second == value) {
+                    return hpack_encode_int(out, 0x80, 7, i + 62);
+                }
+                if (name_index == 0) {
+                    name_index = i + 62;
+                }
+            }
+        }
+
+        if (index) {
+            hpack_encode_int(out, 0x40, 6, name_index);
+        }
+        else {
+            hpack_encode_int(out, 0x00, 4, name_index);
+        }
+        if (name_index == 0) {
+            hpack_encode_string(out, name);
+        }
+        hpack_encode_string(out, value);
+        if (index) {
+            m_table.add(name, value);
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,1018 @@
+#ifndef HTTP2_HPP
+#define HTTP2_HPP
+
+#include <sys/socket.h>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "bytes_buffer.hpp"
+#include "async_file.hpp"
+#include "http_message.hpp"
+#include "hpack.hpp"
+#include "admission_control.hpp"
+#include "connection_drain.hpp"
+#include "trace.hpp"
+
+// Cleartext HTTP/2 (RFC 9113), both prior knowledge and "Upgrade: h2c".
+
+inline constexpr std::string_view k_http2_preface = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+inline constexpr size_t k_http2_preface_line = k_http2_preface.find("SM");
+
+enum class http2_frame_type : uint8_t {
+    data = 0x0,
+    headers = 0x1,
+    priority = 0x2,
+    rst_stream = 0x3,
+    settings = 0x4,
+    push_promise = 0x5,
+    ping = 0x6,
+    goaway = 0x7,
+    window_update = 0x8,
+    continuation = 0x9,
+};
+
+enum class http2_error : uint32_t {
+    no_error = 0x0,
+    protocol_error = 0x1,
+    internal_error = 0x2,
+    flow_control_error = 0x3,
+    stream_closed = 0x5,
+    frame_size_error = 0x6,
+    refused_stream = 0x7,
+    cancel = 0x8,
+    compression_error = 0x9,
+    enhance_your_calm = 0xb,
+};
+
+enum class http2_setting : uint16_t {
+    header_table_size = 0x1,
+    enable_push = 0x2,
+    max_concurrent_streams = 0x3,
+    initial_window_size = 0x4,
+    max_frame_size = 0x5,
+    max_header_list_size = 0x6,
+};
+
+inline constexpr uint8_t k_http2_end_stream = 0x1;
+inline constexpr uint8_t k_http2_ack = 0x1;
+inline constexpr uint8_t k_http2_end_headers = 0x4;
+inline constexpr uint8_t k_http2_padded = 0x8;
+inline constexpr uint8_t k_http2_priority = 0x20;
+
+// HeaderParser for http_request_parser, fed with HPACK-decoded fields; the
+// request line is synthesized as "METHOD path HTTP/2" so that method(),
+// url() and version() behave as for HTTP/1.1.
+struct http2_header_parser {
+    std::pmr::string m_headline;
+    std::pmr::string m_method;
+    std::pmr::string m_path;
+    StringMap m_header_keys;
+    std::pmr::string m_body;
+    bool m_header_finished = false;
+
+    explicit http2_header_parser(std::pmr::memory_resource *mr = std::pmr::get_default_resource())
+        : m_headline(mr), m_method(mr), m_path(mr), m_header_keys(mr), m_body(mr) {}
+
+    void reset_state() {
+        auto mr = m_headline.get_allocator();
+        std::pmr::string(mr).swap(m_headline);
+        std::pmr::string(mr).swap(m_method);
+        std::pmr::string(mr).swap(m_path);
+        StringMap(mr).swap(m_header_keys);
+        std::pmr::string(mr).swap(m_body);
+        m_header_finished = false;
+    }
+
+    [[nodiscard]] bool header_finished() const {
+        return m_header_finished;
+    }
+
+    void add_field(std::string_view name, std::string_view value) {
+        if (name == ":method") {
+            m_method.assign(value);
+            return;
+        }
+        if (name == ":path") {
+            m_path.assign(value);
+            return;
+        }
+        if (name == ":authority") {
+            name = "host";
+        }
+        else if (!name.empty() && name[0] == ':') {
+            return;
+        }
+        auto it = m_header_keys.find(name);
+        if (it == m_header_keys.end()) {
+            m_header_keys.emplace(name, value);
+            return;
+        }
+        it->second.append(name == "cookie" ? "; " : ", ");
+        it->second.append(value);
+    }
+
+    void finish_header() {
+        m_headline.assign(m_method);
+        m_headline.append(" ");
+        m_headline.append(m_path);
+        m_headline.append(" HTTP/2");
+        m_header_finished = true;
+    }
+
+    std::string_view headline() const {
+        return m_headline;
+    }
+
+    StringMap &headers() {
+        return m_header_keys;
+    }
+
+    std::pmr::string &extra_body() {
+        return m_body;
+    }
+};
+
+// HeaderWriter for http_response_writer: collects fields for HPACK instead of
+// serializing them; buffer() holds only the body.
+struct http2_header_writer {
+    using field = std::pair<std::pmr::string, std::pmr::string>;
+
+    bytes_buffer m_buffer;
+    std::pmr::vector<field> m_fields;
+
+    explicit http2_header_writer(std::pmr::memory_resource *mr = std::pmr::get_default_resource())
+        : m_buffer(mr), m_fields(mr) {}
+
+    void reset_state() {
+        m_buffer.release();
+        std::pmr::vector<field>(m_fields.get_allocator()).swap(m_fields);
+    }
+
+    bytes_buffer &buffer() {
+        return m_buffer;
+    }
+
+    void begin_header(std::string_view, std::string_view status, std::string_view) {
+        m_fields.emplace_back(":status", status);
+    }
+
+    void writer_header(std::string_view key, std::string_view value) {
+        std::pmr::string name(key, m_fields.get_allocator());
+        for (auto &c: name) {
+            if (c >= 'A' && c <= 'Z') {
+                c += 'a' - 'A';
+            }
+        }
+        // connection-specific fields are forbidden in HTTP/2
+        if (name == "connection" || name == "keep-alive" || name == "proxy-connection"
+            || name == "transfer-encoding" || name == "upgrade") {
+            return;
+        }
+        m_fields.emplace_back(std::move(name), value);
+    }
+
+    void end_header() {}
+
+    void write_template(std::string_view block, size_t content_length, std::string_view etag) {
+        size_t eol = block.find("\r\n");
+        begin_header({}, block.substr(9, 3), {});
+        while (eol != std::string_view::npos) {
+            size_t start = eol + 2;
+            eol = block.find("\r\n", start);
+            auto line = block.substr(start, eol == std::string_view::npos ? std::string_view::npos : eol - start);
+            size_t colon = line.find(": ");
+            if (colon != std::string_view::npos) {
+                writer_header(line.substr(0, colon), line.substr(colon + 2));
+            }
+        }
+        char digits[20];
+        auto end = std::to_chars(digits, digits + sizeof(digits), content_length).ptr;
+        writer_header("date", http_date_cache::get().now());
+        writer_header("content-length", std::string_view(digits, end - digits));
+        if (!etag.empty()) {
+            writer_header("etag", etag);
+        }
+    }
+
+    http_status status() const {
+        auto value = field_value(":status");
+        unsigned code = 0;
+        std::from_chars(value.data(), value.data() + value.size(), code);
+        return static_cast<http_status>(code);
+    }
+
+    std::string_view field_value(std::string_view key) const {
+        for (auto const &[name, value]: m_fields) {
+            if (http11_header_writer::_iequals(name, key)) {
+                return value;
+            }
+        }
+        return {};
+    }
+
+    void set_field(std::string_view key, std::string_view value) {
+        for (auto &[name, old]: m_fields) {
+            if (http11_header_writer::_iequals(name, key)) {
+                old = value;
+                return;
+            }
+        }
+        writer_header(key, value);
+    }
+
+    bytes_const_view body() const {
+        return m_buffer;
+    }
+
+    void replace_body(bytes_const_view body) {
+        char digits[20];
+        auto end = std::to_chars(digits, digits + sizeof(digits), body.size()).ptr;
+        set_field("content-length", std::string_view(digits, end - digits));
+        m_buffer.clear();
+        m_buffer.append(body);
+    }
+};
+
+inline std::string http2_base64url_decode(std::string_view in) {
+    auto value = [] (char c) -> int {
+        if (c >= 'A' && c <= 'Z') return c - 'A';
+        if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+        if (c >= '0' && c <= '9') return c - '0' + 52;
+        if (c == '-' || c == '+') return 62;
+        if (c == '_' || c == '/') return 63;
+        return -1;
+    };
+    std::string out;
+    uint32_t acc = 0;
+    int bits = 0;
+    for (char c: in) {
+        int v = value(c);
+        if (v < 0) {
+            continue;
+        }
+        acc = (acc << 6) | v;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            out.push_back(static_cast<char>(acc >> bits));
+        }
+    }
+    return out;
+}
+
+// One HTTP/2 connection. Handler::handle(request, response, mr, closing, local, done) is
+// the same entry point the HTTP/1.1 connection uses. Responses are sent
+// round-robin across streams, one DATA frame per stream per round, within
+// the peer's connection and stream windows.
+//
+// GOAWAY, ours on drain or the peer's, ends the connection gracefully: no
+// new streams are taken, those already open still finish, and the write
+// side is closed after the last of them. A connection error ends it at
+// once.
+//
+// Receiving is bounded the same way: a header block may not exceed
+// k_max_header_list, a request body not admission_control's m_conn_bytes
+// (answered with 413), and the bodies buffered by all streams not
+// k_max_recv_buffered. Connection window credit is only handed back while
+// the buffered bytes stay under that, so a client that sends faster than
+// requests complete runs out of window instead of memory.
+template <class Handler>
+struct http2_connection : std::enable_shared_from_this<http2_connection<Handler>> {
+    static constexpr uint32_t k_max_streams = 128;
+    static constexpr uint32_t k_recv_max_frame = 16384;
+    static constexpr size_t k_out_high_water = 256 * 1024;
+    // SETTINGS_MAX_HEADER_LIST_SIZE; also caps the encoded block, CONTINUATION included
+    static constexpr uint32_t k_max_header_list = 64 * 1024;
+    // receive window of every stream and of the connection
+    static constexpr int64_t k_recv_window = 1024 * 1024;
+    static constexpr size_t k_max_recv_buffered = 16 * 1024 * 1024;
+    static constexpr int64_t k_max_window = 0x7fffffff;
+
+    struct stream {
+        uint32_t m_id;
+        http_request_parser<http2_header_parser> m_req;
+        http_response_writer<http2_header_writer> m_res;
+        int64_t m_send_window;
+        int64_t m_recv_window = k_recv_window;
+        size_t m_sent = 0;
+        bool m_queued = false;
+        // inside Handler::handle; a reset then only marks the stream, since
+        // an async stage may still be reading the request or writing m_res
+        bool m_handling = false;
+        bool m_reset = false;
+    };
+
+    using pointer = std::shared_ptr<http2_connection>;
+
+    async_file m_conn;
+    bytes_buffer m_readbuf{16384};
+    bytes_buffer m_in;
+    bytes_buffer m_out;
+    bytes_buffer m_writing;
+    bool m_write_busy = false;
+    size_t m_preface_matched = 0;
+
+    hpack_decoder m_decoder;
+    hpack_encoder m_encoder;
+    std::map<uint32_t, std::unique_ptr<stream>> m_streams;
+    std::deque<uint32_t> m_send_queue;
+    uint32_t m_last_stream_id = 0;
+    // inside Handler::handle: a response completed there is flushed by the caller
+    bool m_dispatching = false;
+
+    uint32_t m_continuation_stream = 0;
+    bool m_continuation_end_stream = false;
+    bytes_buffer m_header_block;
+
+    int64_t m_conn_send_window = 65535;
+    int64_t m_conn_recv_window = 65535;
+    // request body bytes held by this connection's streams
+    size_t m_recv_buffered = 0;
+    uint32_t m_peer_initial_window = 65535;
+    uint32_t m_peer_max_frame = 16384;
+    // GOAWAY sent or received: no new streams
+    bool m_closing = false;
+    // connection error or failed write: input is ignored, nothing more is answered
+    bool m_broken = false;
+    bool m_local_peer = false;
+
+    static pointer make() {
+        return std::make_shared<http2_connection>();
+    }
+
+    ~http2_connection() {
+        admission_control::charge(m_recv_buffered, 0);
+        connection_drain::leave(this);
+    }
+
+    void _enter() {
+        m_local_peer = m_conn.peer_is_local();
+        connection_drain::enter(this, [this] {
+            _goaway(http2_error::no_error);
+            _flush();
+        });
+    }
+
+    // nothing left to send: the write side can be closed
+    [[nodiscard]] bool _done() const {
+        return m_broken || (m_closing && m_streams.empty());
+    }
+
+    // preface_matched: how much of the client preface was already consumed,
+    // k_http2_preface_line after HTTP/1.1 parsed "PRI * HTTP/2.0", 0 after ALPN
+    void do_start(async_file conn, bytes_view early, size_t preface_matched) {
+        m_conn = std::move(conn);
+        _enter();
+        m_preface_matched = preface_matched;
+        _send_settings();
+        // started while the loop drains: refuse every stream, retried elsewhere
+        if (connection_drain::draining()) {
+            _goaway(http2_error::no_error);
+        }
+        _on_bytes(early);
+        _flush();
+        return do_read();
+    }
+
+    // "Upgrade: h2c": req becomes stream 1, already half-closed by the client
+    template <class Request>
+    void do_start_upgrade(async_file conn, Request &req, std::string_view settings, bytes_view early) {
+        m_conn = std::move(conn);
+        _enter();
+        auto payload = http2_base64url_decode(settings);
+        _apply_settings(bytes_const_view{payload.data(), payload.size()});
+        _send_settings();
+
+        auto &s = _open_stream(1);
+        auto &parser = s.m_req.m_header_parser;
+        auto method = req.method_raw();
+        parser.m_method.assign(method.data(), method.size());
+        auto url = req.url();
+        parser.m_path.assign(url.data(), url.size());
+        for (auto const &[key, value]: req.headers()) {
+            if (key != "connection" && key != "upgrade" && key != "http2-settings") {
+                parser.m_header_keys.emplace(key, value);
+            }
+        }
+        parser.finish_header();
+        auto &body = req.body();
+        size_t body_size = std::min(body.size(), req.content_length);
+        parser.m_body.assign(body.data(), body_size);
+        _dispatch(s);
+        if (connection_drain::draining()) {
+            _goaway(http2_error::no_error);
+        }
+
+        _on_bytes(early);
+        _flush();
+        return do_read();
+    }
+
+    void do_read() {
+        return m_conn.async_read(m_readbuf, [self = this->shared_from_this()] (exception<size_t> ret) {
+            if (ret.error() || ret.value() == 0) {
+                return;
+            }
+            self->_on_bytes(self->m_readbuf.subspan(0, ret.value()));
+            self->_flush();
+            if (self->_done()) {
+                return;
+            }
+            return self->do_read();
+        });
+    }
+
+    void _flush() {
+        if (m_write_busy) {
+            return;
+        }
+        if (m_out.size() == 0) {
+            // streams still being handled or sent keep the connection open
+            if (_done()) {
+                m_conn.shutdown_write();
+            }
+            return;
+        }
+        std::swap(m_out, m_writing);
+        m_write_busy = true;
+        return do_write(m_writing);
+    }
+
+    void do_write(bytes_const_view buffer) {
+        return m_conn.async_write(buffer, [self = this->shared_from_this(), buffer] (exception<size_t> ret) {
+            if (ret.error()) {
+                self->m_broken = true;
+                shutdown(self->m_conn.m_fd, SHUT_RDWR);
+                return;
+            }
+            auto n = ret.value();
+            if (n != buffer.size()) {
+                return self->do_write(buffer.subspan(n));
+            }
+            self->m_writing.clear();
+            self->m_write_busy = false;
+            self->_schedule();
+            return self->_flush();
+        });
+    }
+
+    void _frame_header(http2_frame_type type, uint8_t flags, uint32_t stream_id, size_t length) {
+        char h[9] = {
+            static_cast<char>(length >> 16), static_cast<char>(length >> 8), static_cast<char>(length),
+            static_cast<char>(type), static_cast<char>(flags),
+            static_cast<char>((stream_id >> 24) & 0x7f), static_cast<char>(stream_id >> 16),
+            static_cast<char>(stream_id >> 8), static_cast<char>(stream_id),
+        };
+        m_out.append(bytes_const_view{h, 9});
+    }
+
+    static void _put32(char *p, uint32_t v) {
+        p[0] = static_cast<char>(v >> 24);
+        p[1] = static_cast<char>(v >> 16);
+        p[2] = static_cast<char>(v >> 8);
+        p[3] = static_cast<char>(v);
+    }
+
+    static uint32_t _get32(uint8_t const *p) {
+        return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | p[3];
+    }
+
+    void _send_settings() {
+        std::pair<http2_setting, uint32_t> const settings[] = {
+            {http2_setting::max_concurrent_streams, k_max_streams},
+            {http2_setting::initial_window_size, static_cast<uint32_t>(k_recv_window)},
+            {http2_setting::max_header_list_size, k_max_header_list},
+        };
+        char payload[sizeof(settings) / sizeof(settings[0]) * 6];
+        char *p = payload;
+        for (auto [id, value]: settings) {
+            p[0] = 0;
+            p[1] = static_cast<char>(id);
+            _put32(p + 2, value);
+            p += 6;
+        }
+        _frame_header(http2_frame_type::settings, 0, 0, sizeof(payload));
+        m_out.append(bytes_const_view{payload, sizeof(payload)});
+        // the connection window starts at 65535 whatever SETTINGS say
+        _send_window_update(0, static_cast<uint32_t>(k_recv_window - m_conn_recv_window));
+        m_conn_recv_window = k_recv_window;
+    }
+
+    void _send_window_update(uint32_t stream_id, uint32_t increment) {
+        char payload[4];
+        _put32(payload, increment);
+        _frame_header(http2_frame_type::window_update, 0, stream_id, 4);
+        m_out.append(bytes_const_view{payload, 4});
+    }
+
+    void _send_rst_stream(uint32_t stream_id, http2_error error) {
+        char payload[4];
+        _put32(payload, static_cast<uint32_t>(error));
+        _frame_header(http2_frame_type::rst_stream, 0, stream_id, 4);
+        m_out.append(bytes_const_view{payload, 4});
+    }
+
+    // NO_ERROR lets the streams up to m_last_stream_id finish, any other
+    // error ends the connection after this frame
+    void _goaway(http2_error error) {
+        if (m_broken || (m_closing && error == http2_error::no_error)) {
+            return;
+        }
+        char payload[8];
+        _put32(payload, m_last_stream_id);
+        _put32(payload + 4, static_cast<uint32_t>(error));
+        _frame_header(http2_frame_type::goaway, 0, 0, 8);
+        m_out.append(bytes_const_view{payload, 8});
+        m_closing = true;
+        m_broken = error != http2_error::no_error;
+    }
+
+    // every stream leaves through here, handing its body's bytes back
+    void _close_stream(typename decltype(m_streams)::iterator it) {
+        size_t body = it->second->m_req.body().size();
+        m_streams.erase(it);
+        admission_control::charge(m_recv_buffered, m_recv_buffered - body);
+        m_recv_buffered -= body;
+        _replenish_connection();
+    }
+
+    void _close_stream(uint32_t id) {
+        auto it = m_streams.find(id);
+        if (it != m_streams.end()) {
+            _close_stream(it);
+        }
+    }
+
+    stream &_open_stream(uint32_t id) {
+        auto s = std::make_unique<stream>();
+        s->m_id = id;
+        s->m_send_window = m_peer_initial_window;
+        m_last_stream_id = id;
+        auto &ref = *s;
+        m_streams.insert_or_assign(id, std::move(s));
+        return ref;
+    }
+
+    void _on_bytes(bytes_view chunk) {
+        if (_done()) {
+            return;
+        }
+        m_in.append(bytes_const_view(chunk));
+
+        size_t pos = 0;
+        if (m_preface_matched < k_http2_preface.size()) {
+            size_t n = std::min(k_http2_preface.size() - m_preface_matched, m_in.size());
+            if (std::string_view(m_in).substr(0, n) != k_http2_preface.substr(m_preface_matched, n)) {
+                return _goaway(http2_error::protocol_error);
+            }
+            m_preface_matched += n;
+            pos = n;
+        }
+
+        while (!_done() && m_in.size() - pos >= 9) {
+            auto const *h = reinterpret_cast<uint8_t const *>(m_in.data() + pos);
+            size_t length = (size_t(h[0]) << 16) | (size_t(h[1]) << 8) | h[2];
+            if (length > k_recv_max_frame) {
+                return _goaway(http2_error::frame_size_error);
+            }
+            if (m_in.size() - pos - 9 < length) {
+                break;
+            }
+            auto type = static_cast<http2_frame_type>(h[3]);
+            uint8_t flags = h[4];
+            uint32_t stream_id = _get32(h + 5) & 0x7fffffff;
+            _on_frame(type, flags, stream_id, bytes_view(m_in).subspan(pos + 9, length));
+            pos += 9 + length;
+        }
+        m_in.erase_front(std::min(pos, m_in.size()));
+        _schedule();
+    }
+
+    // strip PADDED (and for HEADERS, PRIORITY) from a payload
+    static bool _unpad(uint8_t flags, bytes_view &payload, bool priority) {
+        size_t pad = 0;
+        size_t skip = 0;
+        if (flags & k_http2_padded) {
+            if (payload.size() < 1) {
+                return false;
+            }
+            pad = static_cast<uint8_t>(payload.data()[0]);
+            skip = 1;
+        }
+        if (priority && (flags & k_http2_priority)) {
+            skip += 5;
+        }
+        if (skip + pad > payload.size()) {
+            return false;
+        }
+        payload = payload.subspan(skip, payload.size() - skip - pad);
+        return true;
+    }
+
+    void _on_frame(http2_frame_type type, uint8_t flags, uint32_t stream_id, bytes_view payload) {
+        if (m_continuation_stream != 0 && type != http2_frame_type::continuation) {
+            return _goaway(http2_error::protocol_error);
+        }
+        switch (type) {
+        case http2_frame_type::data:
+            return _on_data(flags, stream_id, payload);
+        case http2_frame_type::headers:
+            return _on_headers(flags, stream_id, payload);
+        case http2_frame_type::continuation:
+            if (stream_id == 0 || stream_id != m_continuation_stream) {
+                return _goaway(http2_error::protocol_error);
+            }
+            m_header_block.append(bytes_const_view(payload));
+            // CONTINUATION flood (CVE-2024-27316): the block is bounded too
+            if (m_header_block.size() > k_max_header_list) {
+                return _goaway(http2_error::enhance_your_calm);
+            }
+            if (flags & k_http2_end_headers) {
+                m_continuation_stream = 0;
+                return _on_header_block(stream_id, m_continuation_end_stream);
+            }
+            return;
+        case http2_frame_type::rst_stream: {
+            auto it = m_streams.find(stream_id);
+            if (it == m_streams.end()) {
+                return;
+            }
+            if (it->second->m_handling) {
+                it->second->m_reset = true;
+                return;
+            }
+            return _close_stream(it);
+        }
+        case http2_frame_type::settings:
+            if (stream_id != 0) {
+                return _goaway(http2_error::protocol_error);
+            }
+            if (flags & k_http2_ack) {
+                return;
+            }
+            if (payload.size() % 6 != 0) {
+                return _goaway(http2_error::frame_size_error);
+            }
+            _apply_settings(payload);
+            _frame_header(http2_frame_type::settings, k_http2_ack, 0, 0);
+            return;
+        case http2_frame_type::ping:
+            if (payload.size() != 8) {
+                return _goaway(http2_error::frame_size_error);
+            }
+            if (!(flags & k_http2_ack)) {
+                _frame_header(http2_frame_type::ping, k_http2_ack, 0, 8);
+                m_out.append(bytes_const_view(payload));
+            }
+            return;
+        case http2_frame_type::goaway:
+            // the client opens no more streams; the open ones still finish
+            m_closing = true;
+            return;
+        case http2_frame_type::window_update:
+            return _on_window_update(stream_id, payload);
+        case http2_frame_type::push_promise:
+            return _goaway(http2_error::protocol_error);
+        default:
+            // PRIORITY is advisory and ignored, unknown types must be ignored
+            return;
+        }
+    }
+
+    void _apply_settings(bytes_const_view payload) {
+        auto const *p = reinterpret_cast<uint8_t const *>(payload.data());
+        for (size_t i = 0; i + 6 <= payload.size(); i += 6) {
+            auto id = static_cast<http2_setting>((uint16_t(p[i]) << 8) | p[i + 1]);
+            uint32_t value = _get32(p + i + 2);
+            switch (id) {
+            case http2_setting::header_table_size:
+                m_encoder.set_max_table_size(value);
+                break;
+            case http2_setting::initial_window_size: {
+                if (value > 0x7fffffff) {
+                    return _goaway(http2_error::flow_control_error);
+                }
+                int64_t delta = int64_t(value) - m_peer_initial_window;
+                m_peer_initial_window = value;
+                for (auto &[stream_id, s]: m_streams) {
+                    s->m_send_window += delta;
+                    if (s->m_send_window > k_max_window) {
+                        return _goaway(http2_error::flow_control_error);
+                    }
+                    _enqueue(*s);
+                }
+                break;
+            }
+            case http2_setting::max_frame_size:
+                if (value < 16384 || value > 16777215) {
+                    return _goaway(http2_error::protocol_error);
+                }
+                m_peer_max_frame = value;
+                break;
+            default:
+                break;
+            }
+        }
+    }
+
+    void _on_window_update(uint32_t stream_id, bytes_view payload) {
+        if (payload.size() != 4) {
+            return _goaway(http2_error::frame_size_error);
+        }
+        uint32_t increment = _get32(reinterpret_cast<uint8_t const *>(payload.data())) & 0x7fffffff;
+        // RFC 9113 6.9: a zero increment is a protocol error, a window past
+        // 2^31-1 a flow-control error, of the stream or of the connection
+        if (stream_id == 0) {
+            if (increment == 0) {
+                return _goaway(http2_error::protocol_error);
+            }
+            m_conn_send_window += increment;
+            if (m_conn_send_window > k_max_window) {
+                return _goaway(http2_error::flow_control_error);
+            }
+            return;
+        }
+        auto it = m_streams.find(stream_id);
+        if (it == m_streams.end()) {
+            return;
+        }
+        auto &s = *it->second;
+        if (increment == 0 || s.m_send_window + increment > k_max_window) {
+            _send_rst_stream(stream_id, increment == 0 ? http2_error::protocol_error : http2_error::flow_control_error);
+            if (s.m_handling) {
+                s.m_reset = true;
+                return;
+            }
+            return _close_stream(it);
+        }
+        s.m_send_window += increment;
+        _enqueue(s);
+    }
+
+    // Window credit goes back in batches, once half a window is used up,
+    // and only as far as the bytes it lets in could be buffered.
+    void _replenish_connection() {
+        if (m_broken || m_conn_recv_window >= k_recv_window / 2
+            || m_recv_buffered + k_recv_window > k_max_recv_buffered) {
+            return;
+        }
+        _send_window_update(0, static_cast<uint32_t>(k_recv_window - m_conn_recv_window));
+        m_conn_recv_window = k_recv_window;
+    }
+
+    void _replenish_stream(stream &s) {
+        if (s.m_recv_window < k_recv_window / 2) {
+            _send_window_update(s.m_id, static_cast<uint32_t>(k_recv_window - s.m_recv_window));
+            s.m_recv_window = k_recv_window;
+        }
+    }
+
+    void _on_data(uint8_t flags, uint32_t stream_id, bytes_view payload) {
+        if (stream_id == 0) {
+            return _goaway(http2_error::protocol_error);
+        }
+        // the whole frame counts against flow control, padding included
+        int64_t length = static_cast<int64_t>(payload.size());
+        m_conn_recv_window -= length;
+        if (m_conn_recv_window < 0) {
+            return _goaway(http2_error::flow_control_error);
+        }
+        auto it = m_streams.find(stream_id);
+        if (it == m_streams.end() || it->second->m_req.m_header_parser.m_header_finished == false
+            || it->second->m_req.request_finished()) {
+            // nothing of a dead stream is kept: its bytes are consumed right away
+            m_conn_recv_window += length;
+            return _send_rst_stream(stream_id, http2_error::stream_closed);
+        }
+        auto &s = *it->second;
+        s.m_recv_window -= length;
+        if (s.m_recv_window < 0) {
+            _send_rst_stream(stream_id, http2_error::flow_control_error);
+            return _close_stream(it);
+        }
+        if (!_unpad(flags, payload, false)) {
+            return _goaway(http2_error::protocol_error);
+        }
+        // padding is not buffered, so its credit is not held back
+        m_conn_recv_window += length - static_cast<int64_t>(payload.size());
+        if (s.m_req.body().size() + payload.size() > admission_control::get().m_limits.m_conn_bytes) {
+            // like HTTP/1.1's 413, then tell the client to stop sending
+            m_conn_recv_window += static_cast<int64_t>(payload.size());
+            s.m_res.begin_header(http_status::payload_too_large);
+            s.m_res.writer_header("server", "co_http");
+            s.m_res.writer_header("content-length", "0");
+            s.m_res.end_header();
+            _respond(s);
+            return _send_rst_stream(stream_id, http2_error::no_error);
+        }
+        s.m_req.body().append(payload.data(), payload.size());
+        admission_control::charge(m_recv_buffered, m_recv_buffered + payload.size());
+        m_recv_buffered += payload.size();
+        _replenish_connection();
+        if (flags & k_http2_end_stream) {
+            return _dispatch(s);
+        }
+        _replenish_stream(s);
+    }
+
+    void _on_headers(uint8_t flags, uint32_t stream_id, bytes_view payload) {
+        if (stream_id == 0 || stream_id % 2 == 0) {
+            return _goaway(http2_error::protocol_error);
+        }
+        if (!_unpad(flags, payload, true)) {
+            return _goaway(http2_error::protocol_error);
+        }
+        m_header_block.clear();
+        m_header_block.append(bytes_const_view(payload));
+        if (m_header_block.size() > k_max_header_list) {
+            return _goaway(http2_error::enhance_your_calm);
+        }
+        if (!(flags & k_http2_end_headers)) {
+            m_continuation_stream = stream_id;
+            m_continuation_end_stream = flags & k_http2_end_stream;
+            return;
+        }
+        return _on_header_block(stream_id, flags & k_http2_end_stream);
+    }
+
+    void _on_header_block(uint32_t stream_id, bool end_stream) {
+        stream *s = nullptr;
+        bool refused = false;
+        bool half_closed = false;
+        if (stream_id > m_last_stream_id) {
+            // REFUSED_STREAM tells the client it may safely retry elsewhere or
+            // later; after GOAWAY every new stream is refused
+            if (m_closing || m_streams.size() >= k_max_streams || admission_control::get().shedding()) {
+                refused = true;
+                m_last_stream_id = stream_id;
+            }
+            else {
+                s = &_open_stream(stream_id);
+            }
+        }
+        else {
+            // trailers of an open stream; anything else is a closed stream
+            auto it = m_streams.find(stream_id);
+            if (it == m_streams.end()) {
+                return _goaway(http2_error::stream_closed);
+            }
+            // half-closed by the client already: the request is being handled
+            // or answered and must not be dispatched a second time
+            auto &open = *it->second;
+            half_closed = open.m_handling || open.m_req.request_finished();
+        }
+
+        // the block has to be decoded either way to keep the HPACK state in sync;
+        // a list larger than we advertised is dropped, the stream reset
+        size_t list_size = 0;
+        bool ok = m_decoder.decode(m_header_block, [&] (std::string_view name, std::string_view value) {
+            list_size += name.size() + value.size() + 32;
+            if (s && list_size <= k_max_header_list) {
+                s->m_req.m_header_parser.add_field(name, value);
+            }
+        });
+        m_header_block.clear();
+        if (!ok) {
+            return _goaway(http2_error::compression_error);
+        }
+        if (refused) {
+            return _send_rst_stream(stream_id, http2_error::refused_stream);
+        }
+        // RFC 9113 5.1 and 8.1: a list over our limit or trailers that do not
+        // end the stream are malformed, headers on a half-closed stream
+        // are STREAM_CLOSED
+        http2_error error = http2_error::no_error;
+        if (list_size > k_max_header_list || (s == nullptr && !end_stream)) {
+            error = http2_error::protocol_error;
+        }
+        else if (half_closed) {
+            error = http2_error::stream_closed;
+        }
+        if (error != http2_error::no_error) {
+            _send_rst_stream(stream_id, error);
+            auto it = m_streams.find(stream_id);
+            if (it == m_streams.end()) {
+                return;
+            }
+            if (it->second->m_handling) {
+                it->second->m_reset = true;
+                return;
+            }
+            return _close_stream(it);
+        }
+        if (s == nullptr) {
+            s = m_streams.find(stream_id)->second.get();
+        }
+        else {
+            s->m_req.m_header_parser.finish_header();
+        }
+        if (end_stream) {
+            return _dispatch(*s);
+        }
+    }
+
+    void _dispatch(stream &s) {
+        s.m_req.m_body_finished = true;
+        trace_span span("handle", static_cast<uint32_t>(m_conn.m_fd));
+        m_dispatching = true;
+        s.m_handling = true;
+        Handler::handle(s.m_req, s.m_res, std::pmr::get_default_resource(), m_closing, m_local_peer,
+                        [self = this->shared_from_this(), id = s.m_id, span = std::move(span)] () mutable {
+            span.end();
+            auto it = self->m_streams.find(id);
+            if (it == self->m_streams.end()) {
+                return;
+            }
+            auto &s = *it->second;
+            s.m_handling = false;
+            // reset while an async stage waited
+            if (s.m_reset) {
+                self->_close_stream(it);
+            }
+            else {
+                self->_respond(s);
+            }
+            if (!self->m_dispatching) {
+                self->_schedule();
+                self->_flush();
+            }
+        });
+        m_dispatching = false;
+    }
+
+    void _respond(stream &s) {
+        bytes_buffer block;
+        m_encoder.begin_block(block);
+        for (auto const &[name, value]: s.m_res.m_header_writer.m_fields) {
+            bool index = name != "date" && name != "content-length" && name != "etag";
+            m_encoder.encode(block, name, value, index);
+        }
+
+        bool no_body = s.m_res.body().size() == 0;
+        size_t pos = 0;
+        bool first = true;
+        do {
+            size_t n = std::min<size_t>(block.size() - pos, m_peer_max_frame);
+            bool last = pos + n == block.size();
+            uint8_t flags = (last ? k_http2_end_headers : 0) | (first && no_body ? k_http2_end_stream : 0);
+            _frame_header(first ? http2_frame_type::headers : http2_frame_type::continuation, flags, s.m_id, n);
+            m_out.append(bytes_const_view(block).subspan(pos, n));
+            pos += n;
+            first = false;
+        } while (pos < block.size());
+
+        if (no_body) {
+            return _close_stream(s.m_id);
+        }
+        _enqueue(s);
+    }
+
+    void _enqueue(stream &s) {
+        if (!s.m_queued && s.m_req.request_finished() && s.m_sent < s.m_res.body().size()) {
+            s.m_queued = true;
+            m_send_queue.push_back(s.m_id);
+        }
+    }
+
+    // round-robin DATA frames until windows or the output high-water mark stop us
+    void _schedule() {
+        while (!m_send_queue.empty() && m_conn_send_window > 0 && m_out.size() < k_out_high_water) {
+            uint32_t id = m_send_queue.front();
+            m_send_queue.pop_front();
+            auto it = m_streams.find(id);
+            if (it == m_streams.end()) {
+                continue;
+            }
+            auto &s = *it->second;
+            s.m_queued = false;
+            if (s.m_send_window <= 0) {
+                continue;
+            }
+            // the buffer, or a pinned body: DATA frames copy from either
+            auto body = s.m_res.body();
+            size_t n = std::min<size_t>(body.size() - s.m_sent, m_peer_max_frame);
+            n = std::min<size_t>(n, s.m_send_window);
+            n = std::min<size_t>(n, m_conn_send_window);
+            bool last = s.m_sent + n == body.size();
+            _frame_header(http2_frame_type::data, last ? k_http2_end_stream : 0, id, n);
+            m_out.append(body.subspan(s.m_sent, n));
+            s.m_sent += n;
+            s.m_send_window -= n;
+            m_conn_send_window -= n;
+            if (last) {
+                _close_stream(it);
+            }
+            else {
+                _enqueue(s);
+            }
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,634 @@
+#ifndef HTTP_COMPRESSION_HPP
+#define HTTP_COMPRESSION_HPP
+
+#ifdef CO_HTTP_COMPRESSION
+
+#include <zlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#ifdef CO_HTTP_BROTLI
+#include <brotli/encode.h>
+#endif
+#ifdef CO_HTTP_ZSTD
+#include <zstd.h>
+#endif
+
+#include "bytes_buffer.hpp"
+#include "callback.hpp"
+#include "io_context.hpp"
+#include "http_message.hpp"
+#include "trace.hpp"
+
+// Content-Encoding of responses: gzip and deflate through zlib, br and zstd
+// when the build found their libraries (CO_HTTP_BROTLI, CO_HTTP_ZSTD).
+
+enum class content_coding : uint8_t {
+    identity, deflate, gzip, br, zstd,
+};
+
+constexpr std::string_view content_coding_name(content_coding coding) {
+    switch (coding) {
+    case content_coding::deflate: return "deflate";
+    case content_coding::gzip: return "gzip";
+    case content_coding::br: return "br";
+    case content_coding::zstd: return "zstd";
+    default: return "identity";
+    }
+}
+
+constexpr bool content_coding_available(content_coding coding) {
+    switch (coding) {
+    case content_coding::deflate: return true;
+    case content_coding::gzip: return true;
+#ifdef CO_HTTP_BROTLI
+    case content_coding::br: return true;
+#endif
+#ifdef CO_HTTP_ZSTD
+    case content_coding::zstd: return true;
+#endif
+    default: return false;
+    }
+}
+
+// The best coding of an Accept-Encoding value we can produce: highest q
+// first, on a tie our order br, zstd, gzip, deflate. "*" stands for any
+// coding not listed; identity when nothing acceptable is left.
+inline content_coding negotiate_content_coding(std::string_view accept) {
+    constexpr content_coding preference[] = {
+        content_coding::br, content_coding::zstd, content_coding::gzip, content_coding::deflate,
+    };
+    // q in thousandths per coding, -1 when not listed
+    int q[5] = {-1, -1, -1, -1, -1};
+    int any = -1;
+    auto trim = [] (std::string_view s) {
+        while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) {
+            s.remove_prefix(1);
+        }
+        while (!s.empty() && (s.back() == ' ' || s.back() == '\t')) {
+            s.remove_suffix(1);
+        }
+        return s;
+    };
+    while (!accept.empty()) {
+        size_t comma = accept.find(',');
+        auto item = accept.substr(0, comma);
+        accept.remove_prefix(comma == std::string_view::npos ? accept.size() : comma + 1);
+
+        size_t semi = item.find(';');
+        auto name = trim(item.substr(0, semi));
+        int weight = 1000;
+        if (semi != std::string_view::npos) {
+            auto param = trim(item.substr(semi + 1));
+            if (param.starts_with("q=") || param.starts_with("Q=")) {
+                // "0", "0.5", "1.000"
+                param.remove_prefix(2);
+                weight = param.starts_with("1") ? 1000 : 0;
+                size_t dot = param.find('.');
+                if (param.starts_with("0") && dot != std::string_view::npos) {
+                    int scale = 100;
+                    for (char c: param.substr(dot + 1, 3)) {
+                        if (c < '0' || c > '9') {
+                            break;
+                        }
+                        weight += (c - '0') * scale;
+                        scale /= 10;
+                    }
+                }
+            }
+        }
+        if (name == "*") {
+            any = weight;
+        }
+        else {
+            for (auto coding: preference) {
+                if (http11_header_writer::_iequals(name, content_coding_name(coding))) {
+                    q[static_cast<int>(coding)] = weight;
+                }
+            }
+        }
+    }
+    content_coding best = content_coding::identity;
+    int best_q = 0;
+    for (auto coding: preference) {
+        int weight = q[static_cast<int>(coding)] < 0 ? any : q[static_cast<int>(coding)];
+        if (content_coding_available(coding) && weight > best_q) {
+            best = coding;
+            best_q = weight;
+        }
+    }
+    return best;
+}
+
+// Incremental encoder. write() takes the body piece by piece: flush makes
+// everything so far decodable on its own (for a response streamed in
+// chunks), finish ends the stream. Output is appended to out.
+struct content_encoder {
+    enum class mode {
+        none, flush, finish,
+    };
+
+    content_coding m_coding;
+    z_stream m_zlib{};
+#ifdef CO_HTTP_BROTLI
+    BrotliEncoderState *m_brotli = nullptr;
+#endif
+#ifdef CO_HTTP_ZSTD
+    ZSTD_CCtx *m_zstd = nullptr;
+#endif
+
+    // level: 1-9 for gzip and deflate, 0-11 for br, 1-22 for zstd
+    content_encoder(content_coding coding, int level) : m_coding(coding) {
+        switch (coding) {
+        case content_coding::deflate:
+        case content_coding::gzip:
+            // windowBits 15 is the zlib format HTTP calls deflate, +16 gzip
+            if (deflateInit2(&m_zlib, level, Z_DEFLATED, coding == content_coding::gzip ? 31 : 15,
+                             8, Z_DEFAULT_STRATEGY) != Z_OK) {
+                throw std::bad_alloc();
+            }
+            break;
+#ifdef CO_HTTP_BROTLI
+        case content_coding::br:
+            m_brotli = BrotliEncoderCreateInstance(nullptr, nullptr, nullptr);
+            if (!m_brotli) {
+                throw std::bad_alloc();
+            }
+            BrotliEncoderSetParameter(m_brotli, BROTLI_PARAM_QUALITY, static_cast<uint32_t>(level));
+            break;
+#endif
+#ifdef CO_HTTP_ZSTD
+        case content_coding::zstd:
+            m_zstd = ZSTD_createCCtx();
+            if (!m_zstd) {
+                throw std::bad_alloc();
+            }
+            ZSTD_CCtx_setParameter(m_zstd, ZSTD_c_compressionLevel, level);
+            break;
+#endif
+        default:
+            throw std::invalid_argument("content_encoder: unsupported coding");
+        }
+    }
+
+    content_encoder(content_encoder &&) = delete;
+
+    ~content_encoder() {
+        switch (m_coding) {
+        case content_coding::deflate:
+        case content_coding::gzip:
+            deflateEnd(&m_zlib);
+            break;
+#ifdef CO_HTTP_BROTLI
+        case content_coding::br:
+            BrotliEncoderDestroyInstance(m_brotli);
+            break;
+#endif
+#ifdef CO_HTTP_ZSTD
+        case content_coding::zstd:
+            ZSTD_freeCCtx(m_zstd);
+            break;
+#endif
+        default:
+            break;
+        }
+    }
+
+    // room for at least n more bytes at the end of out
+    static char *_grow(std::string &out, size_t n) {
+        size_t old = out.size();
+        out.resize(old + n);
+        return out.data() + old;
+    }
+
+    void write(bytes_const_view in, std::string &out, mode how) {
+        switch (m_coding) {
+        case content_coding::deflate:
+        case content_coding::gzip:
+            return _write_zlib(in, out, how);
+#ifdef CO_HTTP_BROTLI
+        case content_coding::br:
+            return _write_brotli(in, out, how);
+#endif
+#ifdef CO_HTTP_ZSTD
+        case content_coding::zstd:
+            return _write_zstd(in, out, how);
+#endif
+        default:
+            return;
+        }
+    }
+
+    void _write_zlib(bytes_const_view in, std::string &out, mode how) {
+        int flush = how == mode::finish ? Z_FINISH : how == mode::flush ? Z_SYNC_FLUSH : Z_NO_FLUSH;
+        m_zlib.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(in.data()));
+        m_zlib.avail_in = static_cast<uInt>(in.size());
+        size_t room = deflateBound(&m_zlib, in.size()) + 16;
+        do {
+            m_zlib.next_out = reinterpret_cast<Bytef *>(_grow(out, room));
+            m_zlib.avail_out = static_cast<uInt>(room);
+            deflate(&m_zlib, flush);
+            out.resize(out.size() - m_zlib.avail_out);
+        } while (m_zlib.avail_out == 0);
+    }
+
+#ifdef CO_HTTP_BROTLI
+    void _write_brotli(bytes_const_view in, std::string &out, mode how) {
+        auto op = how == mode::finish ? BROTLI_OPERATION_FINISH
+                : how == mode::flush ? BROTLI_OPERATION_FLUSH : BROTLI_OPERATION_PROCESS;
+        auto next_in = reinterpret_cast<uint8_t const *>(in.data());
+        size_t avail_in = in.size();
+        size_t room = BrotliEncoderMaxCompressedSize(in.size()) + 16;
+        while (true) {
+            auto next_out = reinterpret_cast<uint8_t *>(_grow(out, room));
+            size_t avail_out = room;
+            if (!BrotliEncoderCompressStream(m_brotli, op, &avail_in, &next_in, &avail_out, &next_out, nullptr)) {
+                throw std::runtime_error("brotli: encoder failed");
+            }
+            out.resize(out.size() - avail_out);
+            if (avail_in == 0 && !BrotliEncoderHasMoreOutput(m_brotli)
+                && (op != BROTLI_OPERATION_FINISH || BrotliEncoderIsFinished(m_brotli))) {
+                return;
+            }
+        }
+    }
+#endif
+
+#ifdef CO_HTTP_ZSTD
+    void _write_zstd(bytes_const_view in, std::string &out, mode how) {
+        auto op = how == mode::finish ? ZSTD_e_end : how == mode::flush ? ZSTD_e_flush : ZSTD_e_continue;
+        ZSTD_inBuffer input{in.data(), in.size(), 0};
+        size_t room = ZSTD_compressBound(in.size()) + 16;
+        while (true) {
+            ZSTD_outBuffer output{_grow(out, room), room, 0};
+            size_t left = ZSTD_compressStream2(m_zstd, &output, &input, op);
+            if (ZSTD_isError(left)) {
+                throw std::runtime_error(std::string("zstd: ") + ZSTD_getErrorName(left));
+            }
+            out.resize(out.size() - room + output.pos);
+            if (op == ZSTD_e_continue ? input.pos == input.size : left == 0) {
+                return;
+            }
+        }
+    }
+#endif
+
+    // whole body at once, fed in slices so the encoder's window stays in cache
+    static std::string encode(content_coding coding, int level, bytes_const_view body) {
+        constexpr size_t k_slice = 64 * 1024;
+        content_encoder encoder(coding, level);
+        std::string out;
+        out.reserve(body.size() / 3 + 64);
+        size_t pos = 0;
+        do {
+            auto slice = body.subspan(pos, k_slice);
+            pos += slice.size();
+            encoder.write(slice, out, pos == body.size() ? mode::finish : mode::none);
+        } while (pos < body.size());
+        return out;
+    }
+};
+
+// Encodes on helper threads, so a large body does not hold up the other
+// connections of the event loop; completions are resumed on the submitting
+// io_context through post(). Threads start with the first job.
+//
+// Two instances: get() for responses somebody waits for, background() for
+// the slow top-level variants of compressed_variant_cache. The latter is
+// one SCHED_IDLE thread with a queue of its own, so a br 11 build never
+// sits ahead of a response and only takes CPU time nobody else wants.
+struct compression_pool {
+    struct _job {
+        content_coding m_coding;
+        int m_level;
+        bytes_const_view m_body;
+        io_context *m_ctx;
+        callback<std::string> m_done;
+    };
+
+    std::mutex m_jobs_mutex;
+    std::condition_variable m_jobs_cv;
+    std::deque<_job> m_jobs;
+    bool m_stopped = false;
+    std::vector<std::thread> m_threads;
+    unsigned m_size;
+    bool m_idle_priority;
+
+    explicit compression_pool(unsigned size, bool idle_priority = false)
+        : m_size(size), m_idle_priority(idle_priority) {}
+
+    compression_pool(compression_pool &&) = delete;
+
+    static compression_pool &get() {
+        static compression_pool instance(std::max(1u, std::thread::hardware_concurrency() / 2));
+        return instance;
+    }
+
+    static compression_pool &background() {
+        static compression_pool instance(1, true);
+        return instance;
+    }
+
+    // body must stay valid and unchanged until done runs
+    void submit(content_coding coding, int level, bytes_const_view body, callback<std::string> done) {
+        {
+            std::lock_guard lock(m_jobs_mutex);
+            m_jobs.push_back({coding, level, body, &io_context::get(), std::move(done)});
+            if (m_threads.empty()) {
+                for (unsigned i = 0; i < m_size; i++) {
+                    m_threads.emplace_back([this] { _worker_main(); });
+                }
+            }
+        }
+        m_jobs_cv.notify_one();
+    }
+
+    void _worker_main() {
+        if (m_idle_priority) {
+            struct sched_param param{};
+            (void)pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+        }
+        while (true) {
+            _job job;
+            {
+                std::unique_lock lock(m_jobs_mutex);
+                m_jobs_cv.wait(lock, [this] { return m_stopped || !m_jobs.empty(); });
+                if (m_stopped) {
+                    return;
+                }
+                job = std::move(m_jobs.front());
+                m_jobs.pop_front();
+            }
+
+            std::string out;
+            {
+                TRACE_SCOPE("compress", job.m_body.size());
+                out = content_encoder::encode(job.m_coding, job.m_level, job.m_body);
+            }
+            job.m_ctx->post([done = std::move(job.m_done), out = std::move(out)] () mutable {
+                done(std::move(out));
+            });
+        }
+    }
+
+    ~compression_pool() {
+        {
+            std::lock_guard lock(m_jobs_mutex);
+            m_stopped = true;
+        }
+        m_jobs_cv.notify_all();
+        for (auto &t: m_threads) {
+            t.join();
+        }
+    }
+};
+
+// Compressed variants of cacheable responses, those with a strong ETag,
+// keyed by URL, ETag and coding. Made once at the highest level on
+// compression_pool::background(), and then copied into every later response
+// of that coding. One per loop thread, least recently used entries go first
+// past m_capacity bytes. At most m_max_building bodies wait to be encoded;
+// past that a miss is served at the fast level without starting a build.
+struct compressed_variant_cache {
+    struct _entry {
+        std::string m_key;
+        std::string m_body;
+    };
+
+    size_t m_capacity = 32 * 1024 * 1024;
+    size_t m_bytes = 0;
+    std::list<_entry> m_lru;
+    std::unordered_map<std::string_view, std::list<_entry>::iterator> m_index;
+    // keys whose variant is being made, each holding a copy of its body
+    std::unordered_set<std::string> m_building;
+    size_t m_max_building = 8;
+
+    static compressed_variant_cache &get() {
+        static thread_local compressed_variant_cache instance;
+        return instance;
+    }
+
+    static std::string key(std::string_view url, std::string_view etag, content_coding coding) {
+        std::string k;
+        k.reserve(url.size() + etag.size() + 10);
+        k.append(url).append("\n").append(etag).append("\n").append(content_coding_name(coding));
+        return k;
+    }
+
+    // valid until the next insert
+    std::string const *find(std::string const &key) {
+        auto it = m_index.find(key);
+        if (it == m_index.end()) {
+            return nullptr;
+        }
+        m_lru.splice(m_lru.begin(), m_lru, it->second);
+        return &it->second->m_body;
+    }
+
+    // true when the caller should make key's variant: not cached and not
+    // already in the works; end_build() must follow
+    bool begin_build(std::string const &key) {
+        if (m_index.contains(key) || m_building.size() >= m_max_building) {
+            return false;
+        }
+        return m_building.insert(key).second;
+    }
+
+    void end_build(std::string key, std::string body) {
+        m_building.erase(key);
+        insert(std::move(key), std::move(body));
+    }
+
+    void insert(std::string key, std::string body) {
+        if (body.size() > m_capacity || m_index.contains(key)) {
+            return;
+        }
+        m_bytes += key.size() + body.size();
+        m_lru.push_front({std::move(key), std::move(body)});
+        m_index.emplace(m_lru.front().m_key, m_lru.begin());
+        while (m_bytes > m_capacity) {
+            auto &last = m_lru.back();
+            m_bytes -= last.m_key.size() + last.m_body.size();
+            m_index.erase(last.m_key);
+            m_lru.pop_back();
+        }
+    }
+};
+
+// Middleware stage: negotiates Accept-Encoding before the handler and
+// encodes its response afterwards. Only 200 responses of a textual type
+// past m_min_size are touched. Responses are encoded at the fast levels,
+// bodies past m_offload_size on the compression_pool, where the connection
+// (or HTTP/2 stream) waits for them without blocking its loop. A cacheable
+// response missing from the cache also starts its variant at the cached
+// level in the background, once per key; nobody waits for that one.
+struct http_compression {
+    struct policy {
+        size_t m_min_size = 256;
+        size_t m_offload_size = 64 * 1024;
+        // larger bodies are never cached: br 11 takes seconds per megabyte
+        size_t m_max_cached_size = 1024 * 1024;
+        // responses made per request: fast levels
+        int m_gzip_level = 4;
+        int m_brotli_quality = 4;
+        int m_zstd_level = 3;
+        // variants made once for the cache: the smallest output
+        int m_cached_gzip_level = 9;
+        int m_cached_brotli_quality = 11;
+        int m_cached_zstd_level = 19;
+    };
+
+    // shared by every loop; set before serving
+    static policy &current_policy() {
+        static policy instance;
+        return instance;
+    }
+
+    static int _level(content_coding coding, bool cached) {
+        auto const &p = current_policy();
+        switch (coding) {
+        case content_coding::br: return cached ? p.m_cached_brotli_quality : p.m_brotli_quality;
+        case content_coding::zstd: return cached ? p.m_cached_zstd_level : p.m_zstd_level;
+        default: return cached ? p.m_cached_gzip_level : p.m_gzip_level;
+        }
+    }
+
+    static bool _compressible(std::string_view type) {
+        auto starts = [&] (std::string_view prefix) {
+            return type.size() >= prefix.size() && http11_header_writer::_iequals(type.substr(0, prefix.size()), prefix);
+        };
+        if (starts("text/") || starts("application/json") || starts("application/javascript")
+            || starts("application/xml") || starts("image/svg+xml")) {
+            return true;
+        }
+        auto essence = type.substr(0, type.find(';'));
+        return essence.ends_with("+json") || essence.ends_with("+xml");
+    }
+
+    // "abc" becomes "abc-gzip": a strong ETag names one representation
+    static std::string _variant_etag(std::string_view etag, content_coding coding) {
+        std::string tagged(etag.substr(0, etag.size() - 1));
+        tagged.append("-").append(content_coding_name(coding)).append("\"");
+        return tagged;
+    }
+
+    template <class Exchange, class Next>
+    void operator()(Exchange &ex, Next next) {
+        auto coding = content_coding::identity;
+        if (ex.m_req.method() != http_method::HEAD) {
+            auto &headers = ex.m_req.headers();
+            auto it = headers.find("accept-encoding");
+            if (it != headers.end()) {
+                coding = negotiate_content_coding(it->second);
+            }
+        }
+        return next.then([coding] (Exchange &ex, auto done) {
+            return _encode(ex, coding, std::move(done));
+        });
+    }
+
+    template <class Exchange, class Done>
+    static void _encode(Exchange &ex, content_coding coding, Done done) {
+        auto &res = ex.m_res;
+        if (res.status() != http_status::ok || res.body().size() < current_policy().m_min_size
+            || !_compressible(res.header("content-type")) || !res.header("content-encoding").empty()) {
+            return done();
+        }
+        // caches must key this response on Accept-Encoding whatever we pick
+        _add_vary(res);
+        if (coding == content_coding::identity) {
+            return done();
+        }
+        // the header edit above moved it
+        auto body = res.body();
+
+        auto etag = res.header("etag");
+        bool cacheable = etag.size() >= 2 && etag.front() == '"' && etag.back() == '"';
+        if (cacheable) {
+            auto &cache = compressed_variant_cache::get();
+            auto key = compressed_variant_cache::key(ex.m_req.url(), etag, coding);
+            if (auto *hit = cache.find(key)) {
+                _apply(res, coding, *hit);
+                return done();
+            }
+            if (body.size() <= current_policy().m_max_cached_size && cache.begin_build(key)) {
+                // the response goes away with its connection: encode a copy
+                auto copy = std::make_shared<std::string const>(body.data(), body.size());
+                compression_pool::background().submit(coding, _level(coding, true), bytes_const_view{copy->data(), copy->size()},
+                                               [key = std::move(key), copy] (std::string out) mutable {
+                    compressed_variant_cache::get().end_build(std::move(key), std::move(out));
+                });
+            }
+        }
+        if (body.size() < current_policy().m_offload_size) {
+            auto out = content_encoder::encode(coding, _level(coding, false), body);
+            _apply(res, coding, out);
+            return done();
+        }
+        compression_pool::get().submit(coding, _level(coding, false), body,
+                                       [ex, coding, done = std::move(done)] (std::string out) mutable {
+            _apply(ex.m_res, coding, out);
+            return done();
+        });
+    }
+
+    // Accept-Encoding joins whatever Vary the handler set, unless it is
+    // already there or the value is "*"
+    template <class Response>
+    static void _add_vary(Response &res) {
+        auto vary = res.header("vary");
+        if (vary.empty()) {
+            return res.set_header("Vary", "Accept-Encoding");
+        }
+        std::string_view rest = vary;
+        while (!rest.empty()) {
+            size_t comma = rest.find(',');
+            auto item = rest.substr(0, comma);
+            rest.remove_prefix(comma == std::string_view::npos ? rest.size() : comma + 1);
+            while (!item.empty() && (item.front() == ' ' || item.front() == '\t')) {
+                item.remove_prefix(1);
+            }
+            while (!item.empty() && (item.back() == ' ' || item.back() == '\t')) {
+                item.remove_suffix(1);
+            }
+            if (item == "*" || http11_header_writer::_iequals(item, "accept-encoding")) {
+                return;
+            }
+        }
+        std::string joined(vary);
+        joined.append(", Accept-Encoding");
+        res.set_header("Vary", joined);
+    }
+
+    // keeps the identity body when encoding did not make it smaller
+    template <class Response>
+    static void _apply(Response &res, content_coding coding, std::string const &encoded) {
+        if (encoded.size() >= res.body().size()) {
+            return;
+        }
+        auto etag = res.header("etag");
+        if (!etag.empty()) {
+            res.set_header("ETag", _variant_etag(etag, coding));
+        }
+        res.set_header("Content-Encoding", content_coding_name(coding));
+        res.replace_body(bytes_const_view{encoded.data(), encoded.size()});
+    }
+};
+
+#endif
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef HTTP_DATE_HPP
+#define HTTP_DATE_HPP
+
+#include <ctime>
+#include <string_view>
+
+// IMF-fixdate ("Sun, 06 Nov 1994 08:49:37 GMT") of the current second,
+// reformatted at most once per second per thread.
+struct http_date_cache {
+    static constexpr size_t k_size = 29;
+
+    time_t m_last = -1;
+    char m_buf[k_size];
+
+    std::string_view now() {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+        if (ts.tv_sec != m_last) {
+            _format(ts.tv_sec);
+        }
+        return {m_buf, k_size};
+    }
+
+    void _format(time_t t) {
+        static constexpr char days[] = "SunMonTueWedThuFriSat";
+        static constexpr char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+        struct tm tm;
+        gmtime_r(&t, &tm);
+        auto put2 = [] (char *p, int v) {
+            p[0] = static_cast<char>('0' + v / 10);
+            p[1] = static_cast<char>('0' + v % 10);
+        };
+        char *p = m_buf;
+        p[0] = days[tm.tm_wday * 3];
+        p[1] = days[tm.tm_wday * 3 + 1];
+        p[2] = days[tm.tm_wday * 3 + 2];
+        p[3] = ',';
+        p[4] = ' ';
+        put2(p + 5, tm.tm_mday);
+        p[7] = ' ';
+        p[8] = months[tm.tm_mon * 3];
+        p[9] = months[tm.tm_mon * 3 + 1];
+        p[10] = months[tm.tm_mon * 3 + 2];
+        p[11] = ' ';
+        int year = tm.tm_year + 1900;
+        put2(p + 12, year / 100);
+        put2(p + 14, year % 100);
+        p[16] = ' ';
+        put2(p + 17, tm.tm_hour);
+        p[19] = ':';
+        put2(p + 20, tm.tm_min);
+        p[22] = ':';
+        put2(p + 23, tm.tm_sec);
+        p[25] = ' ';
+        p[26] = 'G';
+        p[27] = 'M';
+        p[28] = 'T';
+        m_last = t;
+    }
+
+    static http_date_cache &get() {
+        static thread_local http_date_cache instance;
+        return instance;
+    }
+};
+
+#endif
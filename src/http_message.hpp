@@ -0,0 +1,609 @@
+#ifndef HTTP_MESSAGE_HPP
+#define HTTP_MESSAGE_HPP
+
+#include <string>
+#include <map>
+#include <algorithm>
+#include <cassert>
+#include <charconv>
+#include <cstring>
+#include <memory>
+#include <memory_resource>
+
+#include "bytes_buffer.hpp"
+#include "eref.hpp"
+#include "http_date.hpp"
+#include "trace.hpp"
+
+using StringMap = std::pmr::map<std::pmr::string, std::pmr::string, std::less<>>;
+
+enum class http_method : uint8_t {
+    unknown, GET, HEAD, POST, PUT, DELETE, CONNECT, OPTIONS, TRACE, PATCH,
+};
+
+enum class http_status : uint16_t {
+    unknown = 0,
+    continue_ = 100, switching_protocols = 101,
+    ok = 200, created = 201, accepted = 202, no_content = 204, partial_content = 206,
+    moved_permanently = 301, found = 302, see_other = 303, not_modified = 304,
+    temporary_redirect = 307, permanent_redirect = 308,
+    bad_request = 400, unauthorized = 401, forbidden = 403, not_found = 404,
+    method_not_allowed = 405, request_timeout = 408, length_required = 411,
+    payload_too_large = 413, uri_too_long = 414, unsupported_media_type = 415,
+    expectation_failed = 417, upgrade_required = 426, too_many_requests = 429,
+    request_header_fields_too_large = 431,
+    internal_server_error = 500, not_implemented = 501, bad_gateway = 502,
+    service_unavailable = 503, gateway_timeout = 504, http_version_not_supported = 505,
+};
+
+constexpr std::string_view http_status_reason(http_status status) {
+    switch (status) {
+    case http_status::continue_: return "Continue";
+    case http_status::switching_protocols: return "Switching Protocols";
+    case http_status::ok: return "OK";
+    case http_status::created: return "Created";
+    case http_status::accepted: return "Accepted";
+    case http_status::no_content: return "No Content";
+    case http_status::partial_content: return "Partial Content";
+    case http_status::moved_permanently: return "Moved Permanently";
+    case http_status::found: return "Found";
+    case http_status::see_other: return "See Other";
+    case http_status::not_modified: return "Not Modified";
+    case http_status::temporary_redirect: return "Temporary Redirect";
+    case http_status::permanent_redirect: return "Permanent Redirect";
+    case http_status::bad_request: return "Bad Request";
+    case http_status::unauthorized: return "Unauthorized";
+    case http_status::forbidden: return "Forbidden";
+    case http_status::not_found: return "Not Found";
+    case http_status::method_not_allowed: return "Method Not Allowed";
+    case http_status::request_timeout: return "Request Timeout";
+    case http_status::length_required: return "Length Required";
+    case http_status::payload_too_large: return "Payload Too Large";
+    case http_status::uri_too_long: return "URI Too Long";
+    case http_status::unsupported_media_type: return "Unsupported Media Type";
+    case http_status::expectation_failed: return "Expectation Failed";
+    case http_status::upgrade_required: return "Upgrade Required";
+    case http_status::too_many_requests: return "Too Many Requests";
+    case http_status::request_header_fields_too_large: return "Request Header Fields Too Large";
+    case http_status::internal_server_error: return "Internal Server Error";
+    case http_status::not_implemented: return "Not Implemented";
+    case http_status::bad_gateway: return "Bad Gateway";
+    case http_status::service_unavailable: return "Service Unavailable";
+    case http_status::gateway_timeout: return "Gateway Timeout";
+    case http_status::http_version_not_supported: return "HTTP Version Not Supported";
+    default: return "Unknown";
+    }
+}
+
+struct http11_header_parser {
+    std::pmr::string m_header;
+    size_t m_headline_len = 0;
+    StringMap m_header_keys;
+    std::pmr::string m_body;
+    bool m_header_finished = false;
+
+    explicit http11_header_parser(std::pmr::memory_resource *mr = std::pmr::get_default_resource())
+        : m_header(mr), m_header_keys(mr), m_body(mr) {}
+
+    void reset_state() {
+        // swap rather than assign: assigning keeps the old (arena) capacity
+        auto mr = m_header.get_allocator();
+        std::pmr::string(mr).swap(m_header);
+        m_headline_len = 0;
+        StringMap(mr).swap(m_header_keys);
+        std::pmr::string(mr).swap(m_body);
+        m_header_finished = 0;
+    }
+
+    [[nodiscard]] bool header_finished() const {
+        return m_header_finished;
+    }
+
+    void _extract_header() {
+        size_t pos = m_header.find("\r\n");
+        while (pos != std::string::npos) {
+            pos += 2;
+            size_t next_pos = m_header.find("\r\n", pos);
+            size_t line_len = std::string::npos;
+            if (next_pos != std::string::npos) {
+                line_len = next_pos - pos;
+            }
+            std::string_view line = std::string_view(m_header).substr(pos, line_len);
+            size_t colon = line.find(": ");
+            if (colon != std::string::npos) {
+                std::pmr::string key(line.substr(0, colon), m_header.get_allocator());
+                std::string_view value = line.substr(colon + 2);
+                std::transform(key.begin(), key.end(), key.begin(), [] (char c) {
+                    if (c >= 'A' && c <= 'Z') {
+                        c += 'a' - 'A';
+                    }
+                    return c;
+                });
+                m_header_keys.insert_or_assign(std::move(key), value);
+            }
+            pos = next_pos;
+        }
+    }
+
+    void push_chunk(std::string_view chunk) {
+        assert(!m_header_finished);
+        m_header.append(chunk);
+        size_t header_len = m_header.find("\r\n\r\n");
+        if (header_len != std::string::npos) {
+            m_header_finished = true;
+            m_body.assign(m_header, header_len + 4);
+            m_header.resize(header_len);
+            m_headline_len = std::min(m_header.find("\r\n"), header_len);
+            _extract_header();
+        }
+    }
+
+    std::string_view headline() const {
+        return std::string_view(m_header).substr(0, m_headline_len);
+    }
+
+    StringMap &headers() {
+        return m_header_keys;
+    }
+
+    std::pmr::string &headers_raw() {
+        return m_header;
+    }
+
+    std::pmr::string &extra_body() {
+        return m_body;
+    }
+};
+
+template <typename HeaderParser = http11_header_parser>
+struct _http_base_parser {
+    HeaderParser m_header_parser;
+    bool m_body_finished = false;
+    size_t body_accumulated_size = 0;
+    size_t content_length = 0;
+
+    explicit _http_base_parser(std::pmr::memory_resource *mr = std::pmr::get_default_resource())
+        : m_header_parser(mr) {}
+
+    void reset_state() {
+        m_header_parser.reset_state();
+        m_body_finished = false;
+        body_accumulated_size = 0;
+        content_length = 0;
+    }
+
+    [[nodiscard]] bool header_finished() const {
+        return m_header_parser.header_finished();
+    }    
+
+    [[nodiscard]] bool request_finished() const {
+        return m_body_finished;
+    }
+
+    std::pmr::string &headers_raw() {
+        return m_header_parser.headers_raw();
+    }
+
+    std::string_view headline() const {
+        return m_header_parser.headline();
+    }
+
+    StringMap &headers() {
+        return m_header_parser.headers();
+    }
+
+    // "GET / HTTP1.1"      request
+    // "HTTP1.1 200 OK"     response
+    std::string_view _handline_first() const {
+        auto line = m_header_parser.headline();
+        size_t space = line.find(' ');
+        if (space == std::string_view::npos) {
+            return {};
+        }
+        return line.substr(0, space);
+    }
+
+    std::string_view _handline_second() const {
+        auto line = m_header_parser.headline();
+        size_t space1 = line.find(' ');
+        if (space1 == std::string_view::npos) {
+            return {};
+        }
+        size_t space2 = line.find(' ', space1 + 1);
+        if (space2 == std::string_view::npos) {
+            return {};
+        }
+        return line.substr(space1 + 1, space2 - space1 - 1);
+    }
+
+    std::string_view _handline_third() const {
+        auto line = m_header_parser.headline();
+        size_t space1 = line.find(' ');
+        if (space1 == std::string_view::npos) {
+            return {};
+        }
+        size_t space2 = line.find(' ', space1 + 1);
+        if (space2 == std::string_view::npos) {
+            return {};
+        }
+        return line.substr(space2 + 1);
+    }
+
+    std::pmr::string &body() {
+        return m_header_parser.extra_body();
+    }
+
+    size_t _extract_content_length() {
+        auto &headers = m_header_parser.headers();
+        auto it = headers.find("content-length");
+        if (it == headers.end()) {
+            return 0;
+        }
+        size_t n = 0;
+        auto &value = it->second;
+        if (std::from_chars(value.data(), value.data() + value.size(), n).ec != std::errc()) {
+            return 0;
+        }
+        return n;
+    }
+
+    void push_chunk(std::string_view chunk) {
+        assert(!m_body_finished);
+        TRACE_SCOPE("parse", TRACE_CURRENT_CONN);
+        if (!m_header_parser.header_finished()) {
+            m_header_parser.push_chunk(chunk);
+            if (m_header_parser.header_finished()) {
+                body_accumulated_size = body().size();
+                content_length = _extract_content_length();
+                if (body_accumulated_size >= content_length) {
+                    m_body_finished = true;
+                }
+            }
+        }
+        else {
+            body().append(chunk);
+            body_accumulated_size += chunk.size();
+            if (body_accumulated_size >= content_length) {
+                m_body_finished = true;
+            }
+        }
+    }
+
+    std::pmr::string read_some_body() {
+        return std::move(body());
+    }
+};
+
+template <typename HeaderParser = http11_header_parser>
+struct http_request_parser : _http_base_parser<HeaderParser> {
+    using _http_base_parser<HeaderParser>::_http_base_parser;
+
+    http_method method() const {
+        return eref::try_enum_from_name<http_method>(this->_handline_first()).value_or(http_method::unknown);
+    }
+
+    std::string_view method_raw() const {
+        return this->_handline_first();
+    }
+
+    std::string_view url() const {
+        return this->_handline_second();
+    }
+
+    std::string_view version() const {
+        return this->_handline_third();
+    }
+};
+
+template <typename HeaderParser = http11_header_parser>
+struct http_response_parser : _http_base_parser<HeaderParser> {
+    using _http_base_parser<HeaderParser>::_http_base_parser;
+
+    std::string_view version() const {
+        return this->_handline_first();
+    }
+
+    http_status status() const {
+        auto code = this->_handline_second();
+        uint16_t n = 0;
+        if (code.size() != 3) {
+            return http_status::unknown;
+        }
+        for (char c: code) {
+            if (c < '0' || c > '9') {
+                return http_status::unknown;
+            }
+            n = n * 10 + (c - '0');
+        }
+        return static_cast<http_status>(n);
+    }
+
+    std::string_view reason() const {
+        return this->_handline_third();
+    }
+};
+
+template <size_t N>
+struct fixed_string {
+    char m_data[N]{};
+
+    constexpr fixed_string(char const (&str)[N]) {
+        std::copy_n(str, N, m_data);
+    }
+
+    constexpr std::string_view view() const {
+        return {m_data, N - 1};
+    }
+};
+
+// Status line and constant "Key: value" fields serialized at compile time;
+// writers only append Date, Content-Length and ETag after it.
+template <http_status Status, fixed_string ...Fields>
+struct http_header_template {
+    static constexpr std::string_view k_reason = http_status_reason(Status);
+    static constexpr size_t k_size = 13 + k_reason.size() + (0 + ... + (2 + Fields.view().size()));
+
+    static constexpr std::array<char, k_size> k_block = [] {
+        std::array<char, k_size> block{};
+        size_t i = 0;
+        auto put = [&] (std::string_view s) {
+            for (char c: s) {
+                block[i++] = c;
+            }
+        };
+        auto code = static_cast<unsigned>(Status);
+        put("HTTP/1.1 ");
+        block[i++] = static_cast<char>('0' + code / 100 % 10);
+        block[i++] = static_cast<char>('0' + code / 10 % 10);
+        block[i++] = static_cast<char>('0' + code % 10);
+        put(" ");
+        put(k_reason);
+        ((put("\r\n"), put(Fields.view())), ...);
+        return block;
+    }();
+
+    static constexpr std::string_view view() {
+        return {k_block.data(), k_block.size()};
+    }
+};
+
+struct http11_header_writer {
+    bytes_buffer m_buffer;
+
+    explicit http11_header_writer(std::pmr::memory_resource *mr = std::pmr::get_default_resource())
+        : m_buffer(mr) {}
+
+    void reset_state() {
+        m_buffer.release();
+    }
+
+    bytes_buffer &buffer() {
+        return m_buffer;
+    }
+
+    void begin_header(std::string_view first, std::string_view second,
+                      std::string_view third) {
+        m_buffer.append(first);
+        m_buffer.append_literial(" ");
+        m_buffer.append(second);
+        m_buffer.append_literial(" ");
+        m_buffer.append(third);
+    }
+
+    void writer_header(std::string_view key, std::string_view value) {
+        m_buffer.append_literial("\r\n");
+        m_buffer.append(key);
+        m_buffer.append_literial(": ");
+        m_buffer.append(value);
+    }
+    
+    void end_header() {
+        m_buffer.append_literial("\r\n\r\n");
+    }
+
+    static char *_put(char *p, std::string_view s) {
+        std::memcpy(p, s.data(), s.size());
+        return p + s.size();
+    }
+
+    void write_template(std::string_view block, size_t content_length, std::string_view etag) {
+        constexpr std::string_view date_key = "\r\nDate: ";
+        constexpr std::string_view length_key = "\r\nContent-Length: ";
+        constexpr std::string_view etag_key = "\r\nETag: ";
+        std::string_view date = http_date_cache::get().now();
+
+        size_t old_size = m_buffer.size();
+        size_t max_size = block.size() + date_key.size() + date.size() + length_key.size() + 20
+                        + (etag.empty() ? 0 : etag_key.size() + etag.size()) + 4;
+        m_buffer.resize(old_size + max_size);
+
+        char *p = m_buffer.data() + old_size;
+        p = _put(p, block);
+        p = _put(p, date_key);
+        p = _put(p, date);
+        p = _put(p, length_key);
+        p = std::to_chars(p, p + 20, content_length).ptr;
+        if (!etag.empty()) {
+            p = _put(p, etag_key);
+            p = _put(p, etag);
+        }
+        p = _put(p, "\r\n\r\n");
+        m_buffer.resize(p - m_buffer.data());
+    }
+
+    // Reading and editing a finished response, for stages that run after the
+    // handler. The buffer holds "status line\r\nfields\r\n\r\nbody".
+
+    size_t _header_size() const {
+        std::string_view all = m_buffer;
+        size_t end = all.find("\r\n\r\n");
+        return end == std::string_view::npos ? all.size() : end + 4;
+    }
+
+    static bool _iequals(std::string_view a, std::string_view b) {
+        auto lower = [] (char c) {
+            return (c >= 'A' && c <= 'Z') ? static_cast<char>(c + 'a' - 'A') : c;
+        };
+        return std::ranges::equal(a, b, {}, lower, lower);
+    }
+
+    // offset and size of key's value, npos if absent
+    std::pair<size_t, size_t> _find_field(std::string_view key) const {
+        std::string_view header = std::string_view(m_buffer).substr(0, _header_size());
+        size_t eol = header.find("\r\n");
+        while (eol != std::string_view::npos && eol + 4 < header.size()) {
+            size_t start = eol + 2;
+            eol = header.find("\r\n", start);
+            auto line = header.substr(start, eol - start);
+            size_t colon = line.find(": ");
+            if (colon != std::string_view::npos && _iequals(line.substr(0, colon), key)) {
+                return {start + colon + 2, line.size() - colon - 2};
+            }
+        }
+        return {std::string_view::npos, 0};
+    }
+
+    http_status status() const {
+        std::string_view all = m_buffer;
+        unsigned code = 0;
+        if (all.size() >= 12) {
+            std::from_chars(all.data() + 9, all.data() + 12, code);
+        }
+        return static_cast<http_status>(code);
+    }
+
+    std::string_view field_value(std::string_view key) const {
+        auto [pos, size] = _find_field(key);
+        if (pos == std::string_view::npos) {
+            return {};
+        }
+        return std::string_view(m_buffer).substr(pos, size);
+    }
+
+    void set_field(std::string_view key, std::string_view value) {
+        auto [pos, size] = _find_field(key);
+        if (pos != std::string_view::npos) {
+            return m_buffer.splice(pos, size, value);
+        }
+        std::string line = "\r\n";
+        line.append(key).append(": ").append(value);
+        m_buffer.splice(_header_size() - 4, 0, line);
+    }
+
+    bytes_const_view body() const {
+        return bytes_const_view(m_buffer).subspan(_header_size());
+    }
+
+    // also rewrites Content-Length
+    void replace_body(bytes_const_view body) {
+        char digits[20];
+        auto end = std::to_chars(digits, digits + sizeof(digits), body.size()).ptr;
+        set_field("Content-Length", std::string_view(digits, end - digits));
+        m_buffer.resize(_header_size());
+        m_buffer.append(body);
+    }
+};
+
+template <typename HeaderWriter = http11_header_writer>
+struct _http_base_writer {
+    HeaderWriter m_header_writer;
+    // body held by reference instead of in buffer(), see write_pinned_body
+    std::shared_ptr<std::string const> m_pinned_body;
+
+    explicit _http_base_writer(std::pmr::memory_resource *mr = std::pmr::get_default_resource())
+        : m_header_writer(mr) {}
+
+    void _begin_header(std::string_view first, std::string_view second,
+                       std::string_view third) {
+        m_header_writer.begin_header(first, second, third);
+    }
+
+    void reset_state() {
+        m_header_writer.reset_state();        
+        m_pinned_body.reset();
+    }
+
+    bytes_buffer &buffer() {
+        return m_header_writer.buffer();
+    }
+
+    void writer_header(std::string_view key, std::string_view value) {
+        m_header_writer.writer_header(key, value);
+    }
+
+    void end_header() {
+        m_header_writer.end_header();
+    }
+
+    void write_body(std::string_view body) {
+        m_header_writer.buffer().append(body);
+    }
+
+    // A large body by reference: it is never copied into buffer(), and an
+    // HTTP/1.1 connection may send it with MSG_ZEROCOPY, keeping it alive
+    // until the kernel no longer needs its pages. HTTP/2 frames it from
+    // here as well.
+    void write_pinned_body(std::shared_ptr<std::string const> body) {
+        m_pinned_body = std::move(body);
+    }
+
+    http_status status() const {
+        return m_header_writer.status();
+    }
+
+    // a field of the response written so far, empty if absent
+    std::string_view header(std::string_view key) const {
+        return m_header_writer.field_value(key);
+    }
+
+    // replace the field's value, or add it
+    void set_header(std::string_view key, std::string_view value) {
+        m_header_writer.set_field(key, value);
+    }
+
+    bytes_const_view body() const {
+        if (m_pinned_body) {
+            return {m_pinned_body->data(), m_pinned_body->size()};
+        }
+        return m_header_writer.body();
+    }
+
+    void replace_body(bytes_const_view body) {
+        m_pinned_body.reset();
+        m_header_writer.replace_body(body);
+    }
+};
+
+// "GET / HTTP1.1"      request
+template <typename HeaderWriter = http11_header_writer>
+struct http_request_writer : _http_base_writer<HeaderWriter> {
+    using _http_base_writer<HeaderWriter>::_http_base_writer;
+
+    void begin_header(http_method method, std::string_view url) {
+        this->_begin_header(eref::get_enum_name(method), url, "HTTP/1.1");
+    }
+};
+
+// "HTTP1.1 200 OK"     response
+template <typename HeaderWriter = http11_header_writer>
+struct http_response_writer : _http_base_writer<HeaderWriter> {
+    using _http_base_writer<HeaderWriter>::_http_base_writer;
+
+    void begin_header(http_status status) {
+        auto code = static_cast<unsigned>(status);
+        char digits[3] = {
+            static_cast<char>('0' + code / 100 % 10),
+            static_cast<char>('0' + code / 10 % 10),
+            static_cast<char>('0' + code % 10),
+        };
+        this->_begin_header("HTTP/1.1", std::string_view(digits, 3), http_status_reason(status));
+    }
+
+    // whole header from a http_header_template, including the terminating blank line
+    template <class Template>
+    void write_header(size_t content_length, std::string_view etag = {}) {
+        this->m_header_writer.write_template(Template::view(), content_length, etag);
+    }
+};
+
+#endif
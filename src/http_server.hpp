@@ -2,315 +2,319 @@
 #define HTTP_SERVER_HPP
 
 #include <string>
-#include <map>
 #include <algorithm>
-#include <cassert>
 #include <memory>
+#include <chrono>
+#include <unordered_set>
+#include <vector>
+#include <cctype>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include "exception.hpp"
 #include "address_resolver.hpp"
 #include "bytes_buffer.hpp"
 #include "async_file.hpp"
-
-using StringMap = std::map<std::string, std::string>;
-
-struct http11_header_parser {
-    std::string m_header;
-    std::string m_header_line;
-    StringMap m_header_keys;
-    std::string m_body;
-    bool m_header_finished = false;
-
-    void reset_state() {
-        m_header.clear();
-        m_header_line.clear();
-        m_header_keys.clear();
-        m_body.clear();
-        m_header_finished = 0;
-    }
-
-    [[nodiscard]] bool header_finished() const {
-        return m_header_finished;
-    }
-
-    void _extract_header() {
-        size_t pos = m_header.find("\r\n");
-        while (pos != std::string::npos) {
-            pos += 2;
-            size_t next_pos = m_header.find("\r\n", pos);
-            size_t line_len = std::string::npos;
-            if (next_pos != std::string::npos) {
-                line_len = next_pos - pos;
+#include "http_message.hpp"
+#include "request_arena.hpp"
+#include "websocket.hpp"
+#include "http2.hpp"
+#include "tls_context.hpp"
+#include "admission_control.hpp"
+#include "trace.hpp"
+#include "cpu_placement.hpp"
+#include "middleware.hpp"
+#include "http_compression.hpp"
+#include "zerocopy.hpp"
+#include "async_resolver.hpp"
+#include "connection_drain.hpp"
+
+// Application logic, shared by HTTP/1.1 connections and HTTP/2 streams.
+struct http_default_handler {
+    using response_header = http_header_template<http_status::ok,
+        "Server: co_http",
+        "Content-type: text/html;charset=utf-8",
+        "Connection: keep-alive">;
+    using closing_response_header = http_header_template<http_status::ok,
+        "Server: co_http",
+        "Content-type: text/html;charset=utf-8",
+        "Connection: close">;
+
+    template <class Request, class Response>
+    static void handle(Request &req, Response &res, std::pmr::memory_resource *mr, bool closing) {
+        auto &req_body = req.body();
+        auto fill = [&] (auto &body) {
+            if (req_body.empty()) {
+                body = "你好，你的请求正文为空哦";
             }
-            std::string_view line = std::string_view(m_header).substr(pos, line_len);
-            size_t colon = line.find(": ");
-            if (colon != std::string::npos) {
-                std::string key = std::string(line.substr(0, colon));
-                std::string_view value = line.substr(colon + 2);
-                std::transform(key.begin(), key.end(), key.begin(), [] (char c) {
-                    if (c >= 'A' && c <= 'Z') {
-                        c += 'a' - 'A';
-                    }
-                    return c;
-                });
-                m_header_keys.insert_or_assign(std::move(key), value);
+            else {
+                std::format_to(std::back_inserter(body), "你好，你的请求是: [{}]，共 {} 字节", req_body, req_body.size());
             }
-            pos = next_pos;
-        }
-    }
-
-    void push_chunk(std::string_view chunk) {
-        assert(!m_header_finished);
-        m_header.append(chunk);
-        size_t header_len = m_header.find("\r\n\r\n");
-        if (header_len != std::string::npos) {
-            m_header_finished = true;
-            m_body = m_header.substr(header_len + 4);
-            m_header.resize(header_len);
-            _extract_header();
+        };
+        auto write_header = [&] (size_t size) {
+            if (closing) {
+                res.template write_header<closing_response_header>(size);
+            }
+            else {
+                res.template write_header<response_header>(size);
+            }
+        };
+
+        // bodies that will go out with MSG_ZEROCOPY are built on the heap and
+        // handed over pinned (see write_pinned_body); the rest are copied once
+        // into the response buffer, which writes header and body together
+        if (zerocopy_tracker::wanted(req_body.size())) {
+            auto body = std::make_shared<std::string>();
+            body->reserve(req_body.size() + 64);
+            fill(*body);
+            write_header(body->size());
+            return res.write_pinned_body(std::move(body));
         }
-    }
 
-    std::string& headline() {
-        return m_header_line;
-    }
-
-    StringMap &headers() {
-        return m_header_keys;
-    }
+        std::pmr::string body(mr);
+        fill(body);
+        write_header(body.size());
 
-    std::string &headers_raw() {
-        return m_header;
-    }
+        // std::println("我的响应头: {}", buffer);
+        // std::println("我的响应正文: {}", body);
+        // std::println("正在响应");
 
-    std::string &extra_body() {
-        return m_body;
+        res.write_body(body);
     }
 };
 
-template <typename HeaderParser = http11_header_parser>
-struct _http_base_parser {
-    HeaderParser m_header_parser;
-    bool m_body_finished = false;
-    size_t body_accumulated_size = 0;
-    size_t content_length = 0;
-
-    void reset_state() {
-        m_header_parser.reset_state();
-        m_body_finished = false;
-        body_accumulated_size = 0;
-        content_length = 0;
-    }
-
-    [[nodiscard]] bool header_finished() const {
-        return m_header_parser.header_finished();
-    }    
-
-    [[nodiscard]] bool request_finished() const {
-        return m_body_finished;
-    }
-
-    std::string &headers_raw() {
-        return m_header_parser.headers_raw();
-    }
-
-    std::string headline() {
-        return m_header_parser.headline();
-    }
-
-    StringMap &headers() {
-        return m_header_parser.headers();
+// Introspection endpoints, answered before the application sees the request.
+struct http_debug_routes {
+    using json_response_header = http_header_template<http_status::ok,
+        "Server: co_http",
+        "Content-type: application/json",
+        "Connection: close">;
+    using bad_request_header = http_header_template<http_status::bad_request,
+        "Server: co_http",
+        "Connection: close">;
+    using forbidden_header = http_header_template<http_status::forbidden,
+        "Server: co_http",
+        "Connection: close">;
+
+    template <class Exchange>
+    static void _reply_json(Exchange &ex, std::string const &json) {
+        ex.m_res.template write_header<json_response_header>(json.size());
+        ex.m_res.write_body(json);
+    }
+
+    // host names and address literals only; they end up in JSON unescaped
+    static bool _valid_host(std::string_view name) {
+        return !name.empty() && name.size() <= 253 && std::ranges::all_of(name, [] (char c) {
+            return std::isalnum(static_cast<unsigned char>(c)) || c == '.' || c == '-' || c == ':';
+        });
     }
 
-    // "GET / HTTP1.1"      request
-    // "HTTP1.1 200 OK"     response
-    std::string _handline_first() {
-        auto &line = m_header_parser.headline();
-        size_t space = line.find(" ");
-        if (space == std::string::npos) {
-            return "";
+    static std::string _resolve_json(std::string_view name, std::error_code ec, async_resolver::result const &res) {
+        if (ec) {
+            return std::format(R"({{"name":"{}","error":"{}"}})" "\n", name, ec.message());
         }
-        return line.substr(0, space);   
-    }
-
-    std::string _handline_second() {
-        auto &line = m_header_parser.headline();
-        size_t space1 = line.find(" ");
-        if (space1 == std::string::npos) {
-            return "";
+        std::vector<std::string> addrs;
+        for (auto *ai = res->m_head; ai; ai = ai->ai_next) {
+            char text[INET6_ADDRSTRLEN] = "";
+            if (ai->ai_family == AF_INET) {
+                inet_ntop(AF_INET, &reinterpret_cast<struct sockaddr_in *>(ai->ai_addr)->sin_addr, text, sizeof(text));
+            }
+            else if (ai->ai_family == AF_INET6) {
+                inet_ntop(AF_INET6, &reinterpret_cast<struct sockaddr_in6 *>(ai->ai_addr)->sin6_addr, text, sizeof(text));
+            }
+            // one entry per socket type: list each address once
+            if (*text && std::ranges::find(addrs, text) == addrs.end()) {
+                addrs.emplace_back(text);
+            }
         }
-        size_t space2 = line.find(" ", space1);
-        if (space2 == std::string::npos) {
-            return "";
+        std::string json = std::format(R"({{"name":"{}","addresses":[)", name);
+        for (size_t i = 0; i < addrs.size(); i++) {
+            std::format_to(std::back_inserter(json), R"({}"{}")", i ? "," : "", addrs[i]);
         }
-        return line.substr(space1 + 1, space2 - space1 - 1);
+        json += "]}\n";
+        return json;
     }
 
-    std::string _handline_third() {
-        auto &line = m_header_parser.headline();
-        size_t space1 = line.find(" ");
-        if (space1 == std::string::npos) {
-            return "";
-        }
-        size_t space2 = line.find(" ", space1);
-        if (space2 == std::string::npos) {
-            return "";
+    template <class Exchange, class Next>
+    void operator()(Exchange &ex, Next next) {
+        auto url = ex.m_req.url();
+        if (!url.starts_with("/debug/")) {
+            return next();
         }
-        return line.substr(space2);
-    }
-
-    std::string body() {
-        return m_header_parser.extra_body();
-    }
-
-    size_t _extract_content_length() {
-        auto &headers = m_header_parser.headers();
-        auto it = headers.find("content-length");
-        if (it == headers.end()) {
-            return 0;
+        // traces and resolver answers are for the operator, not the internet
+        if (!ex.m_local_peer) {
+            ex.m_res.template write_header<forbidden_header>(0);
+            return next.finish();
         }
-        try {
-            return std::stoi(it->second);
+#ifdef CO_HTTP_TRACE
+        // Chrome trace JSON of every thread's recent events
+        if (url == "/debug/trace") {
+            _reply_json(ex, trace_registry::get().dump_json());
+            return next.finish();
         }
-        catch (std::logic_error const &) {
-            return 0;
+#endif
+        // accept placement of pinned workers, see worker_pool
+        if (url == "/debug/workers") {
+            _reply_json(ex, placement_stats::dump_json());
+            return next.finish();
         }
-    }
-
-    void push_chunk(std::string_view chunk) {
-        assert(!m_body_finished);
-        if (!m_header_parser.header_finished()) {
-            m_header_parser.push_chunk(chunk);
-            if (m_header_parser.header_finished()) {
-                body_accumulated_size = body().size();
-                content_length = _extract_content_length();
-                if (body_accumulated_size >= content_length) {
-                    m_body_finished = true;
-                }
-            }
+        // MSG_ZEROCOPY sends and how many the kernel copied after all
+        if (url == "/debug/zerocopy") {
+            _reply_json(ex, zerocopy_tracker::dump_json());
+            return next.finish();
         }
-        else {
-            body().append(chunk);
-            body_accumulated_size += chunk.size();
-            if (body_accumulated_size >= content_length) {
-                m_body_finished = true;
+        // what this loop's async_resolver answers for a name, cached or not
+        constexpr std::string_view resolve_prefix = "/debug/resolve?name=";
+        if (url.starts_with(resolve_prefix) && async_resolver::g_instance) {
+            std::string name(url.substr(resolve_prefix.size()));
+            if (!_valid_host(name)) {
+                ex.m_res.template write_header<bad_request_header>(0);
+                return next.finish();
             }
+            return async_resolver::get().async_resolve(name, "80", [ex, next = std::move(next), name]
+                                                       (std::error_code ec, async_resolver::result res) mutable {
+                _reply_json(ex, _resolve_json(name, ec, res));
+                return next.finish();
+            });
         }
-    }
-
-    std::string read_some_body() {
-        return std::move(body());
+        return next();
     }
 };
 
-template <typename HeaderParser = http11_header_parser>
-struct http_request_parser : _http_base_parser<HeaderParser> {
-    std::string method() {
-        return this->_handline_first();  
-    }
+// What every connection, HTTP/1.1 or HTTP/2, runs for a request.
+#ifdef CO_HTTP_COMPRESSION
+using http_app = http_pipeline<http_default_handler, http_compression, http_debug_routes>;
+#else
+using http_app = http_pipeline<http_default_handler, http_debug_routes>;
+#endif
 
-    std::string url() {
-        return this->_handline_second();
-    }
+struct http_connection_handler : std::enable_shared_from_this<http_connection_handler> {
 
-    std::string version() {
-        return this->_handline_second();
-    }
-};
+    // live connections of this thread's loop, for the idle reaper
+    inline static thread_local std::unordered_set<http_connection_handler *> g_live;
 
-struct http11_header_writer {
-    bytes_buffer m_buffer;
+    // answers that skip the handler and end the connection
+    using unavailable_header = http_header_template<http_status::service_unavailable,
+        "Server: co_http",
+        "Retry-After: 1",
+        "Connection: close">;
+    using too_large_header = http_header_template<http_status::payload_too_large,
+        "Server: co_http",
+        "Connection: close">;
 
-    void reset_state() {
-        m_buffer.clear();
-    }
+    async_file m_conn;
+    bytes_buffer m_readbuf{1024};
+    request_arena<> m_arena;
+    http_request_parser<> m_req_parser{m_arena.resource()};
+    http_response_writer<> m_res_writer{m_arena.resource()};
+    enum class upgrade_kind : uint8_t {
+        none,
+        websocket,
+        h2c,
+    } m_upgrading = upgrade_kind::none;
+    bool m_admitted = false;
+    bool m_close_after_write = false;
+    bool m_local_peer = false;
+    size_t m_charged = 0;
+    size_t m_discard = 0;
+    std::chrono::steady_clock::time_point m_idle_since;
 
-    bytes_buffer &buffer() {
-        return m_buffer;
-    }
+    using pointer = std::shared_ptr<http_connection_handler>;
 
-    void begin_header(std::string_view first, std::string_view second,
-                      std::string_view third) {
-        m_buffer.append(first);
-        m_buffer.append_literial(" ");
-        m_buffer.append(second);
-        m_buffer.append_literial(" ");
-        m_buffer.append(third);
+    static pointer make() {
+        return std::make_shared<pointer::element_type>();
     }
 
-    void writer_header(std::string_view key, std::string_view value) {
-        m_buffer.append_literial("\r\n");
-        m_buffer.append(key);
-        m_buffer.append_literial(": ");
-        m_buffer.append(value);
-    }
-    
-    void end_header() {
-        m_buffer.append_literial("\r\n\r\n");
+    void do_start(int connfd) {
+        _attach(connfd);
+        do_read();
     }
-};
-
-template <typename HeaderWriter = http11_header_writer>
-struct _http_base_writer {
-    HeaderWriter m_header_writer;
 
-    void _begin_header(std::string_view first, std::string_view second,
-                       std::string_view third) {
-        m_header_writer.begin_header(first, second, third);
+    // an already wrapped connection, e.g. one end of async_file::memory_socketpair
+    void do_start(async_file conn) {
+        _attach(std::move(conn));
+        do_read();
     }
 
-    void reset_state() {
-        m_header_writer.reset_state();        
+#ifdef CO_HTTP_TLS
+    // handshake first; ALPN "h2" goes straight to HTTP/2
+    void do_start(int connfd, tls_context::pointer tls) {
+        _attach(connfd);
+        auto &ctx = *tls;
+        m_conn.async_tls_accept(ctx, [self = shared_from_this(), tls = std::move(tls)] (exception<int> ret) {
+            if (ret.error()) {
+                return;
+            }
+            if (self->m_conn.tls_alpn() == "h2") {
+                http2_connection<http_app>::make()->do_start(std::move(self->m_conn), {}, 0);
+                return;
+            }
+            return self->do_read();
+        });
     }
+#endif
 
-    bytes_buffer &buffer() {
-        return m_header_writer.buffer();
+    // common to every start; socket options are the acceptor's business,
+    // see http_acceptor::do_start
+    void _attach(int connfd) {
+        io_context::get().apply_busy_poll(connfd);
+        return _attach(async_file::async_wrap(connfd));
     }
 
-    void writer_header(std::string_view key, std::string_view value) {
-        m_header_writer.writer_header(key, value);
+    void _attach(async_file conn) {
+        m_conn = std::move(conn);
+        m_local_peer = m_conn.peer_is_local();
+        _enter();
     }
 
-    void end_header() {
-        m_header_writer.end_header();
+    // an idle connection is shut down on drain, a busy one closes after its answer
+    void _enter() {
+        m_idle_since = std::chrono::steady_clock::now();
+        g_live.insert(this);
+        connection_drain::enter(this, [this] {
+            if (idle()) {
+                shutdown(m_conn.m_fd, SHUT_RDWR);
+            }
+        });
     }
 
-    void write_body(std::string_view body) {
-        m_header_writer.buffer().append(body);
+    // Stop keeping connections alive: idle ones are shut down now, busy ones
+    // answer their current request with "Connection: close", HTTP/2 ones
+    // send GOAWAY and finish the streams they have, WebSocket ones close
+    // with 1001. on_drained runs once the last connection is gone.
+    static void begin_drain(callback<> on_drained) {
+        connection_drain::begin(std::move(on_drained));
     }
-};
 
-// "GET / HTTP1.1"      request
-template <typename HeaderWriter = http11_header_writer>
-struct http_request_writer : _http_base_writer<HeaderWriter> {
-    void begin_header(int status) {
-        this->_begin_header("HTTP/1.1", std::to_string(status), "OK");
+    // keep-alive connections waiting for their next request since min_age
+    static void shutdown_idle(std::chrono::milliseconds min_age) {
+        auto now = std::chrono::steady_clock::now();
+        for (auto *conn: g_live) {
+            if (conn->idle() && now - conn->m_idle_since >= min_age) {
+                shutdown(conn->m_conn.m_fd, SHUT_RDWR);
+            }
+        }
     }
-};
 
-// "HTTP1.1 200 OK"     response
-template <typename HeaderWriter = http11_header_writer>
-struct http_response_writer : _http_base_writer<HeaderWriter> {
-    void begin_header(int status) {
-        this->_begin_header("HTTP/1.1", std::to_string(status), "OK");
+    [[nodiscard]] bool idle() {
+        return !m_req_parser.header_finished() && m_req_parser.headers_raw().empty();
     }
-};
 
-struct http_connection_handler : std::enable_shared_from_this<http_connection_handler> {
-    async_file m_conn;
-    bytes_buffer m_readbuf{1024};
-    http_request_parser<> m_req_parser;
-    http_response_writer<> m_res_writer;
-
-    using pointer = std::shared_ptr<http_connection_handler>;
-
-    static pointer make() {
-        return std::make_shared<pointer::element_type>();
+    ~http_connection_handler() {
+        admission_control::charge(m_charged, 0);
+        g_live.erase(this);
+        connection_drain::leave(this);
     }
 
-    void do_start(int connfd) {
-        m_conn = async_file::async_wrap(connfd);
-        do_read();
+    // parser and writer drop their arena storage before the arena is rewound
+    void reset_state() {
+        admission_control::charge(m_charged, 0);
+        m_charged = 0;
+        m_admitted = false;
+        m_req_parser.reset_state();
+        m_res_writer.reset_state();
+        m_arena.reset();
     }
 
     void do_read() {
@@ -325,6 +329,19 @@ struct http_connection_handler : std::enable_shared_from_this<http_connection_ha
             }
 
             self->m_req_parser.push_chunk(self->m_readbuf.subspan(0, n));
+            self->_account();
+            if (!self->m_admitted && self->m_req_parser.header_finished()) {
+                self->m_admitted = true;
+                if (admission_control::get().shedding()) {
+                    return self->do_reject<unavailable_header>();
+                }
+                if (self->m_req_parser.content_length > admission_control::get().m_limits.m_conn_bytes) {
+                    return self->do_reject<too_large_header>();
+                }
+            }
+            if (self->m_charged > admission_control::get().m_limits.m_conn_bytes) {
+                return self->do_reject<too_large_header>();
+            }
             if (!self->m_req_parser.request_finished()) {
                 return self->do_read();
             }
@@ -334,33 +351,150 @@ struct http_connection_handler : std::enable_shared_from_this<http_connection_ha
         });
     }
 
-    void do_handle() {
-        std::string body = std::move(m_req_parser.body());
-        m_req_parser.reset_state();
+    // keep the process-wide buffered byte count in step with this connection
+    void _account() {
+        auto &pinned = m_res_writer.m_pinned_body;
+        size_t bytes = m_req_parser.headers_raw().size() + m_req_parser.body().size()
+                     + m_res_writer.buffer().size() + (pinned ? pinned->size() : 0);
+        admission_control::charge(m_charged, bytes);
+        m_charged = bytes;
+    }
+
+    // answer without running the handler, then close
+    template <class Header>
+    void do_reject() {
+        // a client still sending its body would see our close as a reset and
+        // never read the answer, so swallow what is left of a bounded body first
+        size_t received = m_req_parser.body().size();
+        size_t expected = m_req_parser.content_length;
+        size_t remaining = expected > received ? expected - received : 0;
+        m_discard = remaining <= admission_control::get().m_limits.m_conn_bytes ? remaining : 0;
+        m_close_after_write = true;
+        m_res_writer.template write_header<Header>(0);
+        return do_write(m_res_writer.buffer());
+    }
+
+    void do_discard() {
+        return m_conn.async_read(m_readbuf, [self = shared_from_this()] (exception<size_t> ret) {
+            if (ret.error() || ret.value() == 0) {
+                return;
+            }
+            self->m_discard -= std::min(self->m_discard, ret.value());
+            if (self->m_discard == 0) {
+                return;
+            }
+            return self->do_discard();
+        });
+    }
 
-        if (body.empty()) {
-            body = "你好，你的请求正文为空哦";
+    static bool _header_has_token(StringMap const &headers, std::string_view key, std::string_view token) {
+        auto it = headers.find(key);
+        if (it == headers.end()) {
+            return false;
         }
-        else {
-            body = std::format("你好，你的请求是: [{}]，共 {} 字节", body, body.size());
+        auto lower = [] (char c) {
+            return (c >= 'A' && c <= 'Z') ? static_cast<char>(c + 'a' - 'A') : c;
+        };
+        return std::ranges::search(it->second, token, {}, lower, lower).begin() != it->second.end();
+    }
+
+    [[nodiscard]] bool _is_websocket_upgrade() {
+        auto &headers = m_req_parser.headers();
+        return m_req_parser.method() == http_method::GET
+            && _header_has_token(headers, "upgrade", "websocket")
+            && _header_has_token(headers, "connection", "upgrade")
+            && headers.contains("sec-websocket-key");
+    }
+
+    void do_upgrade() {
+        auto &headers = m_req_parser.headers();
+        auto version = headers.find("sec-websocket-version");
+        if (version == headers.end() || version->second != "13") {
+            m_res_writer.begin_header(http_status::upgrade_required);
+            m_res_writer.writer_header("Sec-WebSocket-Version", "13");
+            m_res_writer.writer_header("Content-Length", "0");
+            m_res_writer.end_header();
+            return do_write(m_res_writer.buffer());
         }
 
-        m_res_writer.begin_header(200);
-        m_res_writer.writer_header("Server", "co_http");
-        m_res_writer.writer_header("Content-type", "text/html;charset=utf-8");
-        m_res_writer.writer_header("Connection", "keep-alive");
-        m_res_writer.writer_header("Content-length", std::to_string(body.size()));
+        m_upgrading = upgrade_kind::websocket;
+        m_res_writer.begin_header(http_status::switching_protocols);
+        m_res_writer.writer_header("Upgrade", "websocket");
+        m_res_writer.writer_header("Connection", "Upgrade");
+        m_res_writer.writer_header("Sec-WebSocket-Accept", websocket_accept_key(headers.find("sec-websocket-key")->second));
         m_res_writer.end_header();
+        return do_write(m_res_writer.buffer());
+    }
 
-        // std::println("我的响应头: {}", buffer);
-        // std::println("我的响应正文: {}", body);
-        // std::println("正在响应");
+    // hand the socket, and any frames sent right behind the handshake, over
+    void _start_websocket() {
+        auto &early = m_req_parser.body();
+        bytes_view early_view{early.data(), early.size()};
+        websocket_connection::make()->do_start(std::move(m_conn), early_view, websocket_hub::get());
+        reset_state();
+    }
 
-        m_res_writer.write_body(body);
-        return do_write(m_res_writer.buffer());
+    // "PRI * HTTP/2.0" parses as a request line; "SM\r\n\r\n" lands in the body
+    [[nodiscard]] bool _is_http2_preface() {
+        return m_req_parser.method_raw() == "PRI" && m_req_parser.url() == "*"
+            && m_req_parser.version() == "HTTP/2.0";
+    }
+
+    [[nodiscard]] bool _is_h2c_upgrade() {
+        auto &headers = m_req_parser.headers();
+        return _header_has_token(headers, "upgrade", "h2c")
+            && _header_has_token(headers, "connection", "http2-settings")
+            && headers.contains("http2-settings");
+    }
+
+    void _start_http2() {
+        auto &early = m_req_parser.body();
+        bytes_view early_view{early.data(), early.size()};
+        http2_connection<http_app>::make()->do_start(std::move(m_conn), early_view, k_http2_preface_line);
+        reset_state();
+    }
+
+    void _start_h2c() {
+        auto &body = m_req_parser.body();
+        size_t body_size = std::min(body.size(), m_req_parser.content_length);
+        bytes_view early_view{body.data() + body_size, body.size() - body_size};
+        auto settings = m_req_parser.headers().find("http2-settings")->second;
+        http2_connection<http_app>::make()->do_start_upgrade(std::move(m_conn), m_req_parser, settings, early_view);
+        reset_state();
+    }
+
+    void do_handle() {
+        if (_is_http2_preface()) {
+            return _start_http2();
+        }
+        if (_is_websocket_upgrade()) {
+            return do_upgrade();
+        }
+        if (_is_h2c_upgrade() && !connection_drain::draining()) {
+            m_upgrading = upgrade_kind::h2c;
+            m_res_writer.begin_header(http_status::switching_protocols);
+            m_res_writer.writer_header("Upgrade", "h2c");
+            m_res_writer.writer_header("Connection", "Upgrade");
+            m_res_writer.end_header();
+            return do_write(m_res_writer.buffer());
+        }
+
+        bool draining = connection_drain::draining();
+        m_close_after_write = draining;
+        // ends when the response is ready, before the completion writes it
+        trace_span span("handle", static_cast<uint32_t>(m_conn.m_fd));
+        return http_app::handle(m_req_parser, m_res_writer, m_arena.resource(), draining, m_local_peer,
+                                [self = shared_from_this(), span = std::move(span)] () mutable {
+            span.end();
+            self->_account();
+            return self->do_write(self->m_res_writer.buffer());
+        });
     }
 
     void do_write(bytes_const_view buffer) {
+        TRACE_EVENT("do_write", m_conn.m_fd, buffer.size());
+        // a pinned body follows: the header waits for it instead of leaving alone
+        bool more = m_res_writer.m_pinned_body != nullptr;
         return m_conn.async_write(buffer, [self = shared_from_this(), buffer] (exception<size_t> ret) {
             if (ret.error()) {
                 return;
@@ -368,17 +502,66 @@ struct http_connection_handler : std::enable_shared_from_this<http_connection_ha
             auto n = ret.value();
 
             if (buffer.size() == n) {
-                self->m_res_writer.reset_state();
-                return self->do_read();
+                // the header is out, the body was handed over pinned
+                if (auto &pinned = self->m_res_writer.m_pinned_body) {
+                    return self->do_write_pinned(bytes_const_view{pinned->data(), pinned->size()});
+                }
+                return self->_written();
             }
+            TRACE_EVENT("partial_write", self->m_conn.m_fd, buffer.size() - n);
             return self->do_write(buffer.subspan(n));
-        });
+        }, more);
+    }
+
+    void do_write_pinned(bytes_const_view rest) {
+        auto done = [self = shared_from_this(), rest] (exception<size_t> ret) {
+            if (ret.error()) {
+                return;
+            }
+            auto n = ret.value();
+            if (rest.size() == n) {
+                return self->_written();
+            }
+            TRACE_EVENT("partial_write", self->m_conn.m_fd, rest.size() - n);
+            return self->do_write_pinned(rest.subspan(n));
+        };
+        auto &pinned = m_res_writer.m_pinned_body;
+        if (zerocopy_tracker::wanted(pinned->size()) && m_conn.enable_zerocopy()) {
+            return m_conn.async_send_zerocopy(rest, pinned, std::move(done));
+        }
+        return m_conn.async_write(rest, std::move(done));
+    }
+
+    // the whole response is out
+    void _written() {
+        if (m_upgrading == upgrade_kind::websocket) {
+            return _start_websocket();
+        }
+        if (m_upgrading == upgrade_kind::h2c) {
+            return _start_h2c();
+        }
+        reset_state();
+        m_idle_since = std::chrono::steady_clock::now();
+        if (m_close_after_write || connection_drain::draining()) {
+            m_conn.shutdown_write();
+            if (m_discard != 0) {
+                return do_discard();
+            }
+            return;
+        }
+        return do_read();
     }
 };
 
 struct http_acceptor : std::enable_shared_from_this<http_acceptor> {
     async_file m_listen;
     address_resolver::address m_addr;
+    bool m_stopped = false;
+    // loop that owns m_listen, which may be a worker's
+    io_context *m_ctx = nullptr;
+    address_resolver::socket_options m_options;
+    // the connection options are TCP ones: off for Unix domain listeners
+    bool m_per_connection = false;
 
     using pointer = std::shared_ptr<http_acceptor>;
 
@@ -386,20 +569,109 @@ struct http_acceptor : std::enable_shared_from_this<http_acceptor> {
         return std::make_shared<pointer::element_type>();
     }
 
+#ifdef CO_HTTP_TLS
+    tls_context::pointer m_tls;
+
+    // accepted connections speak TLS from now on
+    void use_tls(tls_context::pointer tls) {
+        m_tls = std::move(tls);
+    }
+#endif
+
+    // listener options apply to sockets bound from now on, connection options
+    // to every accepted socket, inherited listeners included
+    void use_options(address_resolver::socket_options const &opts) {
+        m_options = opts;
+    }
+
     void do_start(std::string name, std::string port) {
         address_resolver resolver;
         std::println("正在监听：{}:{}", name, port);
         auto entry = resolver.resolve(name, port);
-        int listenfd = entry.create_socket_and_bind();
+        int listenfd = entry.create_socket_and_bind(m_options);
+        return do_start(listenfd);
+    }
+
+    // Unix domain socket at path, "@name" for the abstract namespace; for a
+    // sidecar on the same host this skips the TCP stack entirely
+    void do_start_unix(std::string path) {
+        std::println("正在监听：unix:{}", path);
+        int listenfd = address_resolver::create_unix_socket_and_bind(path, m_options);
+        return do_start(listenfd);
+    }
 
+    // adopt an already bound and listening socket, e.g. handed over on reload
+    void do_start(int listenfd) {
+#ifdef CO_HTTP_TLS
+        // handshake flights go out as several small writes; don't let Nagle
+        // hold the last one back for a delayed ACK
+        if (m_tls) {
+            m_options.m_nodelay = true;
+        }
+#endif
+        address_resolver::address addr;
+        m_per_connection = m_options.per_connection()
+                        && getsockname(listenfd, &addr.m_addr, &addr.m_addrlen) == 0
+                        && (addr.m_addr.sa_family == AF_INET || addr.m_addr.sa_family == AF_INET6);
+        m_ctx = &io_context::get();
         m_listen = async_file::async_wrap(listenfd);
         return do_accept();
     }
 
+    int listen_fd() const {
+        return m_listen.m_fd;
+    }
+
+    // callable from any thread, runs on the owning loop
+    void stop() {
+        if (m_ctx && m_ctx != io_context::g_instence) {
+            return m_ctx->post([self = shared_from_this()] {
+                return self->stop();
+            });
+        }
+        m_stopped = true;
+        m_listen = async_file();
+    }
+
     void do_accept() {
+        auto &admission = admission_control::get();
+        if (!admission.accepting()) {
+            return admission.wait_for_resume([self = shared_from_this()] {
+                if (self->m_stopped) {
+                    return;
+                }
+                return self->do_accept();
+            });
+        }
         return m_listen.async_accept(m_addr, [self = shared_from_this()] (exception<int> ret) {
+            if (self->m_stopped) {
+                return;
+            }
+            // out of fds or memory: back off instead of dying, retry next tick
+            if (ret.is_error(EMFILE) || ret.is_error(ENFILE) || ret.is_error(ENOBUFS) || ret.is_error(ENOMEM)) {
+                return admission_control::get().back_off([self] {
+                    if (self->m_stopped) {
+                        return;
+                    }
+                    return self->do_accept();
+                });
+            }
+            // the peer gave up while in the backlog
+            if (ret.is_error(ECONNABORTED) || ret.is_error(EINTR) || ret.is_error(EPROTO)) {
+                return self->do_accept();
+            }
             auto connfd = ret.except("accept");
+            placement_stats::note_accept(connfd);
+            if (self->m_per_connection) {
+                self->m_options.apply_connection(connfd);
+            }
 
+#ifdef CO_HTTP_TLS
+            if (self->m_tls) {
+                http_connection_handler::make()->do_start(connfd, self->m_tls);
+                return self->do_accept();
+            }
+#endif
             http_connection_handler::make()->do_start(connfd);
             return self->do_accept();
         });
@@ -2,34 +2,200 @@
 #define IO_CONTEXT_HPP
 
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <vector>
 
 #include "callback.hpp"
 #include "exception.hpp"
 
 struct io_context {
+    // How much one async_file may do inline per loop turn before its next
+    // operation is deferred to the ready queue. Larger budgets favour
+    // throughput of busy connections, smaller ones tail latency of the rest.
+    struct budget {
+        size_t m_ops = 16;
+        size_t m_bytes = 256 * 1024;
+    };
+
+    // Opt-in hybrid polling: keep polling epoll with a zero timeout for m_spin
+    // after the last event, then fall back to blocking. The socket/epoll
+    // fields are passed to the kernel busy-poll knobs when non-zero.
+    struct busy_poll {
+        std::chrono::microseconds m_spin{0};
+        uint32_t m_usecs = 0;
+        uint16_t m_budget = 0;
+        bool m_prefer = false;
+    };
+
+    // struct epoll_params / EPIOCSPARAMS, Linux 6.9+
+    struct _epoll_params {
+        uint32_t busy_poll_usecs;
+        uint16_t busy_poll_budget;
+        uint8_t prefer_busy_poll;
+        uint8_t pad;
+    };
+    static constexpr unsigned long k_epiocsparams = _IOW(0x8A, 0x01, _epoll_params);
+
     int m_epfd;
+    int m_wakefd;
+    std::mutex m_posted_mutex;
+    std::vector<callback<>> m_posted;
+    std::deque<callback<>> m_ready;
+    budget m_budget;
+    uint64_t m_turn = 0;
+    bool m_stopped = false;
+    busy_poll m_busy_poll;
+    std::chrono::steady_clock::time_point m_last_activity;
+    // turn time: from epoll_wait returning to the end of the dispatch
+    // (deferred work included), as an EWMA over turns that had work. This is
+    // how long the last event of a turn waited for the others, not how long
+    // events sat in the kernel before epoll_wait returned, which the loop
+    // cannot see; busy turns make it grow the same way.
+    std::chrono::steady_clock::time_point m_ready_at;
+    std::chrono::nanoseconds m_turn_time{0};
 
     inline static thread_local io_context *g_instence = nullptr;
 
-    io_context() : m_epfd(CHECK_CALL(epoll_create1, 0)) {
+    io_context() : m_epfd(CHECK_CALL(epoll_create1, 0)),
+                   m_wakefd(CHECK_CALL(eventfd, 0, EFD_NONBLOCK | EFD_CLOEXEC)) {
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLET;
+        event.data.ptr = this;
+        CHECK_CALL(epoll_ctl, m_epfd, EPOLL_CTL_ADD, m_wakefd, &event);
         g_instence = this;
     }
 
+    // thread-safe: run cb on this loop from any thread
+    void post(callback<> cb) {
+        {
+            std::lock_guard lock(m_posted_mutex);
+            m_posted.push_back(std::move(cb));
+        }
+        uint64_t one = 1;
+        CHECK_CALL(write, m_wakefd, &one, sizeof(one));
+    }
+
+    // best effort: the kernel knobs are skipped where unsupported or not permitted
+    void enable_busy_poll(busy_poll const &opts) {
+        m_busy_poll = opts;
+        if (opts.m_usecs != 0) {
+            _epoll_params params{opts.m_usecs, opts.m_budget, opts.m_prefer, 0};
+            (void)ioctl(m_epfd, k_epiocsparams, &params);
+        }
+    }
+
+    // per-socket half of busy_poll, for sockets served by this loop
+    void apply_busy_poll(int sockfd) const {
+        if (m_busy_poll.m_usecs == 0) {
+            return;
+        }
+        int usecs = static_cast<int>(m_busy_poll.m_usecs);
+        int prefer = m_busy_poll.m_prefer;
+        int budget = m_busy_poll.m_budget;
+        (void)setsockopt(sockfd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs));
+        (void)setsockopt(sockfd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof(prefer));
+        if (budget != 0) {
+            (void)setsockopt(sockfd, SOL_SOCKET, SO_BUSY_POLL_BUDGET, &budget, sizeof(budget));
+        }
+    }
+
+    int _poll_timeout() {
+        if (!m_ready.empty() || m_stopped) {
+            return 0;
+        }
+        if (m_busy_poll.m_spin.count() != 0
+            && std::chrono::steady_clock::now() - m_last_activity < m_busy_poll.m_spin) {
+            return 0;
+        }
+        return -1;
+    }
+
+    // the smoothed turn time, or how long the current turn has been running
+    // if that is worse: one long turn must not admit everything in it
+    std::chrono::nanoseconds turn_time() const {
+        if (m_ready_at == std::chrono::steady_clock::time_point()) {
+            return m_turn_time;
+        }
+        return std::max<std::chrono::nanoseconds>(m_turn_time, std::chrono::steady_clock::now() - m_ready_at);
+    }
+
+    // join() returns after the current turn; call from the loop thread
+    void stop() {
+        m_stopped = true;
+    }
+
+    // run cb on the next loop turn, after pending epoll events
+    void defer(callback<> cb) {
+        m_ready.push_back(std::move(cb));
+    }
+
+    void _run_ready() {
+        for (size_t n = m_ready.size(); n > 0; n--) {
+            auto cb = std::move(m_ready.front());
+            m_ready.pop_front();
+            cb();
+        }
+    }
+
+    void _run_posted() {
+        uint64_t count;
+        (void)read(m_wakefd, &count, sizeof(count));
+        std::vector<callback<>> posted;
+        {
+            std::lock_guard lock(m_posted_mutex);
+            posted.swap(m_posted);
+        }
+        for (auto &cb: posted) {
+            cb();
+        }
+    }
+
     void join() {
         std::array<struct epoll_event, 128> events;
-        while (true) {
-            int ret = epoll_wait(m_epfd, events.data(), events.size(), -1);
+        while (!m_stopped) {
+            ++m_turn;
+            _run_ready();
+            if (m_ready_at != std::chrono::steady_clock::time_point()) {
+                auto sample = std::chrono::steady_clock::now() - m_ready_at;
+                m_turn_time += (sample - m_turn_time) / 8;
+                m_ready_at = {};
+            }
+            int ret = epoll_wait(m_epfd, events.data(), events.size(), _poll_timeout());
             if (ret < 0) {
                 throw;   
             }
+            // deferred work counts too: under load whole turns are only that
+            if (ret > 0 || !m_ready.empty()) {
+                m_ready_at = std::chrono::steady_clock::now();
+                m_last_activity = m_ready_at;
+            }
             for (size_t i = 0; i < ret; i++) {
+                if (events[i].data.ptr == this) {
+                    _run_posted();
+                    continue;
+                }
+                // EPOLLHUP/EPOLLERR on an fd nobody waits on yet (async_wrap
+                // registers with a null callback); its next operation sees the error
+                if (events[i].data.ptr == nullptr) {
+                    continue;
+                }
                 auto cb = callback<>::from_address(events[i].data.ptr);
                 cb();
             }
         }
+        m_stopped = false;
     }
 
     ~io_context() {
+        close(m_wakefd);
         close(m_epfd);
         g_instence = nullptr;
     }
@@ -0,0 +1,329 @@
+#ifndef LOOPBACK_REPLAY_HPP
+#define LOOPBACK_REPLAY_HPP
+
+#ifdef CO_HTTP_REPLAY
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <new>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "exception.hpp"
+#include "io_context.hpp"
+#include "async_file.hpp"
+#include "http_message.hpp"
+#include "http_server.hpp"
+#include "admission_control.hpp"
+
+// Replays a request corpus through http_connection_handler over
+// async_file::memory_socketpair(): parser, pipeline, handler and writer run
+// as in production, minus the kernel. The client sends one request, reads
+// its response, and sends the next, on the same io_context.
+//
+// Counts are per request and include the (non-allocating apart from its
+// callbacks) client. Instructions and cycles come from perf_event_open when
+// the machine exposes a PMU; cycles then fall back to the TSC.
+
+// Allocation counter: replaces the global operator new, so this header must
+// be included by exactly one translation unit (server.cpp).
+inline size_t g_replay_allocations = 0;
+
+void *operator new(size_t size) {
+    ++g_replay_allocations;
+    if (void *p = std::malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void *operator new(size_t size, std::align_val_t align) {
+    ++g_replay_allocations;
+    size_t a = static_cast<size_t>(align);
+    if (void *p = std::aligned_alloc(a, (size + a - 1) / a * a)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+// GCC cannot see that the replaced operator new above is malloc
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+
+void operator delete(void *p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    std::free(p);
+}
+
+void operator delete(void *p, std::align_val_t) noexcept {
+    std::free(p);
+}
+
+void operator delete(void *p, size_t, std::align_val_t) noexcept {
+    std::free(p);
+}
+
+#pragma GCC diagnostic pop
+
+struct perf_counter {
+    int m_fd = -1;
+
+    explicit perf_counter(uint64_t config) {
+        struct perf_event_attr attr{};
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = config;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        m_fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+    }
+
+    perf_counter(perf_counter &&) = delete;
+
+    ~perf_counter() {
+        if (m_fd != -1) {
+            close(m_fd);
+        }
+    }
+
+    [[nodiscard]] bool available() const {
+        return m_fd != -1;
+    }
+
+    uint64_t read_value() const {
+        uint64_t value = 0;
+        if (m_fd == -1 || ::read(m_fd, &value, sizeof(value)) != sizeof(value)) {
+            return 0;
+        }
+        return value;
+    }
+};
+
+struct loopback_replay : std::enable_shared_from_this<loopback_replay> {
+    struct sample {
+        std::chrono::steady_clock::time_point m_time;
+        uint64_t m_tsc;
+        uint64_t m_instructions;
+        uint64_t m_cycles;
+        size_t m_allocations;
+    };
+
+    std::vector<std::string> m_corpus;
+    std::vector<size_t> m_read_chunks;
+    std::vector<size_t> m_write_chunks;
+    size_t m_warmup = 0;
+    size_t m_count = 0;
+    size_t m_sent = 0;
+    size_t m_connections = 0;
+    async_file m_client;
+    std::string_view m_request;
+    char m_buf[64 * 1024];
+    size_t m_got = 0;
+    perf_counter m_instructions{PERF_COUNT_HW_INSTRUCTIONS};
+    perf_counter m_cycles{PERF_COUNT_HW_CPU_CYCLES};
+    sample m_begin{};
+
+    using pointer = std::shared_ptr<loopback_replay>;
+
+    static pointer make() {
+        return std::make_shared<pointer::element_type>();
+    }
+
+    // Raw HTTP/1.1 requests back to back, as captured from the wire. "-"
+    // stands for a small built-in sample.
+    static std::vector<std::string> load_corpus(std::string const &path) {
+        std::string data;
+        if (path == "-") {
+            data = "GET / HTTP/1.1\r\nHost: localhost\r\nUser-Agent: replay\r\nAccept: */*\r\n\r\n"
+                   "POST /echo HTTP/1.1\r\nHost: localhost\r\nContent-Type: text/plain\r\nContent-Length: 11\r\n\r\nhello world";
+        }
+        else {
+            std::ifstream file(path, std::ios::binary);
+            if (!file) {
+                throw std::invalid_argument("cannot open corpus " + path);
+            }
+            std::stringstream ss;
+            ss << file.rdbuf();
+            data = ss.str();
+        }
+        std::vector<std::string> requests;
+        std::string_view rest = data;
+        while (!rest.empty()) {
+            http_request_parser<> parser;
+            parser.push_chunk(rest);
+            if (!parser.header_finished()) {
+                break;
+            }
+            size_t size = std::min(rest.size(), parser.headers_raw().size() + 4 + parser.content_length);
+            requests.emplace_back(rest.substr(0, size));
+            rest.remove_prefix(size);
+        }
+        if (requests.empty()) {
+            throw std::invalid_argument("no complete request in corpus " + path);
+        }
+        return requests;
+    }
+
+    // "1,7,0,4096": the chunk sizes memory_pipe cycles through, 0 is an EAGAIN
+    static std::vector<size_t> parse_chunks(char const *spec) {
+        std::vector<size_t> chunks;
+        if (!spec) {
+            return chunks;
+        }
+        for (char const *p = spec; *p; ) {
+            char *end;
+            chunks.push_back(std::strtoul(p, &end, 10));
+            p = *end == ',' ? end + 1 : end + std::strlen(end);
+        }
+        return chunks;
+    }
+
+    sample _sample() const {
+        return {std::chrono::steady_clock::now(), _tsc(), m_instructions.read_value(),
+                m_cycles.read_value(), g_replay_allocations};
+    }
+
+    static uint64_t _tsc() {
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+    }
+
+    void do_start() {
+        _connect();
+        return do_send();
+    }
+
+    // a fresh connection, also after the server closed the previous one
+    void _connect() {
+        auto [client, server] = async_file::memory_socketpair();
+        client.m_mem->m_out->m_read_chunks = m_read_chunks;
+        client.m_mem->m_in->m_write_chunks = m_write_chunks;
+        m_client = std::move(client);
+        ++m_connections;
+        http_connection_handler::make()->do_start(std::move(server));
+    }
+
+    void do_send() {
+        if (m_sent == m_warmup) {
+            m_begin = _sample();
+        }
+        if (m_sent == m_warmup + m_count) {
+            return _report();
+        }
+        m_request = m_corpus[m_sent % m_corpus.size()];
+        ++m_sent;
+        m_got = 0;
+        return do_write();
+    }
+
+    void do_write() {
+        bytes_const_view buf{m_request.data(), m_request.size()};
+        return m_client.async_write(buf, [self = shared_from_this()] (exception<size_t> ret) {
+            auto n = ret.value();
+            self->m_request.remove_prefix(n);
+            if (!self->m_request.empty()) {
+                return self->do_write();
+            }
+            return self->do_read();
+        });
+    }
+
+    // the response is complete once its header and Content-Length bytes are in
+    size_t _response_size() const {
+        std::string_view got(m_buf, m_got);
+        size_t header_end = got.find("\r\n\r\n");
+        if (header_end == std::string_view::npos) {
+            return 0;
+        }
+        size_t length = 0;
+        size_t pos = got.find("ontent-Length: ");
+        if (pos == std::string_view::npos) {
+            pos = got.find("ontent-length: ");
+        }
+        if (pos != std::string_view::npos && pos < header_end) {
+            length = std::strtoul(m_buf + pos + 15, nullptr, 10);
+        }
+        return header_end + 4 + length;
+    }
+
+    void do_read() {
+        bytes_view buf{m_buf + m_got, sizeof(m_buf) - m_got};
+        return m_client.async_read(buf, [self = shared_from_this()] (exception<size_t> ret) {
+            auto n = ret.value();
+            if (n == 0) {
+                std::println("回放: 服务端提前关闭了连接");
+                return io_context::get().stop();
+            }
+            self->m_got += n;
+            size_t size = self->_response_size();
+            if (size == 0 || self->m_got < size) {
+                if (self->m_got == sizeof(self->m_buf)) {
+                    std::println("回放: 响应超过 {} 字节", sizeof(self->m_buf));
+                    return io_context::get().stop();
+                }
+                return self->do_read();
+            }
+            if (std::string_view(self->m_buf, size).find("Connection: close") != std::string_view::npos) {
+                self->_connect();
+            }
+            return self->do_send();
+        });
+    }
+
+    void _report() {
+        auto end = _sample();
+        double n = static_cast<double>(m_count);
+        double secs = std::chrono::duration<double>(end.m_time - m_begin.m_time).count();
+        std::println("回放 {} 个请求 (语料 {} 条, {} 个连接): {:.0f} 请求/秒, 每请求 {:.1f} ns",
+                     m_count, m_corpus.size(), m_connections, n / secs, secs * 1e9 / n);
+        std::println("  每请求 {:.2f} 次内存分配, {:.0f} 个 TSC 周期", (end.m_allocations - m_begin.m_allocations) / n,
+                     (end.m_tsc - m_begin.m_tsc) / n);
+        if (m_instructions.available() && m_cycles.available()) {
+            std::println("  每请求 {:.0f} 条指令, {:.0f} 个 CPU 周期",
+                         (end.m_instructions - m_begin.m_instructions) / n, (end.m_cycles - m_begin.m_cycles) / n);
+        }
+        else {
+            std::println("  指令与 CPU 周期计数不可用 (perf_event_open 失败)");
+        }
+        m_client = async_file();
+        return io_context::get().stop();
+    }
+
+    // CO_HTTP_REPLAY=<corpus|->, CO_HTTP_REPLAY_COUNT, and chunk patterns for
+    // the server's reads / writes in CO_HTTP_REPLAY_READS / _WRITES
+    static void run(std::string const &corpus) {
+        io_context ctx;
+        admission_control admission;
+        auto replay = make();
+        replay->m_corpus = load_corpus(corpus);
+        replay->m_read_chunks = parse_chunks(getenv("CO_HTTP_REPLAY_READS"));
+        replay->m_write_chunks = parse_chunks(getenv("CO_HTTP_REPLAY_WRITES"));
+        char const *count = getenv("CO_HTTP_REPLAY_COUNT");
+        replay->m_count = count ? std::strtoul(count, nullptr, 10) : 1000000;
+        replay->m_warmup = std::min<size_t>(replay->m_count / 10, 10000);
+        replay->do_start();
+        ctx.join();
+    }
+};
+
+#endif
+
+#endif
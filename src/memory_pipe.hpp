@@ -0,0 +1,129 @@
+#ifndef MEMORY_PIPE_HPP
+#define MEMORY_PIPE_HPP
+
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "exception.hpp"
+#include "callback.hpp"
+#include "io_context.hpp"
+
+// One direction of an in-process byte stream, the transport of an async_file
+// made by memory_socketpair(). Waiting ends are resumed through the ready
+// queue of the io_context, so no syscall is involved.
+//
+// m_chunks makes partial transfers reproducible: the i-th read (or write)
+// moves at most m_chunks[i % size] bytes, and a 0 entry reports EAGAIN once.
+struct memory_pipe {
+    std::string m_data;
+    size_t m_head = 0;
+    size_t m_capacity = 256 * 1024;
+    bool m_writer_closed = false;
+    bool m_reader_closed = false;
+    callback<> m_reader_waiting;
+    callback<> m_writer_waiting;
+    std::vector<size_t> m_read_chunks;
+    std::vector<size_t> m_write_chunks;
+    size_t m_reads = 0;
+    size_t m_writes = 0;
+
+    static size_t _chunk(std::vector<size_t> const &chunks, size_t &count, size_t want) {
+        if (chunks.empty()) {
+            return want;
+        }
+        return std::min(want, chunks[count++ % chunks.size()]);
+    }
+
+    static void _wake(callback<> &waiting) {
+        if (waiting.m_base) {
+            io_context::get().defer(std::move(waiting));
+        }
+    }
+
+    exception<size_t> read(bytes_view buf) {
+        size_t available = m_data.size() - m_head;
+        if (available == 0) {
+            if (m_writer_closed) {
+                return 0;
+            }
+            return -EAGAIN;
+        }
+        size_t n = _chunk(m_read_chunks, m_reads, std::min(available, buf.size()));
+        if (n == 0) {
+            return -EAGAIN;
+        }
+        std::memcpy(buf.data(), m_data.data() + m_head, n);
+        m_head += n;
+        if (m_head == m_data.size()) {
+            m_data.clear();
+            m_head = 0;
+        }
+        _wake(m_writer_waiting);
+        return n;
+    }
+
+    exception<size_t> write(bytes_const_view buf) {
+        if (m_reader_closed) {
+            return -EPIPE;
+        }
+        size_t space = m_capacity - std::min(m_capacity, m_data.size() - m_head);
+        size_t n = _chunk(m_write_chunks, m_writes, std::min(space, buf.size()));
+        if (n == 0) {
+            return -EAGAIN;
+        }
+        m_data.append(buf.data(), n);
+        _wake(m_reader_waiting);
+        return n;
+    }
+
+    // a forced EAGAIN has nothing that would wake the waiter: retry next turn
+    void wait_read(callback<> cb) {
+        if (m_data.size() > m_head || m_writer_closed) {
+            return io_context::get().defer(std::move(cb));
+        }
+        m_reader_waiting = std::move(cb);
+    }
+
+    void wait_write(callback<> cb) {
+        if (m_data.size() - m_head < m_capacity || m_reader_closed) {
+            return io_context::get().defer(std::move(cb));
+        }
+        m_writer_waiting = std::move(cb);
+    }
+
+    void close_writer() {
+        m_writer_closed = true;
+        _wake(m_reader_waiting);
+    }
+
+    void close_reader() {
+        m_reader_closed = true;
+        _wake(m_writer_waiting);
+    }
+};
+
+// what one async_file end of a memory_socketpair holds
+struct memory_endpoint {
+    std::shared_ptr<memory_pipe> m_in;
+    std::shared_ptr<memory_pipe> m_out;
+
+    memory_endpoint(std::shared_ptr<memory_pipe> in, std::shared_ptr<memory_pipe> out)
+        : m_in(std::move(in)), m_out(std::move(out)) {}
+
+    memory_endpoint(memory_endpoint &&) = delete;
+
+    // the peer reads EOF and its writes fail with EPIPE
+    ~memory_endpoint() {
+        // a wait of this end would resume into its destroyed async_file
+        auto reader = std::move(m_in->m_reader_waiting);
+        auto writer = std::move(m_out->m_writer_waiting);
+        m_out->close_writer();
+        m_in->close_reader();
+    }
+};
+
+#endif
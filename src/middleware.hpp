@@ -0,0 +1,130 @@
+#ifndef MIDDLEWARE_HPP
+#define MIDDLEWARE_HPP
+
+#include <concepts>
+#include <cstddef>
+#include <memory_resource>
+#include <tuple>
+#include <utility>
+
+// Middleware composed at compile time: http_pipeline<Handler, Stages...>
+// expands into one chain of direct calls, so stages that do nothing cost
+// nothing, and no std::function or allocation sits between them.
+//
+// Stages run outermost first, then Handler::handle(req, res, mr, closing).
+// A stage is a default-constructible type, created for the call, in one of
+// two forms:
+//
+//   sync:   bool operator()(Exchange &ex)
+//           return false when the stage answered the request itself;
+//           optional void after(Exchange &ex) runs once the inner stages
+//           have produced the response
+//
+//   async:  template <class Next> void operator()(Exchange &ex, Next next)
+//           call next() to run the inner stages, or next.finish() after
+//           answering; either exactly once, now or from a later callback.
+//           next.then(f) runs the inner stages and then f(ex, finish), which
+//           may rewrite the response, even asynchronously, before finish()
+//
+// The caller says whether the client is on this host and passes a
+// completion that runs when the response is ready.
+
+template <class Request, class Response>
+struct http_exchange {
+    Request &m_req;
+    Response &m_res;
+    std::pmr::memory_resource *m_mr;
+    bool m_closing;
+    // the client is on this host, see async_file::peer_is_local
+    bool m_local_peer;
+};
+
+template <class Stage, class Exchange>
+concept sync_middleware = requires (Stage stage, Exchange &ex) {
+    { stage(ex) } -> std::convertible_to<bool>;
+};
+
+template <class Stage, class Exchange>
+concept middleware_with_after = requires (Stage stage, Exchange &ex) {
+    stage.after(ex);
+};
+
+template <class Pipeline, size_t I, class Exchange, class Done>
+struct middleware_next {
+    Exchange m_ex;
+    Done m_done;
+
+    void operator()() {
+        return Pipeline::template _run<I + 1>(m_ex, std::move(m_done));
+    }
+
+    void finish() {
+        return m_done();
+    }
+
+    template <class After>
+    void then(After after) {
+        return Pipeline::template _run<I + 1>(m_ex, [ex = m_ex, done = std::move(m_done),
+                                                     after = std::move(after)] () mutable {
+            return after(ex, std::move(done));
+        });
+    }
+};
+
+template <class Handler, class... Stages>
+struct http_pipeline {
+    template <class Request, class Response, class Done>
+    static void handle(Request &req, Response &res, std::pmr::memory_resource *mr, bool closing,
+                       bool local_peer, Done &&done) {
+        http_exchange<Request, Response> ex{req, res, mr, closing, local_peer};
+        return _run<0>(ex, std::forward<Done>(done));
+    }
+
+    template <size_t I, class Exchange>
+    static constexpr bool _sync_from() {
+        if constexpr (I == sizeof...(Stages)) {
+            return true;
+        }
+        else {
+            using Stage = std::tuple_element_t<I, std::tuple<Stages...>>;
+            return sync_middleware<Stage, Exchange> && _sync_from<I + 1, Exchange>();
+        }
+    }
+
+    template <size_t I, class Exchange, class Done>
+    static void _run(Exchange ex, Done done) {
+        if constexpr (I == sizeof...(Stages)) {
+            Handler::handle(ex.m_req, ex.m_res, ex.m_mr, ex.m_closing);
+            return done();
+        }
+        else {
+            using Stage = std::tuple_element_t<I, std::tuple<Stages...>>;
+            if constexpr (sync_middleware<Stage, Exchange>) {
+                if (!Stage{}(ex)) {
+                    return done();
+                }
+                if constexpr (middleware_with_after<Stage, Exchange> && _sync_from<I + 1, Exchange>()) {
+                    // inner stages complete before _run returns: nothing to keep alive
+                    return _run<I + 1>(ex, [&ex, &done] {
+                        Stage{}.after(ex);
+                        return done();
+                    });
+                }
+                else if constexpr (middleware_with_after<Stage, Exchange>) {
+                    return _run<I + 1>(ex, [ex, done = std::move(done)] () mutable {
+                        Stage{}.after(ex);
+                        return done();
+                    });
+                }
+                else {
+                    return _run<I + 1>(ex, std::move(done));
+                }
+            }
+            else {
+                return Stage{}(ex, middleware_next<http_pipeline, I, Exchange, Done>{ex, std::move(done)});
+            }
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,336 @@
+#ifndef RELOAD_HANDOFF_HPP
+#define RELOAD_HANDOFF_HPP
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <format>
+#include <print>
+#include <string>
+#include <vector>
+
+#include "exception.hpp"
+#include "async_file.hpp"
+#include "http_server.hpp"
+
+// Zero-downtime restart. The running server listens on a unix control socket;
+// a new instance connects to it at startup and receives the listening fds via
+// SCM_RIGHTS. The old instance then stops accepting, drains its connections
+// and leaves io_context::join() when they are gone or the deadline passes.
+//
+// Whoever can connect gets every listener and makes us exit, so the socket
+// lives in a directory only our uid can enter, and both ends check the
+// other's SO_PEERCRED uid.
+struct reload_handoff : std::enable_shared_from_this<reload_handoff> {
+    // SCM_MAX_FD: one message carries at most this many fds
+    static constexpr size_t k_max_fds = 253;
+
+    std::string m_path;
+    std::chrono::milliseconds m_drain_timeout;
+    std::vector<http_acceptor::pointer> m_acceptors;
+    async_file m_control;
+    async_file m_deadline;
+    address_resolver::address m_peer_addr;
+    uint64_t m_expirations = 0;
+
+    using pointer = std::shared_ptr<reload_handoff>;
+
+    static pointer make(std::string path, std::chrono::milliseconds drain_timeout = std::chrono::seconds(30)) {
+        auto p = std::make_shared<pointer::element_type>();
+        p->m_path = std::move(path);
+        p->m_drain_timeout = drain_timeout;
+        return p;
+    }
+
+    // $XDG_RUNTIME_DIR/co_http.reload.sock, or /tmp/co_http-<uid>/reload.sock
+    static std::string default_path() {
+        if (char const *runtime = getenv("XDG_RUNTIME_DIR"); runtime && *runtime == '/') {
+            return std::string(runtime) + "/co_http.reload.sock";
+        }
+        return std::format("/tmp/co_http-{}/reload.sock", geteuid());
+    }
+
+    std::string _directory() const {
+        auto slash = m_path.rfind('/');
+        if (slash == std::string::npos) {
+            return ".";
+        }
+        return slash == 0 ? "/" : m_path.substr(0, slash);
+    }
+
+    // The socket's directory, created if missing: ours, a real directory
+    // and closed to group and others; throws otherwise.
+    void _make_private_directory() const {
+        auto dir = _directory();
+        if (mkdir(dir.c_str(), 0700) < 0 && errno != EEXIST) {
+            _throw_system_error(("reload_handoff: mkdir " + dir).c_str());
+        }
+        if (!_is_private_directory(dir)) {
+            throw std::system_error(std::make_error_code(std::errc::permission_denied),
+                                    "reload_handoff: " + dir + " must be a directory of uid "
+                                    + std::to_string(geteuid()) + " with mode 0700");
+        }
+    }
+
+    static bool _is_private_directory(std::string const &dir) {
+        struct stat st;
+        return lstat(dir.c_str(), &st) == 0 && S_ISDIR(st.st_mode)
+            && st.st_uid == geteuid() && (st.st_mode & 077) == 0;
+    }
+
+    static bool _peer_is_us(int sockfd) {
+        struct ucred cred{};
+        socklen_t len = sizeof(cred);
+        return getsockopt(sockfd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 && cred.uid == geteuid();
+    }
+
+    struct sockaddr_un _control_address() const {
+        struct sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        if (m_path.size() >= sizeof(addr.sun_path)) {
+            throw std::invalid_argument("reload_handoff: control path too long");
+        }
+        std::memcpy(addr.sun_path, m_path.data(), m_path.size());
+        return addr;
+    }
+
+    // Blocking, meant for startup: fetch the listening fds of a running
+    // predecessor. Empty if there is none, or if it does not answer within
+    // timeout; the caller then binds fresh sockets.
+    std::vector<int> take_over(std::chrono::milliseconds timeout = std::chrono::seconds(5)) const {
+        if (!_is_private_directory(_directory())) {
+            return {};
+        }
+        auto addr = _control_address();
+        int sockfd = CHECK_CALL(socket, AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        // a hung predecessor may never accept or answer: connect() obeys the
+        // send timeout on unix sockets, recvmsg() the receive timeout
+        auto secs = std::chrono::duration_cast<std::chrono::seconds>(timeout);
+        struct timeval tv{};
+        tv.tv_sec = secs.count();
+        tv.tv_usec = std::chrono::duration_cast<std::chrono::microseconds>(timeout - secs).count();
+        CHECK_CALL(setsockopt, sockfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        CHECK_CALL(setsockopt, sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        if (connect(sockfd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0 || !_peer_is_us(sockfd)) {
+            if (errno == EAGAIN || errno == EINPROGRESS) {
+                std::println("旧进程没有响应重载请求，改为重新绑定监听套接字");
+            }
+            close(sockfd);
+            return {};
+        }
+
+        char byte;
+        struct iovec iov{&byte, 1};
+        alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(int) * k_max_fds)];
+        struct msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        ssize_t n = recvmsg(sockfd, &msg, MSG_CMSG_CLOEXEC);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            std::println("旧进程没有及时移交监听套接字，改为重新绑定");
+        }
+        close(sockfd);
+
+        std::vector<int> fds;
+        if (n <= 0) {
+            return fds;
+        }
+        for (auto *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+                continue;
+            }
+            size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            auto *data = reinterpret_cast<int *>(CMSG_DATA(cmsg));
+            fds.insert(fds.end(), data, data + count);
+        }
+        return fds;
+    }
+
+    // serve future reloads for these acceptors
+    void do_start(std::vector<http_acceptor::pointer> acceptors) {
+        m_acceptors = std::move(acceptors);
+        if (m_acceptors.size() > k_max_fds) {
+            throw std::invalid_argument("reload_handoff: too many acceptors");
+        }
+        _make_private_directory();
+        auto addr = _control_address();
+        int sockfd = CHECK_CALL(socket, AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        // a predecessor's socket; anything else at the path is not ours to remove
+        struct stat st;
+        if (lstat(m_path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+            unlink(m_path.c_str());
+        }
+        CHECK_CALL(bind, sockfd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr));
+        (void)chmod(m_path.c_str(), 0600);
+        CHECK_CALL(listen, sockfd, 1);
+        m_control = async_file::async_wrap(sockfd);
+        return do_accept();
+    }
+
+    void do_accept() {
+        m_peer_addr = {};
+        return m_control.async_accept(m_peer_addr, [self = shared_from_this()] (exception<int> ret) {
+            if (ret.error()) {
+                return self->do_accept();
+            }
+            int connfd = ret.value();
+            if (!_peer_is_us(connfd)) {
+                std::println("拒绝了其他用户的重载请求");
+                close(connfd);
+                return self->do_accept();
+            }
+            bool sent = self->_send_fds(connfd);
+            close(connfd);
+            if (!sent) {
+                return self->do_accept();
+            }
+            return self->_hand_over();
+        });
+    }
+
+    bool _send_fds(int connfd) const {
+        std::vector<int> fds;
+        for (auto const &acceptor: m_acceptors) {
+            fds.push_back(acceptor->listen_fd());
+        }
+        char byte = 'F';
+        struct iovec iov{&byte, 1};
+        alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(int) * k_max_fds)]{};
+        struct msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+        auto *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+        std::memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+        return sendmsg(connfd, &msg, MSG_NOSIGNAL) == 1;
+    }
+
+    void _hand_over() {
+        std::println("已将监听套接字移交给新进程，正在等待连接结束");
+        m_control = async_file();
+        for (auto const &acceptor: m_acceptors) {
+            acceptor->stop();
+        }
+
+        int tfd = CHECK_CALL(timerfd_create, CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        auto secs = std::chrono::duration_cast<std::chrono::seconds>(m_drain_timeout);
+        struct itimerspec spec{};
+        spec.it_value.tv_sec = secs.count();
+        spec.it_value.tv_nsec = std::chrono::duration_cast<std::chrono::nanoseconds>(m_drain_timeout - secs).count();
+        CHECK_CALL(timerfd_settime, tfd, 0, &spec, nullptr);
+        m_deadline = async_file::async_wrap(tfd);
+
+        http_connection_handler::begin_drain([] {
+            io_context::get().stop();
+        });
+
+        bytes_view buf{reinterpret_cast<char *>(&m_expirations), sizeof(m_expirations)};
+        return m_deadline.async_read(buf, [self = shared_from_this()] (exception<size_t>) {
+            io_context::get().stop();
+        });
+    }
+};
+
+// The listening sockets take_over() returned, handed out by address: a
+// listener only adopts sockets bound exactly where it would bind itself, so
+// a predecessor started with other settings cannot hand 8443 to the plain
+// HTTP acceptor. Sockets nobody claims are closed with this object.
+struct inherited_listeners {
+    std::vector<int> m_fds;
+
+    explicit inherited_listeners(std::vector<int> fds) : m_fds(std::move(fds)) {}
+
+    inherited_listeners(inherited_listeners &&) = delete;
+
+    ~inherited_listeners() {
+        close_rest();
+    }
+
+    // the predecessor keeps its copies; ours of unclaimed sockets go
+    void close_rest() {
+        for (int fd: m_fds) {
+            close(fd);
+        }
+        m_fds.clear();
+    }
+
+    [[nodiscard]] bool empty() const {
+        return m_fds.empty();
+    }
+
+    // up to count sockets listening on the first address name:port resolves
+    // to, the one a fresh bind would use; in the order they were sent
+    std::vector<int> take(std::string const &name, std::string const &port, size_t count = 1) {
+        if (m_fds.empty()) {
+            return {};
+        }
+        address_resolver resolver;
+        auto entry = resolver.resolve(name, port);
+        return _take(entry.get_address(), count);
+    }
+
+    std::vector<int> take_unix(std::string_view path, size_t count = 1) {
+        if (m_fds.empty()) {
+            return {};
+        }
+        auto addr = address_resolver::unix_address(path);
+        return _take(addr, count);
+    }
+
+    std::vector<int> _take(address_resolver::address_ref want, size_t count) {
+        std::vector<int> taken;
+        std::erase_if(m_fds, [&] (int fd) {
+            if (taken.size() == count || !_listens_on(fd, want)) {
+                return false;
+            }
+            taken.push_back(fd);
+            return true;
+        });
+        return taken;
+    }
+
+    static bool _listens_on(int fd, address_resolver::address_ref want) {
+        int listening = 0;
+        socklen_t optlen = sizeof(listening);
+        if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &optlen) < 0 || !listening) {
+            return false;
+        }
+        address_resolver::address have;
+        if (getsockname(fd, &have.m_addr, &have.m_addrlen) < 0 || have.m_addr.sa_family != want.m_addr->sa_family) {
+            return false;
+        }
+        switch (want.m_addr->sa_family) {
+        case AF_INET: {
+            auto &a = reinterpret_cast<struct sockaddr_in const &>(have.m_addr_storage);
+            auto &b = *reinterpret_cast<struct sockaddr_in const *>(want.m_addr);
+            return a.sin_port == b.sin_port && a.sin_addr.s_addr == b.sin_addr.s_addr;
+        }
+        case AF_INET6: {
+            auto &a = reinterpret_cast<struct sockaddr_in6 const &>(have.m_addr_storage);
+            auto &b = *reinterpret_cast<struct sockaddr_in6 const *>(want.m_addr);
+            return a.sin6_port == b.sin6_port && std::memcmp(&a.sin6_addr, &b.sin6_addr, sizeof(a.sin6_addr)) == 0;
+        }
+        case AF_UNIX:
+            // the path, or for the abstract namespace the leading NUL and name
+            return have.m_addrlen == want.m_addrlen
+                && std::memcmp(&have.m_addr, want.m_addr, want.m_addrlen) == 0;
+        default:
+            return false;
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef REQUEST_ARENA_HPP
+#define REQUEST_ARENA_HPP
+
+#include <cstddef>
+#include <memory_resource>
+
+// Monotonic per-connection arena; everything a request allocates is dropped
+// at once by reset(). Containers using it must be emptied (re-created) first.
+template <size_t N = 8192>
+struct request_arena {
+    alignas(std::max_align_t) std::byte m_initial[N];
+    std::pmr::monotonic_buffer_resource m_resource{m_initial, N, std::pmr::new_delete_resource()};
+
+    request_arena() = default;
+    request_arena(request_arena &&) = delete;
+
+    std::pmr::memory_resource *resource() noexcept {
+        return &m_resource;
+    }
+
+    void reset() {
+        m_resource.release();
+    }
+};
+
+#endif
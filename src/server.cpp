@@ -1,3 +1,6 @@
+#include <csignal>
+#include <cstdlib>
+
 #include "exception.hpp"
 #include "address_resolver.hpp"
 #include "http_server.hpp"
@@ -5,23 +8,185 @@
 #include "callback.hpp"
 #include "io_context.hpp"
 #include "async_file.hpp"
+#include "async_resolver.hpp"
+#include "http_date.hpp"
+#include "request_arena.hpp"
+#include "reload_handoff.hpp"
+#include "sha1.hpp"
+#include "websocket.hpp"
+#include "http_message.hpp"
+#include "hpack.hpp"
+#include "http2.hpp"
+#include "tls_context.hpp"
+#include "admission_control.hpp"
+#include "trace.hpp"
+#include "trace_dumper.hpp"
+#include "cpu_placement.hpp"
+#include "worker_pool.hpp"
+#include "memory_pipe.hpp"
+#include "http_compression.hpp"
+#include "zerocopy.hpp"
+#include "loopback_replay.hpp"
 
 void server() {
+    // a peer gone mid-write (or mid close_notify) is an EPIPE, not a crash
+    signal(SIGPIPE, SIG_IGN);
     io_context ctx;
-    auto acceptor = http_acceptor::make();
-    acceptor->do_start("127.0.0.1", "8080");
+#ifdef CO_HTTP_TRACE
+    // kill -USR2 <pid> writes the recent trace, also served at /debug/trace;
+    // CO_HTTP_TRACE_FILE=path overrides trace_dumper::default_path
+    char const *trace_path = getenv("CO_HTTP_TRACE_FILE");
+    auto dumper = trace_dumper::make(SIGUSR2, trace_path ? trace_path : trace_dumper::default_path());
+    dumper->do_start();
+#endif
+    admission_control admission;
+    async_resolver resolver;
+    admission.on_pressure([] {
+        http_connection_handler::shutdown_idle(admission_control::get().m_limits.m_idle_age);
+    });
+    // CO_HTTP_RELOAD=path: the reload control socket, by default in a
+    // private directory (see reload_handoff::default_path)
+    char const *reload_path = getenv("CO_HTTP_RELOAD");
+    auto reload = reload_handoff::make(reload_path ? reload_path : reload_handoff::default_path());
+
+    // listeners of a predecessor, claimed below by the address they are
+    // bound to; the rest are closed once everything listens
+    inherited_listeners inherited(reload->take_over());
+    if (!inherited.empty()) {
+        std::println("已接管旧进程的监听套接字");
+    }
+    std::vector<http_acceptor::pointer> acceptors;
+
+    // every client speaks first, so accept() can wait for the request bytes
+    address_resolver::socket_options tuning;
+    tuning.m_backlog = 4096;
+    tuning.m_defer_accept = std::chrono::seconds(5);
+    tuning.m_fastopen_queue = 256;
+    tuning.m_nodelay = true;
+    tuning.m_quickack = true;
+    // CO_HTTP_TUNING=0: kernel defaults instead, for comparison; listeners
+    // inherited on reload keep the options they were created with
+    if (char const *env = getenv("CO_HTTP_TUNING"); env && std::string_view(env) == "0") {
+        tuning = {};
+    }
+
+    // CO_HTTP_ZEROCOPY=bytes: response bodies from that size up are pinned
+    // and sent with MSG_ZEROCOPY; see zerocopy_tracker for when that pays off
+    if (char const *env = getenv("CO_HTTP_ZEROCOPY")) {
+        zerocopy_tracker::g_min_size = std::strtoul(env, nullptr, 10);
+    }
+
+    // CO_HTTP_BUSY_POLL=spin_us[,usecs[,budget[,prefer]]]: keep polling for
+    // spin_us after the last event; the rest go to the kernel busy-poll knobs
+    io_context::busy_poll busy;
+    if (char const *env = getenv("CO_HTTP_BUSY_POLL")) {
+        char *end;
+        busy.m_spin = std::chrono::microseconds(std::strtoul(env, &end, 10));
+        if (*end == ',') {
+            busy.m_usecs = static_cast<uint32_t>(std::strtoul(end + 1, &end, 10));
+        }
+        if (*end == ',') {
+            busy.m_budget = static_cast<uint16_t>(std::strtoul(end + 1, &end, 10));
+        }
+        if (*end == ',') {
+            busy.m_prefer = std::strtoul(end + 1, &end, 10) != 0;
+        }
+        ctx.enable_busy_poll(busy);
+    }
+
+    // CO_HTTP_WORKERS=n: 8080 is served by n loops pinned to the first n
+    // allowed CPUs (see worker_pool), otherwise by this thread alone
+    worker_pool::pointer workers;
+    size_t nworkers = 0;
+    if (char const *env = getenv("CO_HTTP_WORKERS")) {
+        nworkers = std::strtoul(env, nullptr, 10);
+    }
+    if (nworkers > 0) {
+        auto cpus = cpu_placement::allowed_cpus();
+        cpus.resize(std::min(cpus.size(), nworkers));
+        workers = worker_pool::make();
+        workers->m_options = tuning;
+        workers->m_busy_poll = busy;
+        // a predecessor with more workers leaves its extra listeners to close_rest()
+        workers->start(cpus, "127.0.0.1", "8080", inherited.take("127.0.0.1", "8080", cpus.size()));
+        acceptors = workers->acceptors();
+    }
+    else {
+        auto acceptor = http_acceptor::make();
+        acceptor->use_options(tuning);
+        auto fds = inherited.take("127.0.0.1", "8080");
+        if (fds.empty()) {
+            acceptor->do_start("127.0.0.1", "8080");
+        }
+        else {
+            acceptor->do_start(fds[0]);
+        }
+        acceptors.push_back(acceptor);
+    }
+
+#ifdef CO_HTTP_TLS
+    // HTTPS on 8443 when CO_HTTP_TLS_CERT and CO_HTTP_TLS_KEY name PEM files
+    char const *cert = getenv("CO_HTTP_TLS_CERT");
+    char const *key = getenv("CO_HTTP_TLS_KEY");
+    if (cert && key) {
+        auto tls_acceptor = http_acceptor::make();
+        tls_acceptor->use_tls(tls_context::make(cert, key));
+        tls_acceptor->use_options(tuning);
+        auto fds = inherited.take("127.0.0.1", "8443");
+        if (fds.empty()) {
+            tls_acceptor->do_start("127.0.0.1", "8443");
+        }
+        else {
+            tls_acceptor->do_start(fds[0]);
+        }
+        acceptors.push_back(tls_acceptor);
+    }
+#endif
+
+    // also serve a Unix domain socket when CO_HTTP_UNIX names one, e.g.
+    // /run/co_http.sock or @co_http for the abstract namespace
+    if (char const *unix_path = getenv("CO_HTTP_UNIX")) {
+        auto unix_acceptor = http_acceptor::make();
+        unix_acceptor->use_options(tuning);
+        auto fds = inherited.take_unix(unix_path);
+        if (fds.empty()) {
+            unix_acceptor->do_start_unix(unix_path);
+        }
+        else {
+            unix_acceptor->do_start(fds[0]);
+        }
+        acceptors.push_back(unix_acceptor);
+    }
+
+    inherited.close_rest();
+    reload->do_start(acceptors);
 
     ctx.join();
+    if (workers) {
+        workers->drain(reload->m_drain_timeout);
+    }
 }
 
 int main()
 {
     // setlocale(LC_ALL, "zh_CN.UTF-8");
     try {
+#ifdef CO_HTTP_REPLAY
+        // benchmark mode: replay a request corpus in memory instead of serving
+        if (char const *corpus = getenv("CO_HTTP_REPLAY")) {
+            loopback_replay::run(corpus);
+            return 0;
+        }
+#endif
         server();
     }
     catch (std::system_error const &e) {
         std::println("错误: {} ({} / {})", e.what(), e.code().category().name(), e.code().value());
+        return 1;
+    }
+    catch (std::exception const &e) {
+        std::println("错误: {}", e.what());
+        return 1;
     }
     return 0;
-}
\ No newline at end of file
+}
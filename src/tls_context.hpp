@@ -0,0 +1,100 @@
+#ifndef TLS_CONTEXT_HPP
+#define TLS_CONTEXT_HPP
+
+#ifdef CO_HTTP_TLS
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+// Server-side TLS settings shared by every connection of every thread.
+// Only the handshake runs in OpenSSL; once it is done, SSL_OP_ENABLE_KTLS
+// moves record encryption into the kernel when the cipher and kernel
+// allow it, and async_file then writes with plain write(2).
+struct tls_context {
+    SSL_CTX *m_ctx = nullptr;
+    bool m_alpn_h2 = true;
+
+    using pointer = std::shared_ptr<tls_context>;
+
+    [[noreturn]] static void _throw_ssl_error(char const *what) {
+        char buf[256];
+        ERR_error_string_n(ERR_get_error(), buf, sizeof(buf));
+        throw std::runtime_error(std::string(what) + ": " + buf);
+    }
+
+    static pointer make(std::string const &cert_file, std::string const &key_file) {
+        auto self = std::make_shared<tls_context>();
+        SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+        if (!ctx) {
+            _throw_ssl_error("SSL_CTX_new");
+        }
+        self->m_ctx = ctx;
+
+        SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+        // AES-GCM first: it is what kTLS offloads on every kernel that has it
+        SSL_CTX_set_ciphersuites(ctx, "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384:TLS_CHACHA20_POLY1305_SHA256");
+        SSL_CTX_set_cipher_list(ctx, "ECDHE+AESGCM:ECDHE+CHACHA20");
+        SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE);
+        // async_file retries writes with a moved buffer and accepts short writes
+        SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER
+                              | SSL_MODE_RELEASE_BUFFERS);
+
+        // resumption: a server-side session cache for TLS 1.2 session ids and
+        // stateless tickets (one per handshake is enough) for TLS 1.3
+        static constexpr unsigned char sid_ctx[] = "co_http";
+        SSL_CTX_set_session_id_context(ctx, sid_ctx, sizeof(sid_ctx) - 1);
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+        SSL_CTX_sess_set_cache_size(ctx, 20480);
+        SSL_CTX_set_num_tickets(ctx, 1);
+
+        if (SSL_CTX_use_certificate_chain_file(ctx, cert_file.c_str()) != 1) {
+            _throw_ssl_error("SSL_CTX_use_certificate_chain_file");
+        }
+        if (SSL_CTX_use_PrivateKey_file(ctx, key_file.c_str(), SSL_FILETYPE_PEM) != 1) {
+            _throw_ssl_error("SSL_CTX_use_PrivateKey_file");
+        }
+
+        SSL_CTX_set_alpn_select_cb(ctx, _select_alpn, self.get());
+        return self;
+    }
+
+    // prefer h2 when the client offers it, otherwise http/1.1
+    static int _select_alpn(SSL *, unsigned char const **out, unsigned char *outlen,
+                            unsigned char const *in, unsigned int inlen, void *arg) {
+        auto *self = static_cast<tls_context *>(arg);
+        static constexpr unsigned char protos[] = "\x02h2\x08http/1.1";
+        unsigned char const *server = self->m_alpn_h2 ? protos : protos + 3;
+        unsigned int server_len = self->m_alpn_h2 ? sizeof(protos) - 1 : sizeof(protos) - 4;
+        unsigned char *selected = nullptr;
+        if (SSL_select_next_proto(&selected, outlen, server, server_len, in, inlen) != OPENSSL_NPN_NEGOTIATED) {
+            return SSL_TLSEXT_ERR_NOACK;
+        }
+        *out = selected;
+        return SSL_TLSEXT_ERR_OK;
+    }
+
+    SSL *new_session(int fd) const {
+        SSL *ssl = SSL_new(m_ctx);
+        if (!ssl) {
+            _throw_ssl_error("SSL_new");
+        }
+        SSL_set_fd(ssl, fd);
+        SSL_set_accept_state(ssl);
+        return ssl;
+    }
+
+    tls_context() = default;
+    tls_context(tls_context &&) = delete;
+
+    ~tls_context() {
+        SSL_CTX_free(m_ctx);
+    }
+};
+
+#endif
+
+#endif
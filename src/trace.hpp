@@ -0,0 +1,243 @@
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+// Request tracing into per-thread ring buffers, exported as Chrome trace JSON
+// (chrome://tracing, ui.perfetto.dev). Compiled in only with CO_HTTP_TRACE;
+// otherwise every TRACE_* macro expands to nothing.
+//
+//   TRACE_EVENT(name, id, value)  instant event, e.g. bytes or -errno
+//   TRACE_SCOPE(name, id)         complete event spanning the enclosing scope
+//   trace_span span(name, id)     complete event ending at span.end(), for a
+//                                 span that ends in a callback it is moved into
+//   TRACE_CONN(id)                connection that following events belong to
+//                                 when the caller has no id of its own (parsers)
+//
+// name must be a string literal, id is usually the connection's fd.
+
+#ifdef CO_HTTP_TRACE
+
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <format>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+inline uint64_t trace_clock() noexcept {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    uint64_t ticks;
+    asm volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+    return ticks;
+#else
+    return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+struct trace_event {
+    uint64_t m_tsc;
+    uint64_t m_value;  // duration in ticks for 'X', argument for 'i'
+    char const *m_name;
+    uint32_t m_id;
+    char m_phase;
+};
+
+// Single writer (the owning thread), readers only during a dump. The writer
+// never waits: every slot is a seqlock, odd while being written and
+// 2 * (index + 1) once event number index is complete, so a dump racing with
+// the writer skips the slots it is overwriting instead of reading torn ones.
+struct trace_ring {
+    static constexpr size_t k_capacity = 1 << 16;
+
+    struct _slot {
+        std::atomic<uint64_t> m_seq{0};
+        std::atomic<uint64_t> m_tsc{0};
+        std::atomic<uint64_t> m_value{0};
+        std::atomic<char const *> m_name{nullptr};
+        std::atomic<uint32_t> m_id{0};
+        std::atomic<char> m_phase{0};
+    };
+
+    std::unique_ptr<_slot[]> m_slots = std::make_unique<_slot[]>(k_capacity);
+    std::atomic<uint64_t> m_head{0};
+    uint32_t m_tid = 0;
+
+    void push(char phase, char const *name, uint32_t id, uint64_t tsc, uint64_t value) noexcept {
+        uint64_t head = m_head.load(std::memory_order_relaxed);
+        auto &slot = m_slots[head & (k_capacity - 1)];
+        slot.m_seq.store(2 * head + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        slot.m_tsc.store(tsc, std::memory_order_relaxed);
+        slot.m_value.store(value, std::memory_order_relaxed);
+        slot.m_name.store(name, std::memory_order_relaxed);
+        slot.m_id.store(id, std::memory_order_relaxed);
+        slot.m_phase.store(phase, std::memory_order_relaxed);
+        slot.m_seq.store(2 * head + 2, std::memory_order_release);
+        m_head.store(head + 1, std::memory_order_release);
+    }
+
+    // event number index, unless it was overwritten or is being written
+    bool read(uint64_t index, trace_event &e) const noexcept {
+        auto &slot = m_slots[index & (k_capacity - 1)];
+        uint64_t seq = slot.m_seq.load(std::memory_order_acquire);
+        if (seq != 2 * index + 2) {
+            return false;
+        }
+        e.m_tsc = slot.m_tsc.load(std::memory_order_relaxed);
+        e.m_value = slot.m_value.load(std::memory_order_relaxed);
+        e.m_name = slot.m_name.load(std::memory_order_relaxed);
+        e.m_id = slot.m_id.load(std::memory_order_relaxed);
+        e.m_phase = slot.m_phase.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return slot.m_seq.load(std::memory_order_relaxed) == seq;
+    }
+};
+
+struct trace_registry {
+    std::mutex m_mutex;
+    std::vector<std::shared_ptr<trace_ring>> m_rings;
+    // reference point to convert ticks into microseconds at dump time
+    uint64_t m_tsc0 = trace_clock();
+    std::chrono::steady_clock::time_point m_time0 = std::chrono::steady_clock::now();
+
+    static trace_registry &get() {
+        static trace_registry instance;
+        return instance;
+    }
+
+    // rings outlive their threads so that a later dump still sees them
+    std::shared_ptr<trace_ring> add_ring() {
+        auto ring = std::make_shared<trace_ring>();
+        ring->m_tid = static_cast<uint32_t>(gettid());
+        std::lock_guard lock(m_mutex);
+        m_rings.push_back(ring);
+        return ring;
+    }
+
+    std::string dump_json() {
+        uint64_t tsc1 = trace_clock();
+        auto time1 = std::chrono::steady_clock::now();
+        double us = std::chrono::duration<double, std::micro>(time1 - m_time0).count();
+        double ticks_per_us = us > 0 ? static_cast<double>(tsc1 - m_tsc0) / us : 1.0;
+        int pid = getpid();
+
+        std::vector<std::shared_ptr<trace_ring>> rings;
+        {
+            std::lock_guard lock(m_mutex);
+            rings = m_rings;
+        }
+
+        std::string out = "{\"traceEvents\":[";
+        bool first = true;
+        for (auto const &ring: rings) {
+            uint64_t head = ring->m_head.load(std::memory_order_acquire);
+            uint64_t size = std::min<uint64_t>(head, trace_ring::k_capacity);
+            for (uint64_t i = head - size; i < head; i++) {
+                trace_event e;
+                if (!ring->read(i, e) || e.m_tsc < m_tsc0) {
+                    continue;
+                }
+                double ts = static_cast<double>(e.m_tsc - m_tsc0) / ticks_per_us;
+                out += first ? "\n" : ",\n";
+                first = false;
+                if (e.m_phase == 'X') {
+                    std::format_to(std::back_inserter(out),
+                        R"({{"name":"{}","ph":"X","ts":{:.3f},"dur":{:.3f},"pid":{},"tid":{},"args":{{"conn":{}}}}})",
+                        e.m_name, ts, static_cast<double>(e.m_value) / ticks_per_us, pid, ring->m_tid, e.m_id);
+                }
+                else {
+                    std::format_to(std::back_inserter(out),
+                        R"({{"name":"{}","ph":"i","s":"t","ts":{:.3f},"pid":{},"tid":{},"args":{{"conn":{},"value":{}}}}})",
+                        e.m_name, ts, pid, ring->m_tid, e.m_id, static_cast<int64_t>(e.m_value));
+                }
+            }
+        }
+        out += "\n]}\n";
+        return out;
+    }
+};
+
+inline trace_ring &trace_local_ring() {
+    static thread_local std::shared_ptr<trace_ring> ring = trace_registry::get().add_ring();
+    return *ring;
+}
+
+inline thread_local uint32_t g_trace_conn = 0;
+
+inline void trace_instant(char const *name, uint32_t id, int64_t value) noexcept {
+    trace_local_ring().push('i', name, id, trace_clock(), static_cast<uint64_t>(value));
+}
+
+struct trace_scope {
+    char const *m_name;
+    uint32_t m_id;
+    uint64_t m_begin = trace_clock();
+
+    trace_scope(char const *name, uint32_t id) noexcept : m_name(name), m_id(id) {}
+
+    trace_scope(trace_scope &&) = delete;
+
+    ~trace_scope() {
+        uint64_t end = trace_clock();
+        trace_local_ring().push('X', m_name, m_id, m_begin, end - m_begin);
+    }
+};
+
+struct trace_span {
+    char const *m_name;
+    uint32_t m_id;
+    uint64_t m_begin = trace_clock();
+    bool m_open = true;
+
+    trace_span(char const *name, uint32_t id) noexcept : m_name(name), m_id(id) {}
+
+    trace_span(trace_span &&that) noexcept
+        : m_name(that.m_name), m_id(that.m_id), m_begin(that.m_begin), m_open(std::exchange(that.m_open, false)) {}
+
+    ~trace_span() {
+        end();
+    }
+
+    void end() noexcept {
+        if (m_open) {
+            m_open = false;
+            trace_local_ring().push('X', m_name, m_id, m_begin, trace_clock() - m_begin);
+        }
+    }
+};
+
+#define TRACE_CONCAT_2(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_2(a, b)
+#define TRACE_EVENT(name, id, value) trace_instant(name, static_cast<uint32_t>(id), static_cast<int64_t>(value))
+#define TRACE_SCOPE(name, id) trace_scope TRACE_CONCAT(_trace_scope_, __LINE__)(name, static_cast<uint32_t>(id))
+#define TRACE_CONN(id) (g_trace_conn = static_cast<uint32_t>(id))
+#define TRACE_CURRENT_CONN g_trace_conn
+
+#else
+
+#include <cstdint>
+
+struct trace_span {
+    trace_span(char const *, uint32_t) noexcept {}
+
+    void end() noexcept {}
+};
+
+#define TRACE_EVENT(name, id, value) ((void)0)
+#define TRACE_SCOPE(name, id) ((void)0)
+#define TRACE_CONN(id) ((void)0)
+#define TRACE_CURRENT_CONN 0
+
+#endif
+
+#endif
@@ -0,0 +1,111 @@
+#ifndef TRACE_DUMPER_HPP
+#define TRACE_DUMPER_HPP
+
+#ifdef CO_HTTP_TRACE
+
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <csignal>
+#include <cstdlib>
+#include <format>
+#include <memory>
+#include <string>
+
+#include "exception.hpp"
+#include "async_file.hpp"
+#include "trace.hpp"
+
+// Writes the trace rings as Chrome trace JSON to m_path whenever the process
+// receives m_signo (e.g. `kill -USR2 <pid>`). The signal is blocked and read
+// through a signalfd, so the dump runs on the loop like any other event.
+//
+// The trace shows request paths and timings, so it is only written into a
+// directory of ours closed to everyone else, and never through a link.
+struct trace_dumper : std::enable_shared_from_this<trace_dumper> {
+    int m_signo;
+    std::string m_path;
+    async_file m_sigfd;
+    struct signalfd_siginfo m_info;
+
+    using pointer = std::shared_ptr<trace_dumper>;
+
+    // $XDG_RUNTIME_DIR/co_http.trace.json, else /tmp/co_http-<euid>/trace.json
+    static std::string default_path() {
+        if (char const *runtime = getenv("XDG_RUNTIME_DIR"); runtime && *runtime == '/') {
+            return std::string(runtime) + "/co_http.trace.json";
+        }
+        return std::format("/tmp/co_http-{}/trace.json", geteuid());
+    }
+
+    static pointer make(int signo, std::string path) {
+        auto p = std::make_shared<pointer::element_type>();
+        p->m_signo = signo;
+        p->m_path = std::move(path);
+        return p;
+    }
+
+    // call before starting other threads: they inherit the blocked mask
+    void do_start() {
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigaddset(&mask, m_signo);
+        CHECK_CALL(sigprocmask, SIG_BLOCK, &mask, nullptr);
+        int sfd = CHECK_CALL(signalfd, -1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+        m_sigfd = async_file::async_wrap(sfd);
+        return do_wait();
+    }
+
+    void do_wait() {
+        bytes_view buf{reinterpret_cast<char *>(&m_info), sizeof(m_info)};
+        return m_sigfd.async_read(buf, [self = shared_from_this()] (exception<size_t> ret) {
+            if (ret.error()) {
+                return;
+            }
+            self->dump();
+            return self->do_wait();
+        });
+    }
+
+    // m_path's directory, created if missing; false unless it is ours, a
+    // real directory and closed to group and others
+    bool _private_directory() const {
+        auto slash = m_path.rfind('/');
+        std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : m_path.substr(0, slash);
+        (void)mkdir(dir.c_str(), 0700);
+        struct stat st;
+        return lstat(dir.c_str(), &st) == 0 && S_ISDIR(st.st_mode)
+            && st.st_uid == geteuid() && (st.st_mode & 077) == 0;
+    }
+
+    // blocking: a debugging aid, not worth a thread
+    void dump() const {
+        if (!_private_directory()) {
+            std::println("追踪文件的目录不是私有目录, 不写入 {}", m_path);
+            return;
+        }
+        auto json = trace_registry::get().dump_json();
+        std::string tmp = m_path + ".tmp";
+        // a leftover of an interrupted dump; the directory is ours alone
+        (void)unlink(tmp.c_str());
+        int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+        if (fd < 0) {
+            std::println("无法写入追踪文件 {}", tmp);
+            return;
+        }
+        for (size_t off = 0; off < json.size(); ) {
+            ssize_t n = write(fd, json.data() + off, json.size() - off);
+            if (n <= 0) {
+                break;
+            }
+            off += n;
+        }
+        close(fd);
+        rename(tmp.c_str(), m_path.c_str());
+        std::println("追踪已写入 {}", m_path);
+    }
+};
+
+#endif
+
+#endif
@@ -0,0 +1,583 @@
+#ifndef WEBSOCKET_HPP
+#define WEBSOCKET_HPP
+
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "bytes_buffer.hpp"
+#include "callback.hpp"
+#include "async_file.hpp"
+#include "connection_drain.hpp"
+#include "sha1.hpp"
+
+enum class websocket_opcode : uint8_t {
+    continuation = 0x0,
+    text = 0x1,
+    binary = 0x2,
+    close = 0x8,
+    ping = 0x9,
+    pong = 0xA,
+};
+
+// close status codes, RFC 6455 section 7.4.1
+enum class websocket_close : uint16_t {
+    normal = 1000,
+    going_away = 1001,
+    protocol_error = 1002,
+    invalid_payload = 1007,
+    too_big = 1009,
+};
+
+// codes a peer may send: 1004-1006 and 1015 are reserved for reporting,
+// never put on the wire, and 3000-4999 belong to applications
+inline bool websocket_valid_close_code(uint16_t code) {
+    return (code >= 1000 && code <= 1003) || (code >= 1007 && code <= 1014)
+        || (code >= 3000 && code <= 4999);
+}
+
+// RFC 3629: shortest forms only, no surrogates, nothing past U+10FFFF
+inline bool websocket_valid_utf8(bytes_const_view text) {
+    auto const *p = reinterpret_cast<uint8_t const *>(text.data());
+    size_t size = text.size();
+    size_t i = 0;
+    while (i < size) {
+        // ASCII runs eight at a time
+        if (i + 8 <= size) {
+            uint64_t v;
+            std::memcpy(&v, p + i, 8);
+            if ((v & 0x8080808080808080ull) == 0) {
+                i += 8;
+                continue;
+            }
+        }
+        uint8_t c = p[i];
+        if (c < 0x80) {
+            i++;
+            continue;
+        }
+        size_t n;
+        uint8_t lo = 0x80, hi = 0xbf;
+        if (c >= 0xc2 && c <= 0xdf) {
+            n = 1;
+        }
+        else if (c >= 0xe0 && c <= 0xef) {
+            n = 2;
+            lo = c == 0xe0 ? 0xa0 : 0x80;
+            hi = c == 0xed ? 0x9f : 0xbf;
+        }
+        else if (c >= 0xf0 && c <= 0xf4) {
+            n = 3;
+            lo = c == 0xf0 ? 0x90 : 0x80;
+            hi = c == 0xf4 ? 0x8f : 0xbf;
+        }
+        else {
+            return false;
+        }
+        if (size - i <= n || p[i + 1] < lo || p[i + 1] > hi) {
+            return false;
+        }
+        for (size_t k = 2; k <= n; k++) {
+            if ((p[i + k] & 0xc0) != 0x80) {
+                return false;
+            }
+        }
+        i += n + 1;
+    }
+    return true;
+}
+
+inline std::string websocket_accept_key(std::string_view client_key) {
+    std::string s(client_key);
+    s.append("258EAFA5-E914-47DA-95CA-C5AB0DC85B11");
+    auto digest = sha1(s);
+    return base64_encode(digest.data(), digest.size());
+}
+
+// XOR data[i] with key[i % 4] in place, vectorized where the target allows.
+inline void websocket_unmask(char *data, size_t size, uint8_t const (&key)[4]) {
+    size_t i = 0;
+    uint32_t key32;
+    std::memcpy(&key32, key, 4);
+#if defined(__AVX2__)
+    __m256i vkey = _mm256_set1_epi32(static_cast<int>(key32));
+    for (; i + 32 <= size; i += 32) {
+        auto *p = reinterpret_cast<__m256i *>(data + i);
+        _mm256_storeu_si256(p, _mm256_xor_si256(_mm256_loadu_si256(p), vkey));
+    }
+#endif
+#if defined(__SSE2__)
+    __m128i vkey128 = _mm_set1_epi32(static_cast<int>(key32));
+    for (; i + 16 <= size; i += 16) {
+        auto *p = reinterpret_cast<__m128i *>(data + i);
+        _mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), vkey128));
+    }
+#elif defined(__ARM_NEON)
+    uint8x16_t vkey128 = vreinterpretq_u8_u32(vdupq_n_u32(key32));
+    for (; i + 16 <= size; i += 16) {
+        auto *p = reinterpret_cast<uint8_t *>(data + i);
+        vst1q_u8(p, veorq_u8(vld1q_u8(p), vkey128));
+    }
+#endif
+    uint64_t key64 = (uint64_t(key32) << 32) | key32;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t v;
+        std::memcpy(&v, data + i, 8);
+        v ^= key64;
+        std::memcpy(data + i, &v, 8);
+    }
+    for (; i < size; i++) {
+        data[i] ^= static_cast<char>(key[i % 4]);
+    }
+}
+
+// Serialized server frame (never masked), shared so that one frame can be
+// queued on any number of connections without copying.
+using websocket_frame = std::shared_ptr<bytes_buffer const>;
+
+inline websocket_frame websocket_make_frame(websocket_opcode opcode, bytes_const_view payload, bool fin = true) {
+    auto frame = std::make_shared<bytes_buffer>();
+    char header[10];
+    size_t header_size = 2;
+    size_t n = payload.size();
+    header[0] = static_cast<char>((fin ? 0x80 : 0x00) | static_cast<uint8_t>(opcode));
+    if (n < 126) {
+        header[1] = static_cast<char>(n);
+    }
+    else if (n <= 0xffff) {
+        header[1] = 126;
+        header[2] = static_cast<char>(n >> 8);
+        header[3] = static_cast<char>(n);
+        header_size = 4;
+    }
+    else {
+        header[1] = 127;
+        for (int i = 0; i < 8; i++) {
+            header[2 + i] = static_cast<char>(uint64_t(n) >> (56 - i * 8));
+        }
+        header_size = 10;
+    }
+    frame->reserve(header_size + n);
+    frame->append(bytes_const_view{header, header_size});
+    frame->append(payload);
+    return frame;
+}
+
+// the status code at the front of a close payload of 2 bytes or more
+inline uint16_t websocket_close_code(bytes_const_view payload) {
+    auto const *p = reinterpret_cast<uint8_t const *>(payload.data());
+    return static_cast<uint16_t>((p[0] << 8) | p[1]);
+}
+
+inline websocket_frame websocket_make_close_frame(websocket_close code) {
+    auto c = static_cast<uint16_t>(code);
+    char payload[2] = {static_cast<char>(c >> 8), static_cast<char>(c)};
+    return websocket_make_frame(websocket_opcode::close, bytes_const_view{payload, 2});
+}
+
+// Incremental client-frame parser. Complete single-frame messages are handed
+// out in place (unmasked inside the read buffer); fragmented messages are
+// reassembled in m_message. Control frames may arrive between fragments.
+// Text messages and close reasons must be UTF-8, close codes valid.
+struct websocket_frame_parser {
+    // 2 bytes, 8 of extended length, 4 of masking key
+    static constexpr size_t k_max_header = 14;
+
+    bytes_buffer m_pending;
+    bytes_buffer m_message;
+    websocket_opcode m_message_opcode = websocket_opcode::continuation;
+    bool m_in_message = false;
+    size_t m_max_message = 16 << 20;
+    // sticky: after a violation the rest of the stream is not parsed
+    uint16_t m_error = 0;
+
+    // Calls on_frame(opcode, bytes_view payload) for every message and control
+    // frame. Returns 0, or the close code for a protocol violation.
+    template <class OnFrame>
+    uint16_t push_chunk(bytes_view chunk, OnFrame &&on_frame) {
+        if (m_error != 0) {
+            return m_error;
+        }
+        bytes_view input = chunk;
+        if (m_pending.size() != 0) {
+            m_pending.append(bytes_const_view(chunk));
+            input = m_pending;
+        }
+
+        size_t pos = 0;
+        uint16_t error = 0;
+        while (error == 0) {
+            size_t used = 0;
+            error = _parse_one(input.subspan(pos), used, on_frame);
+            if (used == 0) {
+                break;
+            }
+            pos += used;
+        }
+
+        if (m_pending.size() != 0) {
+            m_pending.erase_front(pos);
+        }
+        else if (pos < input.size() && error == 0) {
+            m_pending.append(bytes_const_view(input.subspan(pos)));
+        }
+        // at most one incomplete frame is kept
+        if (error == 0 && m_pending.size() > k_max_header + m_max_message) {
+            error = static_cast<uint16_t>(websocket_close::too_big);
+        }
+        if (error != 0) {
+            m_error = error;
+            m_pending.release();
+            m_message.release();
+        }
+        return error;
+    }
+
+    template <class OnFrame>
+    uint16_t _parse_one(bytes_view in, size_t &used, OnFrame &on_frame) {
+        if (in.size() < 2) {
+            return 0;
+        }
+        auto const *p = reinterpret_cast<uint8_t const *>(in.data());
+        bool fin = p[0] & 0x80;
+        uint8_t rsv = p[0] & 0x70;
+        auto opcode = static_cast<websocket_opcode>(p[0] & 0x0f);
+        bool masked = p[1] & 0x80;
+        uint64_t len = p[1] & 0x7f;
+        size_t header_size = 2;
+        if (len == 126) {
+            header_size = 4;
+            if (in.size() < header_size) {
+                return 0;
+            }
+            len = (uint64_t(p[2]) << 8) | p[3];
+        }
+        else if (len == 127) {
+            header_size = 10;
+            if (in.size() < header_size) {
+                return 0;
+            }
+            len = 0;
+            for (int i = 0; i < 8; i++) {
+                len = (len << 8) | p[2 + i];
+            }
+        }
+
+        bool control = static_cast<uint8_t>(opcode) & 0x08;
+        if (rsv != 0 || !masked) {
+            return static_cast<uint16_t>(websocket_close::protocol_error);
+        }
+        switch (opcode) {
+        case websocket_opcode::continuation:
+        case websocket_opcode::text:
+        case websocket_opcode::binary:
+        case websocket_opcode::close:
+        case websocket_opcode::ping:
+        case websocket_opcode::pong:
+            break;
+        default:
+            return static_cast<uint16_t>(websocket_close::protocol_error);
+        }
+        if (control && (!fin || len > 125)) {
+            return static_cast<uint16_t>(websocket_close::protocol_error);
+        }
+        if (len > m_max_message || (!control && m_message.size() + len > m_max_message)) {
+            return static_cast<uint16_t>(websocket_close::too_big);
+        }
+        if (!control && (opcode == websocket_opcode::continuation) != m_in_message) {
+            return static_cast<uint16_t>(websocket_close::protocol_error);
+        }
+
+        if (in.size() < header_size + 4) {
+            return 0;
+        }
+        uint8_t key[4];
+        std::memcpy(key, p + header_size, 4);
+        header_size += 4;
+        if (in.size() - header_size < len) {
+            return 0;
+        }
+        used = header_size + len;
+        bytes_view payload = in.subspan(header_size, len);
+        websocket_unmask(payload.data(), payload.size(), key);
+
+        if (opcode == websocket_opcode::close) {
+            if (uint16_t error = _check_close(payload)) {
+                return error;
+            }
+        }
+        if (control) {
+            on_frame(opcode, payload);
+        }
+        else if (!m_in_message && fin) {
+            if (opcode == websocket_opcode::text && !websocket_valid_utf8(payload)) {
+                return static_cast<uint16_t>(websocket_close::invalid_payload);
+            }
+            on_frame(opcode, payload);
+        }
+        else {
+            if (!m_in_message) {
+                m_in_message = true;
+                m_message_opcode = opcode;
+            }
+            m_message.append(bytes_const_view(payload));
+            if (fin) {
+                m_in_message = false;
+                if (m_message_opcode == websocket_opcode::text && !websocket_valid_utf8(m_message)) {
+                    return static_cast<uint16_t>(websocket_close::invalid_payload);
+                }
+                on_frame(m_message_opcode, bytes_view(m_message));
+                m_message.release();
+            }
+        }
+        return 0;
+    }
+
+    // empty, or a valid code and a UTF-8 reason
+    static uint16_t _check_close(bytes_const_view payload) {
+        if (payload.size() == 0) {
+            return 0;
+        }
+        if (payload.size() == 1 || !websocket_valid_close_code(websocket_close_code(payload))) {
+            return static_cast<uint16_t>(websocket_close::protocol_error);
+        }
+        if (!websocket_valid_utf8(payload.subspan(2))) {
+            return static_cast<uint16_t>(websocket_close::invalid_payload);
+        }
+        return 0;
+    }
+};
+
+struct websocket_hub;
+
+struct websocket_connection : std::enable_shared_from_this<websocket_connection> {
+    using pointer = std::shared_ptr<websocket_connection>;
+    using message_callback = callback<websocket_connection &, websocket_opcode, bytes_view>;
+
+    // reads of all connections on this thread land here and are consumed
+    // before the callback returns, so idle sockets hold no read buffer
+    inline static thread_local static_bytes_buffer<16384> g_readbuf;
+    // application hook; messages are echoed back while it is unset
+    inline static thread_local message_callback g_on_message;
+
+    async_file m_conn;
+    websocket_frame_parser m_parser;
+    std::vector<websocket_frame> m_queue;
+    size_t m_queue_head = 0;
+    size_t m_offset = 0;
+    bool m_writing = false;
+    bool m_close_sent = false;
+    // the peer broke the protocol: nothing more is read from it
+    bool m_failed = false;
+    websocket_hub *m_hub = nullptr;
+    // once our close frame is out, how long the peer gets to close its side
+    std::chrono::milliseconds m_close_timeout{5000};
+    async_file m_close_timer;
+    uint64_t m_expirations = 0;
+
+    static pointer make() {
+        return std::make_shared<pointer::element_type>();
+    }
+
+    // conn has completed the upgrade handshake; early holds bytes that
+    // arrived behind the request
+    void do_start(async_file conn, bytes_view early, websocket_hub &hub);
+
+    void send(websocket_frame frame) {
+        if (m_close_sent) {
+            return;
+        }
+        m_queue.push_back(std::move(frame));
+        if (!m_writing) {
+            do_write();
+        }
+    }
+
+    void send_text(std::string_view text) {
+        send(websocket_make_frame(websocket_opcode::text, bytes_const_view{text.data(), text.size()}));
+    }
+
+    void close(websocket_close code) {
+        if (m_close_sent) {
+            return;
+        }
+        m_queue.push_back(websocket_make_close_frame(code));
+        m_close_sent = true;
+        if (!m_writing) {
+            do_write();
+        }
+    }
+
+    void _on_frame(websocket_opcode opcode, bytes_view payload) {
+        switch (opcode) {
+        case websocket_opcode::ping:
+            return send(websocket_make_frame(websocket_opcode::pong, payload));
+        case websocket_opcode::pong:
+            return;
+        case websocket_opcode::close:
+            // the parser has checked the code: echo it, or 1000 for none
+            if (payload.size() >= 2) {
+                return close(static_cast<websocket_close>(websocket_close_code(payload)));
+            }
+            return close(websocket_close::normal);
+        default:
+            if (g_on_message.m_base) {
+                return g_on_message(*this, opcode, payload);
+            }
+            return send(websocket_make_frame(opcode, payload));
+        }
+    }
+
+    void _on_bytes(bytes_view chunk) {
+        uint16_t error = m_parser.push_chunk(chunk, [this] (websocket_opcode opcode, bytes_view payload) {
+            _on_frame(opcode, payload);
+        });
+        if (error != 0) {
+            m_failed = true;
+            close(static_cast<websocket_close>(error));
+        }
+    }
+
+    void do_read() {
+        return m_conn.async_read(g_readbuf, [self = shared_from_this()] (exception<size_t> ret) {
+            if (ret.error() || ret.value() == 0) {
+                return self->_stop_close_timer();
+            }
+            self->_on_bytes(bytes_view(g_readbuf).subspan(0, ret.value()));
+            if (self->m_failed) {
+                return;
+            }
+            return self->do_read();
+        });
+    }
+
+    // our close frame is out: a failed peer is dropped right away, any other
+    // gets m_close_timeout to send its close and end the connection
+    void _closed() {
+        m_conn.shutdown_write();
+        if (m_failed || m_close_timer.m_fd != -1) {
+            return;
+        }
+        int tfd = CHECK_CALL(timerfd_create, CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        auto secs = std::chrono::duration_cast<std::chrono::seconds>(m_close_timeout);
+        struct itimerspec spec{};
+        spec.it_value.tv_sec = secs.count();
+        spec.it_value.tv_nsec = std::chrono::duration_cast<std::chrono::nanoseconds>(m_close_timeout - secs).count();
+        CHECK_CALL(timerfd_settime, tfd, 0, &spec, nullptr);
+        m_close_timer = async_file::async_wrap(tfd);
+        bytes_view buf{reinterpret_cast<char *>(&m_expirations), sizeof(m_expirations)};
+        return m_close_timer.async_read(buf, [self = shared_from_this()] (exception<size_t>) {
+            // ends the pending read, which releases the connection
+            shutdown(self->m_conn.m_fd, SHUT_RDWR);
+        });
+    }
+
+    // the peer is gone before the timeout: fire the timer now so that its
+    // callback lets go of the connection
+    void _stop_close_timer() {
+        if (m_close_timer.m_fd == -1) {
+            return;
+        }
+        struct itimerspec spec{};
+        spec.it_value.tv_nsec = 1;
+        (void)timerfd_settime(m_close_timer.m_fd, 0, &spec, nullptr);
+    }
+
+    void do_write() {
+        if (m_queue_head == m_queue.size()) {
+            m_queue.clear();
+            m_queue_head = 0;
+            m_writing = false;
+            if (m_close_sent) {
+                return _closed();
+            }
+            return;
+        }
+        m_writing = true;
+        bytes_const_view buf = bytes_const_view(*m_queue[m_queue_head]).subspan(m_offset);
+        return m_conn.async_write(buf, [self = shared_from_this()] (exception<size_t> ret) {
+            if (ret.error()) {
+                self->m_queue.clear();
+                self->m_queue_head = 0;
+                self->m_writing = false;
+                shutdown(self->m_conn.m_fd, SHUT_RDWR);
+                return;
+            }
+            self->m_offset += ret.value();
+            if (self->m_offset == self->m_queue[self->m_queue_head]->size()) {
+                self->m_queue[self->m_queue_head++].reset();
+                self->m_offset = 0;
+            }
+            return self->do_write();
+        });
+    }
+
+    ~websocket_connection();
+};
+
+// Broadcast group. Every member keeps a read armed (holding itself alive)
+// until its peer goes away, so none is destroyed while broadcast iterates.
+struct websocket_hub {
+    std::unordered_set<websocket_connection *> m_members;
+
+    void join(websocket_connection &conn) {
+        m_members.insert(&conn);
+    }
+
+    void leave(websocket_connection &conn) {
+        m_members.erase(&conn);
+    }
+
+    // serialize once, queue the same frame on every member
+    size_t broadcast(websocket_opcode opcode, bytes_const_view payload) {
+        auto frame = websocket_make_frame(opcode, payload);
+        for (auto *conn: m_members) {
+            conn->send(frame);
+        }
+        return m_members.size();
+    }
+
+    static websocket_hub &get() {
+        static thread_local websocket_hub instance;
+        return instance;
+    }
+};
+
+// on drain the peer is told 1001 and gets m_close_timeout to close
+inline void websocket_connection::do_start(async_file conn, bytes_view early, websocket_hub &hub) {
+    m_conn = std::move(conn);
+    m_hub = &hub;
+    hub.join(*this);
+    connection_drain::enter(this, [this] {
+        close(websocket_close::going_away);
+    });
+    if (early.size() != 0) {
+        _on_bytes(early);
+    }
+    if (connection_drain::draining()) {
+        close(websocket_close::going_away);
+    }
+    return do_read();
+}
+
+inline websocket_connection::~websocket_connection() {
+    if (m_hub) {
+        m_hub->leave(*this);
+    }
+    connection_drain::leave(this);
+}
+
+#endif
@@ -0,0 +1,160 @@
+#ifndef WORKER_POOL_HPP
+#define WORKER_POOL_HPP
+
+#include <sys/timerfd.h>
+#include <chrono>
+#include <latch>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "exception.hpp"
+#include "address_resolver.hpp"
+#include "io_context.hpp"
+#include "async_file.hpp"
+#include "admission_control.hpp"
+#include "async_resolver.hpp"
+#include "http_server.hpp"
+#include "cpu_placement.hpp"
+
+// One event loop per CPU, each pinned and with its own listening socket in a
+// SO_REUSEPORT group. A CBPF program steers every new connection to the
+// worker on the CPU that processed its packets, so a connection stays on one
+// core from softirq to handler. Everything a loop touches is thread_local
+// already (io_context, admission_control, async_resolver, live connections,
+// http_date).
+struct worker_pool : std::enable_shared_from_this<worker_pool> {
+    struct worker {
+        int m_cpu = -1;
+        int m_listenfd = -1;
+        address_resolver::socket_options m_options;
+        io_context::busy_poll m_busy_poll;
+        placement_stats *m_stats = nullptr;
+        io_context *m_ctx = nullptr;
+        http_acceptor::pointer m_acceptor;
+        async_file m_deadline;
+        uint64_t m_expirations = 0;
+        std::thread m_thread;
+    };
+
+    std::vector<std::unique_ptr<worker>> m_workers;
+    address_resolver::socket_options m_options;
+    // every worker loop polls like this, see io_context::busy_poll
+    io_context::busy_poll m_busy_poll;
+
+    using pointer = std::shared_ptr<worker_pool>;
+
+    static pointer make() {
+        return std::make_shared<pointer::element_type>();
+    }
+
+    // Listen on name:port with one worker per entry of cpus. inherited are
+    // the listening sockets of a predecessor, in its creation order, at most
+    // one per cpu (see inherited_listeners::take): they are kept, so nothing
+    // queued in their backlogs is lost, and only the missing ones are bound.
+    // Returns once every worker accepts.
+    void start(std::vector<int> const &cpus, std::string name, std::string port,
+               std::vector<int> const &inherited = {}) {
+        std::vector<int> listenfds = inherited;
+        if (!listenfds.empty() && listenfds.size() < cpus.size()) {
+            std::println("旧进程有 {} 个监听套接字, 需要 {} 个, 补充绑定其余的", listenfds.size(), cpus.size());
+        }
+        if (listenfds.size() < cpus.size()) {
+            std::println("正在监听：{}:{}，{} 个工作线程", name, port, cpus.size());
+            address_resolver resolver;
+            auto entry = resolver.resolve(name, port);
+            // group order is creation order: listener i belongs to cpus[i]
+            while (listenfds.size() < cpus.size()) {
+                listenfds.push_back(entry.create_socket_and_bind(m_options));
+            }
+        }
+        cpu_placement::attach_reuseport_cbpf(listenfds[0], cpus);
+
+        placement_stats::g_workers.clear();
+        for (size_t i = 0; i < cpus.size(); i++) {
+            auto w = std::make_unique<worker>();
+            w->m_cpu = cpus[i];
+            w->m_listenfd = listenfds[i];
+            w->m_options = m_options;
+            w->m_busy_poll = m_busy_poll;
+            auto stats = std::make_unique<placement_stats>();
+            stats->m_cpu = cpus[i];
+            w->m_stats = stats.get();
+            placement_stats::g_workers.push_back(std::move(stats));
+            m_workers.push_back(std::move(w));
+        }
+
+        std::latch ready(static_cast<std::ptrdiff_t>(m_workers.size()));
+        for (auto &w: m_workers) {
+            w->m_thread = std::thread([w = w.get(), &ready] {
+                _worker_main(*w, ready);
+            });
+        }
+        ready.wait();
+    }
+
+    static void _worker_main(worker &w, std::latch &ready) {
+        cpu_placement::pin_to_cpu(w.m_cpu);
+        w.m_stats->m_node = cpu_placement::current_node();
+        (void)cpu_placement::prefer_node(w.m_stats->m_node);
+        placement_stats::g_current = w.m_stats;
+
+        io_context ctx;
+        ctx.enable_busy_poll(w.m_busy_poll);
+        admission_control admission;
+        async_resolver resolver;
+        admission.on_pressure([] {
+            http_connection_handler::shutdown_idle(admission_control::get().m_limits.m_idle_age);
+        });
+        w.m_acceptor = http_acceptor::make();
+        w.m_acceptor->use_options(w.m_options);
+        w.m_acceptor->do_start(w.m_listenfd);
+        w.m_ctx = &ctx;
+        ready.count_down();
+
+        ctx.join();
+        w.m_acceptor->stop();
+        w.m_deadline = async_file();
+    }
+
+    // for reload_handoff, which passes their sockets on and stops them
+    std::vector<http_acceptor::pointer> acceptors() const {
+        std::vector<http_acceptor::pointer> result;
+        for (auto const &w: m_workers) {
+            result.push_back(w->m_acceptor);
+        }
+        return result;
+    }
+
+    // Blocking: drain every worker like reload_handoff drains the main loop,
+    // at most for timeout, then join the threads.
+    void drain(std::chrono::milliseconds timeout) {
+        for (auto &w: m_workers) {
+            w->m_ctx->post([w = w.get(), timeout] {
+                w->m_acceptor->stop();
+                int tfd = CHECK_CALL(timerfd_create, CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+                auto secs = std::chrono::duration_cast<std::chrono::seconds>(timeout);
+                struct itimerspec spec{};
+                spec.it_value.tv_sec = secs.count();
+                spec.it_value.tv_nsec = std::chrono::duration_cast<std::chrono::nanoseconds>(timeout - secs).count();
+                CHECK_CALL(timerfd_settime, tfd, 0, &spec, nullptr);
+                w->m_deadline = async_file::async_wrap(tfd);
+
+                http_connection_handler::begin_drain([] {
+                    io_context::get().stop();
+                });
+
+                bytes_view buf{reinterpret_cast<char *>(&w->m_expirations), sizeof(w->m_expirations)};
+                return w->m_deadline.async_read(buf, [] (exception<size_t>) {
+                    io_context::get().stop();
+                });
+            });
+        }
+        for (auto &w: m_workers) {
+            w->m_thread.join();
+        }
+    }
+};
+
+#endif
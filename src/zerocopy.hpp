@@ -0,0 +1,139 @@
+#ifndef ZEROCOPY_HPP
+#define ZEROCOPY_HPP
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <format>
+#include <memory>
+#include <string>
+
+// MSG_ZEROCOPY bookkeeping of one socket. The kernel sends straight from
+// the caller's pages, so every buffer passed to a zero-copy send stays
+// pinned (a shared_ptr held here) until its completion is read from the
+// socket's error queue. Sends are numbered from 0 in call order; one
+// notification acknowledges a range of them.
+//
+// Loopback and devices without scatter-gather copy anyway and say so in
+// the notification (SO_EE_CODE_ZEROCOPY_COPIED). Then the pinning and the
+// notifications are pure overhead, so after k_copied_limit such ranges in
+// a row the socket goes back to plain writes.
+struct zerocopy_tracker {
+    static constexpr int k_copied_limit = 4;
+    // how long a closed socket may wait for its completions, see
+    // async_file::_linger_zerocopy
+    static constexpr std::chrono::seconds k_linger_timeout{5};
+
+    struct _pin {
+        uint32_t m_id;
+        size_t m_bytes;
+        std::shared_ptr<void const> m_buffer;
+    };
+
+    // bodies from this size up are pinned and sent with MSG_ZEROCOPY, 0 = never
+    inline static size_t g_min_size = 0;
+
+    // process-wide, for /debug/zerocopy
+    inline static std::atomic<uint64_t> g_sends{0};
+    inline static std::atomic<uint64_t> g_bytes{0};
+    inline static std::atomic<uint64_t> g_completions{0};
+    inline static std::atomic<uint64_t> g_copied{0};
+    inline static std::atomic<uint64_t> g_fallbacks{0};
+    // closed sockets still waiting for completions, and the bytes they pin;
+    // admission_control counts the latter as buffered
+    inline static std::atomic<uint64_t> g_lingering{0};
+    inline static std::atomic<size_t> g_lingering_bytes{0};
+    inline static std::atomic<uint64_t> g_linger_timeouts{0};
+
+    uint32_t m_next_id = 0;
+    std::deque<_pin> m_pinned;
+    size_t m_pinned_bytes = 0;
+    int m_copied_in_row = 0;
+    bool m_enabled = false;
+
+    // whether a body of this size should be handed over pinned
+    static bool wanted(size_t size) {
+        return g_min_size != 0 && size >= g_min_size;
+    }
+
+    // SO_ZEROCOPY on a TCP socket; false where unsupported (AF_UNIX, old kernels)
+    static bool enable(int fd) {
+        int one = 1;
+        return setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+    }
+
+    [[nodiscard]] bool in_flight() const {
+        return !m_pinned.empty();
+    }
+
+    // after a MSG_ZEROCOPY send that took n > 0 bytes
+    void sent(std::shared_ptr<void const> buffer, size_t n) {
+        m_pinned.push_back({m_next_id++, n, std::move(buffer)});
+        m_pinned_bytes += n;
+        g_sends.fetch_add(1, std::memory_order_relaxed);
+        g_bytes.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    // Drain the error queue, releasing the buffers of completed sends.
+    // Non-blocking; a socket with nothing in flight has nothing queued.
+    void reap(int fd) {
+        while (in_flight()) {
+            char control[CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+            struct msghdr msg{};
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+                return;
+            }
+            for (auto *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+                bool recverr = (cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)
+                            || (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR);
+                if (!recverr) {
+                    continue;
+                }
+                auto *err = reinterpret_cast<struct sock_extended_err const *>(CMSG_DATA(cm));
+                if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY || err->ee_errno != 0) {
+                    continue;
+                }
+                _complete(err->ee_info, err->ee_data, err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED);
+            }
+        }
+    }
+
+    // ids lo..hi inclusive, modulo 2^32
+    void _complete(uint32_t lo, uint32_t hi, bool copied) {
+        std::erase_if(m_pinned, [this, lo, hi] (_pin const &pin) {
+            if (pin.m_id - lo > hi - lo) {
+                return false;
+            }
+            m_pinned_bytes -= pin.m_bytes;
+            return true;
+        });
+        g_completions.fetch_add(hi - lo + 1, std::memory_order_relaxed);
+        if (copied) {
+            g_copied.fetch_add(hi - lo + 1, std::memory_order_relaxed);
+            if (++m_copied_in_row >= k_copied_limit) {
+                m_enabled = false;
+            }
+        }
+        else {
+            m_copied_in_row = 0;
+        }
+    }
+
+    static std::string dump_json() {
+        return std::format(R"({{"sends":{},"bytes":{},"completions":{},"copied":{},"fallbacks":{},)"
+                           R"("lingering":{},"lingering_bytes":{},"linger_timeouts":{}}})" "\n",
+                           g_sends.load(std::memory_order_relaxed), g_bytes.load(std::memory_order_relaxed),
+                           g_completions.load(std::memory_order_relaxed), g_copied.load(std::memory_order_relaxed),
+                           g_fallbacks.load(std::memory_order_relaxed), g_lingering.load(std::memory_order_relaxed),
+                           g_lingering_bytes.load(std::memory_order_relaxed),
+                           g_linger_timeouts.load(std::memory_order_relaxed));
+    }
+};
+
+#endif
@@ -0,0 +1,205 @@
+// Offline checks of async_resolver: "localhost" through /etc/hosts, the rest
+// against a stub lookup, so no DNS server is needed.
+
+#include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <string>
+#include <thread>
+
+#include "io_context.hpp"
+#include "async_resolver.hpp"
+
+#define EXPECT(cond) do { \
+    if (!(cond)) { \
+        std::println("失败: {}:{}: {}", __FILE__, __LINE__, #cond); \
+        std::exit(1); \
+    } \
+} while (0)
+
+static std::atomic<int> g_stub_calls{0};
+
+// svc.test is 127.0.0.2, slow.test answers after 100 ms, anything else is unknown
+static int stub_lookup(std::string const &name, std::string const &service, address_resolver &out) {
+    ++g_stub_calls;
+    if (name == "slow.test") {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    if (name == "svc.test" || name == "slow.test" || name.starts_with("n")) {
+        return out.try_resolve("127.0.0.2", service);
+    }
+    return EAI_NONAME;
+}
+
+static std::string first_address(async_resolver::result const &res) {
+    char text[INET6_ADDRSTRLEN] = "";
+    auto *ai = res->m_head;
+    if (ai->ai_family == AF_INET) {
+        inet_ntop(AF_INET, &reinterpret_cast<struct sockaddr_in *>(ai->ai_addr)->sin_addr, text, sizeof(text));
+    }
+    else {
+        inet_ntop(AF_INET6, &reinterpret_cast<struct sockaddr_in6 *>(ai->ai_addr)->sin6_addr, text, sizeof(text));
+    }
+    return text;
+}
+
+static void test_hosts_file() {
+    io_context ctx;
+    async_resolver resolver;
+    bool done = false;
+    resolver.async_resolve("localhost", "80", [&] (std::error_code ec, async_resolver::result res) {
+        EXPECT(!ec);
+        auto addr = first_address(res);
+        EXPECT(addr == "127.0.0.1" || addr == "::1");
+        done = true;
+        ctx.stop();
+    });
+    ctx.join();
+    EXPECT(done);
+}
+
+static void test_coalesce_and_cache() {
+    io_context ctx;
+    async_resolver resolver;
+    resolver.m_lookup = stub_lookup;
+    g_stub_calls = 0;
+    int answered = 0;
+    for (int i = 0; i < 50; i++) {
+        resolver.async_resolve("svc.test", "80", [&] (std::error_code ec, async_resolver::result res) {
+            EXPECT(!ec);
+            EXPECT(first_address(res) == "127.0.0.2");
+            if (++answered == 50) {
+                ctx.stop();
+            }
+        });
+    }
+    ctx.join();
+    EXPECT(answered == 50);
+    EXPECT(g_stub_calls == 1);
+
+    // a hit completes inline, without another lookup
+    bool hit = false;
+    resolver.async_resolve("svc.test", "80", [&] (std::error_code ec, async_resolver::result) {
+        EXPECT(!ec);
+        hit = true;
+    });
+    EXPECT(hit);
+    EXPECT(g_stub_calls == 1);
+}
+
+static void test_negative_cache_and_expiry() {
+    io_context ctx;
+    async_resolver resolver(std::chrono::milliseconds(50), std::chrono::milliseconds(50));
+    resolver.m_lookup = stub_lookup;
+    g_stub_calls = 0;
+    auto lookup = [&] (char const *name, bool expect_error) {
+        resolver.async_resolve(name, "80", [&, expect_error] (std::error_code ec, async_resolver::result) {
+            EXPECT(static_cast<bool>(ec) == expect_error);
+            ctx.stop();
+        });
+        ctx.join();
+    };
+    lookup("missing.test", true);
+    lookup("missing.test", true);
+    EXPECT(g_stub_calls == 1);
+    std::this_thread::sleep_for(std::chrono::milliseconds(60));
+    lookup("missing.test", true);
+    EXPECT(g_stub_calls == 2);
+}
+
+static void test_bounded() {
+    io_context ctx;
+    async_resolver resolver;
+    resolver.m_lookup = stub_lookup;
+    resolver.m_max_entries = 4;
+    for (int i = 0; i < 20; i++) {
+        resolver.async_resolve("n" + std::to_string(i), "80", [&] (std::error_code ec, async_resolver::result) {
+            EXPECT(!ec);
+            ctx.stop();
+        });
+        ctx.join();
+    }
+    EXPECT(resolver.m_cache.size() <= 4);
+    EXPECT(resolver.m_lru.size() == resolver.m_cache.size());
+}
+
+// a hit refreshes an entry, so the one left alone is evicted
+static void test_least_recently_used() {
+    io_context ctx;
+    async_resolver resolver;
+    resolver.m_lookup = stub_lookup;
+    resolver.m_max_entries = 2;
+    auto lookup = [&] (std::string const &name) {
+        resolver.async_resolve(name, "80", [&] (std::error_code ec, async_resolver::result) {
+            EXPECT(!ec);
+            ctx.stop();
+        });
+        ctx.join();
+    };
+    lookup("n1");
+    lookup("n2");
+    bool hit = false;
+    resolver.async_resolve("n1", "80", [&] (std::error_code, async_resolver::result) {
+        hit = true;
+    });
+    EXPECT(hit);
+    lookup("n3");
+    EXPECT(resolver.m_cache.contains("n1:80"));
+    EXPECT(!resolver.m_cache.contains("n2:80"));
+    EXPECT(resolver.m_cache.contains("n3:80"));
+}
+
+// a slow name takes one helper; the next lookup gets another
+static void test_slow_lookup_does_not_block() {
+    io_context ctx;
+    async_resolver resolver;
+    resolver.m_lookup = stub_lookup;
+    std::string order;
+    auto record = [&] (char c) {
+        return [&, c] (std::error_code ec, async_resolver::result) {
+            EXPECT(!ec);
+            order += c;
+            if (order.size() == 2) {
+                ctx.stop();
+            }
+        };
+    };
+    resolver.async_resolve("slow.test", "80", record('s'));
+    resolver.async_resolve("svc.test", "80", record('f'));
+    ctx.join();
+    EXPECT(order == "fs");
+    EXPECT(resolver.m_workers.size() == 2);
+}
+
+static void test_destroy_while_pending() {
+    io_context ctx;
+    bool canceled = false;
+    {
+        async_resolver resolver;
+        resolver.m_lookup = stub_lookup;
+        resolver.async_resolve("slow.test", "80", [&] (std::error_code ec, async_resolver::result res) {
+            EXPECT(ec == std::errc::operation_canceled);
+            EXPECT(!res);
+            canceled = true;
+        });
+        // give the helper time to pick the job up before we go away
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    // the cancellation runs next turn; the helper's late result is dropped
+    ctx.defer([&] { ctx.stop(); });
+    ctx.join();
+    EXPECT(canceled);
+}
+
+int main() {
+    test_hosts_file();
+    test_coalesce_and_cache();
+    test_negative_cache_and_expiry();
+    test_bounded();
+    test_least_recently_used();
+    test_slow_lookup_does_not_block();
+    test_destroy_while_pending();
+    std::println("async_resolver: 全部通过");
+    return 0;
+}
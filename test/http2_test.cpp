@@ -0,0 +1,485 @@
+// Offline checks of the HTTP/2 input side: HPACK against the RFC 7541
+// Appendix C examples, Huffman edge cases, and frames fed straight into an
+// http2_connection whose output is read back from m_out, no socket needed.
+
+#include <cstdlib>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "io_context.hpp"
+#include "http2.hpp"
+
+#define EXPECT(cond) do { \
+    if (!(cond)) { \
+        std::println("失败: {}:{}: {}", __FILE__, __LINE__, #cond); \
+        std::exit(1); \
+    } \
+} while (0)
+
+using field_list = std::vector<std::pair<std::string, std::string>>;
+
+// "8286 84be" -> bytes, spaces ignored
+static std::string unhex(std::string_view hex) {
+    std::string out;
+    int high = -1;
+    for (char c: hex) {
+        int v = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+        if (v < 0) {
+            continue;
+        }
+        if (high < 0) {
+            high = v;
+        }
+        else {
+            out.push_back(static_cast<char>(high << 4 | v));
+            high = -1;
+        }
+    }
+    return out;
+}
+
+static bool decode(hpack_decoder &decoder, std::string const &block, field_list &fields) {
+    fields.clear();
+    return decoder.decode(bytes_const_view{block.data(), block.size()}, [&] (std::string_view name, std::string_view value) {
+        fields.emplace_back(name, value);
+    });
+}
+
+static std::string encode(hpack_encoder &encoder, field_list const &fields) {
+    bytes_buffer out;
+    encoder.begin_block(out);
+    for (auto const &[name, value]: fields) {
+        encoder.encode(out, name, value);
+    }
+    return std::string(out.data(), out.size());
+}
+
+// RFC 7541 C.1
+static void test_integers() {
+    auto round_trip = [] (int prefix, uint64_t value, std::string_view hex) {
+        bytes_buffer out;
+        hpack_encode_int(out, 0, prefix, value);
+        EXPECT(std::string(out.data(), out.size()) == unhex(hex));
+        auto const *p = reinterpret_cast<uint8_t const *>(out.data());
+        uint64_t decoded = 0;
+        EXPECT(hpack_decode_int(p, p + out.size(), prefix, decoded));
+        EXPECT(decoded == value);
+    };
+    round_trip(5, 10, "0a");
+    round_trip(5, 1337, "1f9a0a");
+    round_trip(8, 42, "2a");
+
+    // cut short, and continuing past 64 bits
+    auto bytes = unhex("1f9a");
+    auto const *p = reinterpret_cast<uint8_t const *>(bytes.data());
+    uint64_t value;
+    EXPECT(!hpack_decode_int(p, p + bytes.size(), 5, value));
+    bytes = unhex("1fffffffffffffffffffff01");
+    p = reinterpret_cast<uint8_t const *>(bytes.data());
+    EXPECT(!hpack_decode_int(p, p + bytes.size(), 5, value));
+}
+
+// RFC 7541 C.2: one representation of each kind
+static void test_literals() {
+    hpack_decoder decoder;
+    field_list fields;
+    EXPECT(decode(decoder, unhex("400a 6375 7374 6f6d 2d6b 6579 0d63 7573 746f 6d2d 6865 6164 6572"), fields));
+    EXPECT((fields == field_list{{"custom-key", "custom-header"}}));
+    EXPECT(decoder.m_table.count() == 1 && decoder.m_table.m_size == 55);
+
+    hpack_decoder without_indexing;
+    EXPECT(decode(without_indexing, unhex("040c 2f73 616d 706c 652f 7061 7468"), fields));
+    EXPECT((fields == field_list{{":path", "/sample/path"}}));
+    EXPECT(without_indexing.m_table.count() == 0);
+
+    hpack_decoder never_indexed;
+    EXPECT(decode(never_indexed, unhex("1008 7061 7373 776f 7264 0673 6563 7265 74"), fields));
+    EXPECT((fields == field_list{{"password", "secret"}}));
+    EXPECT(never_indexed.m_table.count() == 0);
+
+    hpack_decoder indexed;
+    EXPECT(decode(indexed, unhex("82"), fields));
+    EXPECT((fields == field_list{{":method", "GET"}}));
+    EXPECT(indexed.m_table.count() == 0);
+
+    // index 0 and an index past the dynamic table are errors
+    EXPECT(!decode(indexed, unhex("80"), fields));
+    EXPECT(!decode(indexed, unhex("be"), fields));
+}
+
+static field_list const k_requests[] = {
+    {{":method", "GET"}, {":scheme", "http"}, {":path", "/"}, {":authority", "www.example.com"}},
+    {{":method", "GET"}, {":scheme", "http"}, {":path", "/"}, {":authority", "www.example.com"},
+     {"cache-control", "no-cache"}},
+    {{":method", "GET"}, {":scheme", "https"}, {":path", "/index.html"}, {":authority", "www.example.com"},
+     {"custom-key", "custom-value"}},
+};
+
+// RFC 7541 C.3 (plain strings) and C.4 (Huffman); our encoder picks Huffman
+// whenever it is shorter, which gives exactly the C.4 bytes
+static void test_requests() {
+    std::string_view plain[] = {
+        "8286 8441 0f77 7777 2e65 7861 6d70 6c65 2e63 6f6d",
+        "8286 84be 5808 6e6f 2d63 6163 6865",
+        "8287 85bf 400a 6375 7374 6f6d 2d6b 6579 0c63 7573 746f 6d2d 7661 6c75 65",
+    };
+    std::string_view huffman[] = {
+        "8286 8441 8cf1 e3c2 e5f2 3a6b a0ab 90f4 ff",
+        "8286 84be 5886 a8eb 1064 9cbf",
+        "8287 85bf 4088 25a8 49e9 5ba9 7d7f 8925 a849 e95b b8e8 b4bf",
+    };
+    size_t const table_sizes[] = {57, 110, 164};
+
+    hpack_decoder plain_decoder;
+    hpack_decoder huffman_decoder;
+    hpack_encoder encoder;
+    field_list fields;
+    for (int i = 0; i < 3; i++) {
+        EXPECT(decode(plain_decoder, unhex(plain[i]), fields));
+        EXPECT(fields == k_requests[i]);
+        EXPECT(plain_decoder.m_table.m_size == table_sizes[i]);
+
+        EXPECT(decode(huffman_decoder, unhex(huffman[i]), fields));
+        EXPECT(fields == k_requests[i]);
+        EXPECT(huffman_decoder.m_table.m_size == table_sizes[i]);
+
+        EXPECT(encode(encoder, k_requests[i]) == unhex(huffman[i]));
+        EXPECT(encoder.m_table.m_size == table_sizes[i]);
+    }
+}
+
+// RFC 7541 C.6: responses with Huffman in a 256 byte table, which evicts
+static void test_responses_with_eviction() {
+    field_list const responses[] = {
+        {{":status", "302"}, {"cache-control", "private"}, {"date", "Mon, 21 Oct 2013 20:13:21 GMT"},
+         {"location", "https://www.example.com"}},
+        {{":status", "307"}, {"cache-control", "private"}, {"date", "Mon, 21 Oct 2013 20:13:21 GMT"},
+         {"location", "https://www.example.com"}},
+        {{":status", "200"}, {"cache-control", "private"}, {"date", "Mon, 21 Oct 2013 20:13:22 GMT"},
+         {"location", "https://www.example.com"}, {"content-encoding", "gzip"},
+         {"set-cookie", "foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1"}},
+    };
+    std::string_view blocks[] = {
+        "4882 6402 5885 aec3 771a 4b61 96d0 7abe 9410 54d4 44a8 2005 9504 0b81 66e0 82a6"
+        "2d1b ff6e 919d 29ad 1718 63c7 8f0b 97c8 e9ae 82ae 43d3",
+        "4883 640e ffc1 c0bf",
+        "88c1 6196 d07a be94 1054 d444 a820 0595 040b 8166 e084 a62d 1bff c05a 839b d9ab"
+        "77ad 94e7 821d d7f2 e6c7 b335 dfdf cd5b 3960 d5af 2708 7f36 72c1 ab27 0fb5 291f"
+        "9587 3160 65c0 03ed 4ee5 b106 3d50 07",
+    };
+    size_t const table_sizes[] = {222, 222, 215};
+    size_t const table_counts[] = {4, 4, 3};
+
+    hpack_decoder decoder;
+    decoder.m_table.set_max_size(256);
+    // the example Huffman-codes "307" at no gain, where we send it plain, so
+    // the encoder is checked by what a decoder makes of its output
+    hpack_encoder encoder;
+    encoder.m_table.set_max_size(256);
+    hpack_decoder mirror;
+    mirror.m_table.set_max_size(256);
+    field_list fields;
+    for (int i = 0; i < 3; i++) {
+        EXPECT(decode(decoder, unhex(blocks[i]), fields));
+        EXPECT(fields == responses[i]);
+        EXPECT(decoder.m_table.m_size == table_sizes[i]);
+        EXPECT(decoder.m_table.count() == table_counts[i]);
+
+        auto block = encode(encoder, responses[i]);
+        EXPECT(block.size() <= unhex(blocks[i]).size());
+        EXPECT(decode(mirror, block, fields));
+        EXPECT(fields == responses[i]);
+        EXPECT(encoder.m_table.m_size == table_sizes[i]);
+    }
+    // and refers to the same entries: content-encoding is 63, date 64
+    EXPECT(encode(encoder, {{"content-encoding", "gzip"}, {"date", "Mon, 21 Oct 2013 20:13:22 GMT"}}) == unhex("bfc0"));
+    // the newest entry first: set-cookie, content-encoding, date
+    EXPECT(decoder.m_table.at(0).first == "set-cookie");
+    EXPECT(decoder.m_table.at(2).second == "Mon, 21 Oct 2013 20:13:22 GMT");
+}
+
+static void test_huffman() {
+    std::string all;
+    for (int c = 0; c < 256; c++) {
+        all.push_back(static_cast<char>(c));
+    }
+    for (std::string_view text: {std::string_view(all), std::string_view("www.example.com"), std::string_view("")}) {
+        bytes_buffer encoded;
+        hpack_huffman_encode(text, encoded);
+        EXPECT(encoded.size() == hpack_huffman_size(text));
+        std::string decoded;
+        EXPECT(hpack_huffman_decode(std::string_view(encoded.data(), encoded.size()), decoded));
+        EXPECT(decoded == text);
+    }
+
+    std::string out;
+    // "a" is 00011, padded with ones
+    EXPECT(hpack_huffman_decode(unhex("1f"), out) && out == "a");
+    // EOS spelled out is an error even though it is all ones
+    EXPECT(!hpack_huffman_decode(unhex("ffff fffc"), out));
+    EXPECT(!hpack_huffman_decode(unhex("1fff ffff ff"), out));
+    // padding longer than 7 bits
+    EXPECT(!hpack_huffman_decode(unhex("1fff"), out));
+    // padding that is not a prefix of EOS
+    EXPECT(!hpack_huffman_decode(unhex("18"), out));
+
+    // and the same through the decoder: a Huffman literal with a bad tail
+    hpack_decoder decoder;
+    field_list fields;
+    EXPECT(!decode(decoder, unhex("4082 1fff 0161"), fields));
+    EXPECT(!decode(decoder, unhex("0001 6184 ffff fffc"), fields));
+}
+
+// RFC 7541 4.2 and 6.3: size updates come first in a block and stay within
+// what we advertised
+static void test_table_size_update() {
+    hpack_decoder decoder;
+    field_list fields;
+    EXPECT(decode(decoder, unhex("400a 6375 7374 6f6d 2d6b 6579 0d63 7573 746f 6d2d 6865 6164 6572"), fields));
+    EXPECT(decoder.m_table.count() == 1);
+
+    // two updates before the first field: shrink to 0 (evicting), then 4096
+    EXPECT(decode(decoder, unhex("20 3fe1 1f 82"), fields));
+    EXPECT((fields == field_list{{":method", "GET"}}));
+    EXPECT(decoder.m_table.count() == 0 && decoder.m_table.m_max_size == 4096);
+
+    // after a field it is a compression error
+    EXPECT(!decode(decoder, unhex("82 3fe1 1f"), fields));
+    EXPECT(!decode(decoder, unhex("8220"), fields));
+    // past SETTINGS_HEADER_TABLE_SIZE
+    EXPECT(!decode(decoder, unhex("3fe2 1f"), fields));
+    // an update with no fields at all is fine
+    EXPECT(decode(decoder, unhex("3f e1 0f"), fields) && fields.empty());
+    EXPECT(decoder.m_table.m_max_size == 2048);
+
+    // the encoder announces a changed peer size once, first thing in the next block
+    hpack_encoder encoder;
+    encoder.set_max_table_size(256);
+    EXPECT(encode(encoder, {{":method", "GET"}}) == unhex("3fe1 0182"));
+    EXPECT(encode(encoder, {{":method", "GET"}}) == unhex("82"));
+}
+
+// answers every request with its path
+struct echo_handler {
+    template <class Request, class Response, class Done>
+    static void handle(Request &req, Response &res, std::pmr::memory_resource *, bool, bool, Done &&done) {
+        auto url = req.url();
+        res.begin_header(http_status::ok);
+        res.writer_header("content-length", std::to_string(url.size()));
+        res.end_header();
+        res.write_body(url);
+        done();
+    }
+};
+
+using test_connection = http2_connection<echo_handler>;
+
+struct frame {
+    http2_frame_type m_type;
+    uint8_t m_flags;
+    uint32_t m_stream;
+    std::string m_payload;
+};
+
+static std::string make_frame(http2_frame_type type, uint8_t flags, uint32_t stream, std::string_view payload) {
+    std::string out;
+    size_t length = payload.size();
+    out.push_back(static_cast<char>(length >> 16));
+    out.push_back(static_cast<char>(length >> 8));
+    out.push_back(static_cast<char>(length));
+    out.push_back(static_cast<char>(type));
+    out.push_back(static_cast<char>(flags));
+    for (int shift = 24; shift >= 0; shift -= 8) {
+        out.push_back(static_cast<char>(stream >> shift));
+    }
+    out.append(payload);
+    return out;
+}
+
+static uint32_t get32(std::string_view s, size_t pos = 0) {
+    auto const *p = reinterpret_cast<uint8_t const *>(s.data() + pos);
+    return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | p[3];
+}
+
+// a connection past the client preface, with our SETTINGS already taken out
+static test_connection::pointer connect() {
+    auto conn = test_connection::make();
+    conn->m_preface_matched = k_http2_preface.size();
+    conn->_send_settings();
+    conn->m_out.clear();
+    return conn;
+}
+
+static void feed(test_connection &conn, std::string bytes) {
+    conn._on_bytes(bytes_view{bytes.data(), bytes.size()});
+}
+
+static std::vector<frame> take_frames(test_connection &conn) {
+    std::vector<frame> frames;
+    std::string_view out(conn.m_out.data(), conn.m_out.size());
+    while (out.size() >= 9) {
+        size_t length = (size_t(uint8_t(out[0])) << 16) | (size_t(uint8_t(out[1])) << 8) | uint8_t(out[2]);
+        EXPECT(out.size() >= 9 + length);
+        frames.push_back({static_cast<http2_frame_type>(out[3]), static_cast<uint8_t>(out[4]),
+                          get32(out, 5) & 0x7fffffff, std::string(out.substr(9, length))});
+        out.remove_prefix(9 + length);
+    }
+    EXPECT(out.empty());
+    conn.m_out.clear();
+    return frames;
+}
+
+static http2_error goaway_error(std::vector<frame> const &frames) {
+    EXPECT(!frames.empty() && frames.back().m_type == http2_frame_type::goaway);
+    EXPECT(frames.back().m_payload.size() == 8);
+    return static_cast<http2_error>(get32(frames.back().m_payload, 4));
+}
+
+// literals without indexing, so the decoder's table holds only what a test puts there
+static std::string request_block(hpack_encoder &encoder, std::string_view path) {
+    bytes_buffer out;
+    encoder.encode(out, ":method", "GET", false);
+    encoder.encode(out, ":scheme", "http", false);
+    encoder.encode(out, ":path", path, false);
+    encoder.encode(out, ":authority", "a", false);
+    return std::string(out.data(), out.size());
+}
+
+static void test_request_response() {
+    auto conn = connect();
+    hpack_encoder encoder;
+    hpack_decoder decoder;
+    feed(*conn, make_frame(http2_frame_type::headers, k_http2_end_headers | k_http2_end_stream, 1,
+                           request_block(encoder, "/hello")));
+    auto frames = take_frames(*conn);
+    EXPECT(frames.size() == 2);
+    EXPECT(frames[0].m_type == http2_frame_type::headers && frames[0].m_stream == 1);
+    field_list fields;
+    EXPECT(decode(decoder, frames[0].m_payload, fields));
+    EXPECT(fields.size() == 2 && fields[0].first == ":status" && fields[0].second == "200");
+    EXPECT(frames[1].m_type == http2_frame_type::data && (frames[1].m_flags & k_http2_end_stream));
+    EXPECT(frames[1].m_payload == "/hello");
+    EXPECT(conn->m_streams.empty());
+
+    // a header block split over CONTINUATION frames
+    auto block = request_block(encoder, "/split");
+    feed(*conn, make_frame(http2_frame_type::headers, k_http2_end_stream, 3, std::string_view(block).substr(0, 3))
+              + make_frame(http2_frame_type::continuation, 0, 3, std::string_view(block).substr(3, 2))
+              + make_frame(http2_frame_type::continuation, k_http2_end_headers, 3, std::string_view(block).substr(5)));
+    frames = take_frames(*conn);
+    EXPECT(frames.size() == 2 && frames[1].m_payload == "/split");
+
+    // PING comes back with ACK set
+    feed(*conn, make_frame(http2_frame_type::ping, 0, 0, "12345678"));
+    frames = take_frames(*conn);
+    EXPECT(frames.size() == 1 && frames[0].m_type == http2_frame_type::ping);
+    EXPECT(frames[0].m_flags == k_http2_ack && frames[0].m_payload == "12345678");
+}
+
+// a list past SETTINGS_MAX_HEADER_LIST_SIZE resets the stream only; the block
+// is still decoded, so the HPACK state stays usable for the next stream
+static void test_oversized_header_list() {
+    auto conn = connect();
+    bytes_buffer block;
+    // literal with indexing, plain strings: x-big = 4000 bytes, then referenced again
+    hpack_encode_int(block, 0x40, 6, 0);
+    hpack_encode_int(block, 0x00, 7, 5);
+    block.append(std::string_view("x-big"));
+    hpack_encode_int(block, 0x00, 7, 4000);
+    block.append(std::string(4000, 'v'));
+    for (int i = 0; i < 16; i++) {
+        hpack_encode_int(block, 0x80, 7, 62);
+    }
+    hpack_encoder encoder;
+    auto tail = request_block(encoder, "/big");
+    block.append(tail);
+    feed(*conn, make_frame(http2_frame_type::headers, k_http2_end_headers | k_http2_end_stream, 1,
+                           std::string_view(block.data(), block.size())));
+    auto frames = take_frames(*conn);
+    EXPECT(frames.size() == 1 && frames[0].m_type == http2_frame_type::rst_stream && frames[0].m_stream == 1);
+    EXPECT(static_cast<http2_error>(get32(frames[0].m_payload)) == http2_error::protocol_error);
+    EXPECT(conn->m_streams.empty() && !conn->m_closing);
+
+    // index 62 is still x-big: within the limit this time
+    bytes_buffer next;
+    hpack_encode_int(next, 0x80, 7, 62);
+    next.append(request_block(encoder, "/after"));
+    feed(*conn, make_frame(http2_frame_type::headers, k_http2_end_headers | k_http2_end_stream, 3,
+                           std::string_view(next.data(), next.size())));
+    frames = take_frames(*conn);
+    EXPECT(frames.size() == 2 && frames[1].m_payload == "/after");
+}
+
+static void test_connection_errors() {
+    hpack_encoder encoder;
+    auto expect_goaway = [&] (std::string bytes, http2_error error) {
+        auto conn = connect();
+        feed(*conn, std::move(bytes));
+        EXPECT(goaway_error(take_frames(*conn)) == error);
+        EXPECT(conn->m_broken && conn->_done());
+    };
+    auto headers = [] (uint32_t stream, std::string_view block) {
+        return make_frame(http2_frame_type::headers, k_http2_end_headers | k_http2_end_stream, stream, block);
+    };
+
+    // HPACK errors break the shared table: the whole connection goes
+    expect_goaway(headers(1, unhex("82 86 84 4182 1fff")), http2_error::compression_error);
+    expect_goaway(headers(1, unhex("82 3fe1 1f 86 84")), http2_error::compression_error);
+    expect_goaway(headers(1, unhex("3fe2 1f 82 86 84")), http2_error::compression_error);
+
+    // framing
+    expect_goaway(make_frame(http2_frame_type::data, 0, 1, std::string(16385, 'x')), http2_error::frame_size_error);
+    expect_goaway(make_frame(http2_frame_type::ping, 0, 0, "1234567"), http2_error::frame_size_error);
+    expect_goaway(make_frame(http2_frame_type::settings, 0, 0, "12345"), http2_error::frame_size_error);
+    expect_goaway(make_frame(http2_frame_type::settings, 0, 1, ""), http2_error::protocol_error);
+    expect_goaway(headers(2, request_block(encoder, "/even")), http2_error::protocol_error);
+    expect_goaway(make_frame(http2_frame_type::window_update, 0, 0, unhex("00000000")), http2_error::protocol_error);
+    expect_goaway(make_frame(http2_frame_type::push_promise, k_http2_end_headers, 1, unhex("00000002")),
+                  http2_error::protocol_error);
+    // anything between HEADERS and its CONTINUATION
+    expect_goaway(make_frame(http2_frame_type::headers, 0, 1, unhex("82"))
+                + make_frame(http2_frame_type::ping, 0, 0, "12345678"), http2_error::protocol_error);
+    expect_goaway(make_frame(http2_frame_type::headers, 0, 1, unhex("82"))
+                + make_frame(http2_frame_type::continuation, k_http2_end_headers, 3, unhex("86")),
+                  http2_error::protocol_error);
+
+    // bytes after the GOAWAY are not looked at
+    auto conn = connect();
+    feed(*conn, make_frame(http2_frame_type::ping, 0, 0, "1234567")
+              + make_frame(http2_frame_type::ping, 0, 0, "12345678"));
+    auto frames = take_frames(*conn);
+    EXPECT(frames.size() == 1);
+}
+
+// the client's GOAWAY lets open streams finish before the connection is done
+static void test_peer_goaway() {
+    auto conn = connect();
+    hpack_encoder encoder;
+    feed(*conn, make_frame(http2_frame_type::headers, k_http2_end_headers, 1, request_block(encoder, "/upload")));
+    feed(*conn, make_frame(http2_frame_type::goaway, 0, 0, unhex("00000000 00000000")));
+    EXPECT(conn->m_closing && !conn->_done());
+    feed(*conn, make_frame(http2_frame_type::data, k_http2_end_stream, 1, "body"));
+    auto frames = take_frames(*conn);
+    EXPECT(frames.size() == 2 && frames[1].m_payload == "/upload");
+    EXPECT(conn->_done());
+}
+
+int main() {
+    // the connections ask for the limits and whether we are shedding
+    io_context ctx;
+    admission_control admission;
+    test_integers();
+    test_literals();
+    test_requests();
+    test_responses_with_eviction();
+    test_huffman();
+    test_table_size_update();
+    test_request_response();
+    test_oversized_header_list();
+    test_connection_errors();
+    test_peer_goaway();
+    std::println("http2: 全部通过");
+    return 0;
+}
@@ -0,0 +1,222 @@
+// Checks of http_compression: Accept-Encoding negotiation, encode/decode
+// round trips through the reference decoders, and the variant cache limits.
+
+#include <zlib.h>
+#include <cstdlib>
+#include <string>
+
+#ifdef CO_HTTP_BROTLI_DECODER
+#include <brotli/decode.h>
+#endif
+
+#include "io_context.hpp"
+#include "http_compression.hpp"
+
+#define EXPECT(cond) do { \
+    if (!(cond)) { \
+        std::println("失败: {}:{}: {}", __FILE__, __LINE__, #cond); \
+        std::exit(1); \
+    } \
+} while (0)
+
+// zlib and gzip both, told apart by their header
+static std::string inflate_all(std::string const &in) {
+    z_stream z{};
+    EXPECT(inflateInit2(&z, 15 + 32) == Z_OK);
+    z.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(in.data()));
+    z.avail_in = static_cast<uInt>(in.size());
+    std::string out;
+    int ret;
+    do {
+        char buf[16384];
+        z.next_out = reinterpret_cast<Bytef *>(buf);
+        z.avail_out = sizeof(buf);
+        ret = inflate(&z, Z_NO_FLUSH);
+        EXPECT(ret == Z_OK || ret == Z_STREAM_END || ret == Z_BUF_ERROR);
+        out.append(buf, sizeof(buf) - z.avail_out);
+    } while (ret == Z_OK && z.avail_out == 0);
+    inflateEnd(&z);
+    return out;
+}
+
+#ifdef CO_HTTP_BROTLI_DECODER
+static std::string brotli_decode_all(std::string const &in) {
+    std::string out(1024 * 1024, '\0');
+    size_t size = out.size();
+    EXPECT(BrotliDecoderDecompress(in.size(), reinterpret_cast<uint8_t const *>(in.data()), &size,
+                                   reinterpret_cast<uint8_t *>(out.data())) == BROTLI_DECODER_RESULT_SUCCESS);
+    out.resize(size);
+    return out;
+}
+#endif
+
+static std::string decode(content_coding coding, std::string const &in) {
+#ifdef CO_HTTP_BROTLI_DECODER
+    if (coding == content_coding::br) {
+        return brotli_decode_all(in);
+    }
+#endif
+    (void)coding;
+    return inflate_all(in);
+}
+
+static bool decodable(content_coding coding) {
+    if (coding == content_coding::gzip || coding == content_coding::deflate) {
+        return true;
+    }
+#ifdef CO_HTTP_BROTLI_DECODER
+    if (coding == content_coding::br) {
+        return content_coding_available(coding);
+    }
+#endif
+    return false;
+}
+
+// text that compresses, and a tail of noise that does not
+static std::string sample_body(size_t size) {
+    std::string body;
+    body.reserve(size);
+    uint32_t seed = 12345;
+    while (body.size() < size) {
+        if (body.size() < size / 2) {
+            body += "<li class=\"item\">entry " + std::to_string(body.size() % 997) + "</li>\n";
+        }
+        else {
+            seed = seed * 1103515245 + 12345;
+            body += static_cast<char>(seed >> 16);
+        }
+    }
+    body.resize(size);
+    return body;
+}
+
+static content_coding best(std::string_view accept) {
+    return negotiate_content_coding(accept);
+}
+
+static void test_negotiate() {
+    constexpr bool br = content_coding_available(content_coding::br);
+    constexpr bool zstd = content_coding_available(content_coding::zstd);
+    auto strongest = br ? content_coding::br : zstd ? content_coding::zstd : content_coding::gzip;
+
+    EXPECT(best("") == content_coding::identity);
+    EXPECT(best("identity") == content_coding::identity);
+    EXPECT(best("gzip") == content_coding::gzip);
+    EXPECT(best("deflate") == content_coding::deflate);
+    EXPECT(best("GZip") == content_coding::gzip);
+    EXPECT(best("compress, x-unknown") == content_coding::identity);
+
+    // a tie goes to our order, a higher q wins regardless
+    EXPECT(best("deflate, gzip") == content_coding::gzip);
+    EXPECT(best("gzip, deflate, br, zstd") == strongest);
+    EXPECT(best("gzip;q=0.5, deflate;q=0.8") == content_coding::deflate);
+    EXPECT(best("gzip;q=0.501, deflate;q=0.5") == content_coding::gzip);
+    EXPECT(best("gzip; q=1.000 , deflate ;q=0.999") == content_coding::gzip);
+    EXPECT(best("deflate;Q=0.9, gzip;q=0.1") == content_coding::deflate);
+
+    // q=0 rules a coding out, also with the trailing zeros
+    EXPECT(best("gzip;q=0") == content_coding::identity);
+    EXPECT(best("gzip;q=0.000, deflate") == content_coding::deflate);
+    EXPECT(best("gzip;q=0, deflate;q=0") == content_coding::identity);
+
+    // "*" covers whatever is not listed, but not what is
+    EXPECT(best("*") == strongest);
+    EXPECT(best("*;q=0") == content_coding::identity);
+    EXPECT(best("*;q=0, gzip") == content_coding::gzip);
+    EXPECT(best("gzip;q=0, *") == (br || zstd ? strongest : content_coding::deflate));
+    EXPECT(best("gzip;q=0, deflate;q=0, br;q=0, zstd;q=0, *") == content_coding::identity);
+    EXPECT(best("*;q=0.1, deflate;q=0.2") == content_coding::deflate);
+    if constexpr (!br) {
+        // a coding we cannot produce is never picked, whatever its q
+        EXPECT(best("br, gzip;q=0.1") == content_coding::gzip);
+    }
+}
+
+static void test_round_trip() {
+    content_coding codings[] = {content_coding::gzip, content_coding::deflate, content_coding::br};
+    for (auto coding: codings) {
+        if (!decodable(coding)) {
+            continue;
+        }
+        // empty, less than a slice, and across several 64 KiB slices
+        for (size_t size: {size_t(0), size_t(1), size_t(1000), size_t(200 * 1024 + 17)}) {
+            auto body = sample_body(size);
+            for (int level: {1, coding == content_coding::br ? 11 : 9}) {
+                auto out = content_encoder::encode(coding, level, bytes_const_view{body.data(), body.size()});
+                EXPECT(decode(coding, out) == body);
+            }
+        }
+    }
+}
+
+// each flush leaves what came so far decodable, as a chunked response needs
+static void test_streaming_flush() {
+    auto body = sample_body(100 * 1024);
+    content_encoder encoder(content_coding::gzip, 4);
+    std::string out;
+    size_t pos = 0;
+    for (size_t piece: {size_t(10), size_t(4000), size_t(30000)}) {
+        encoder.write(bytes_const_view{body.data() + pos, piece}, out, content_encoder::mode::flush);
+        pos += piece;
+        EXPECT(inflate_all(out) == body.substr(0, pos));
+    }
+    encoder.write(bytes_const_view{body.data() + pos, body.size() - pos}, out, content_encoder::mode::finish);
+    EXPECT(inflate_all(out) == body);
+}
+
+// the background pool encodes and hands the result back to the loop
+static void test_background_pool() {
+    io_context ctx;
+    auto body = sample_body(300 * 1024);
+    std::string result;
+    compression_pool::background().submit(content_coding::gzip, 9, bytes_const_view{body.data(), body.size()},
+                                          [&] (std::string out) {
+        result = std::move(out);
+        ctx.stop();
+    });
+    ctx.join();
+    EXPECT(!result.empty());
+    EXPECT(inflate_all(result) == body);
+}
+
+static void test_variant_cache() {
+    compressed_variant_cache cache;
+    cache.m_capacity = 80;
+    cache.m_max_building = 2;
+
+    auto k1 = compressed_variant_cache::key("/a", "\"1\"", content_coding::gzip);
+    auto k2 = compressed_variant_cache::key("/b", "\"1\"", content_coding::gzip);
+    auto k3 = compressed_variant_cache::key("/c", "\"1\"", content_coding::gzip);
+    EXPECT(cache.begin_build(k1));
+    EXPECT(!cache.begin_build(k1));
+    EXPECT(cache.begin_build(k2));
+    // too many builds in flight: the third has to wait its turn
+    EXPECT(!cache.begin_build(k3));
+    cache.end_build(k1, std::string(20, 'x'));
+    EXPECT(cache.find(k1) && cache.find(k1)->size() == 20);
+    EXPECT(!cache.begin_build(k1));
+    EXPECT(cache.begin_build(k3));
+
+    // past m_capacity the least recently used entry goes
+    cache.end_build(k2, std::string(20, 'y'));
+    EXPECT(cache.find(k1));
+    cache.end_build(k3, std::string(20, 'z'));
+    EXPECT(cache.m_bytes <= cache.m_capacity);
+    EXPECT(cache.find(k1));
+    EXPECT(!cache.find(k2));
+    EXPECT(cache.find(k3));
+
+    // a variant larger than the whole cache is not kept
+    cache.insert(compressed_variant_cache::key("/big", "\"1\"", content_coding::gzip), std::string(200, 'b'));
+    EXPECT(cache.find(k1) && cache.find(k3));
+}
+
+int main() {
+    test_negotiate();
+    test_round_trip();
+    test_streaming_flush();
+    test_background_pool();
+    test_variant_cache();
+    std::println("http_compression: 全部通过");
+    return 0;
+}
@@ -0,0 +1,279 @@
+// Loopback checks of TLS termination: a self-signed certificate made here,
+// an http_acceptor on an ephemeral port, and blocking OpenSSL clients on
+// another thread that verify it, pick protocols by ALPN and resume.
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include <openssl/x509v3.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <string_view>
+#include <thread>
+
+#include "io_context.hpp"
+#include "http_server.hpp"
+
+#define EXPECT(cond) do { \
+    if (!(cond)) { \
+        std::println("失败: {}:{}: {}", __FILE__, __LINE__, #cond); \
+        std::exit(1); \
+    } \
+} while (0)
+
+// P-256 key and a certificate for "localhost" signed by itself, as PEM files
+static void make_self_signed(std::string const &cert_file, std::string const &key_file) {
+    EVP_PKEY *key = EVP_EC_gen("P-256");
+    EXPECT(key != nullptr);
+    X509 *cert = X509_new();
+    X509_set_version(cert, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+    X509_gmtime_adj(X509_getm_notBefore(cert), -60);
+    X509_gmtime_adj(X509_getm_notAfter(cert), 24 * 3600);
+    X509_set_pubkey(cert, key);
+    X509_NAME *name = X509_get_subject_name(cert);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, reinterpret_cast<unsigned char const *>("localhost"),
+                               -1, -1, 0);
+    X509_set_issuer_name(cert, name);
+    X509_EXTENSION *san = X509V3_EXT_conf_nid(nullptr, nullptr, NID_subject_alt_name, "DNS:localhost");
+    X509_add_ext(cert, san, -1);
+    X509_EXTENSION_free(san);
+    EXPECT(X509_sign(cert, key, EVP_sha256()) > 0);
+
+    FILE *f = std::fopen(cert_file.c_str(), "w");
+    EXPECT(f && PEM_write_X509(f, cert) == 1);
+    std::fclose(f);
+    f = std::fopen(key_file.c_str(), "w");
+    EXPECT(f && PEM_write_PrivateKey(f, key, nullptr, nullptr, 0, nullptr, nullptr) == 1);
+    std::fclose(f);
+    X509_free(cert);
+    EVP_PKEY_free(key);
+}
+
+static int connect_to(int port) {
+    struct sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(static_cast<uint16_t>(port));
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    EXPECT(fd >= 0);
+    EXPECT(connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) == 0);
+    return fd;
+}
+
+// one blocking client connection; the handshake result is in m_ok
+struct tls_client {
+    int m_fd = -1;
+    SSL *m_ssl = nullptr;
+    bool m_ok = false;
+
+    tls_client(SSL_CTX *ctx, int port, std::string_view alpn = {}, SSL_SESSION *session = nullptr) {
+        m_fd = connect_to(port);
+        m_ssl = SSL_new(ctx);
+        SSL_set_fd(m_ssl, m_fd);
+        SSL_set_tlsext_host_name(m_ssl, "localhost");
+        SSL_set1_host(m_ssl, "localhost");
+        if (!alpn.empty()) {
+            SSL_set_alpn_protos(m_ssl, reinterpret_cast<unsigned char const *>(alpn.data()),
+                                static_cast<unsigned int>(alpn.size()));
+        }
+        if (session) {
+            SSL_set_session(m_ssl, session);
+        }
+        m_ok = SSL_connect(m_ssl) == 1;
+    }
+
+    tls_client(tls_client &&) = delete;
+
+    // without a close_notify OpenSSL marks the session as not resumable
+    ~tls_client() {
+        if (m_ok) {
+            SSL_shutdown(m_ssl);
+        }
+        SSL_free(m_ssl);
+        close(m_fd);
+    }
+
+    std::string_view alpn() const {
+        unsigned char const *proto = nullptr;
+        unsigned int len = 0;
+        SSL_get0_alpn_selected(m_ssl, &proto, &len);
+        return {reinterpret_cast<char const *>(proto), len};
+    }
+
+    bool write_all(std::string_view data) {
+        size_t n = 0;
+        return SSL_write_ex(m_ssl, data.data(), data.size(), &n) == 1 && n == data.size();
+    }
+
+    // one response, framed by Content-Length; empty on EOF or error
+    std::string read_response() {
+        std::string buf;
+        char chunk[16384];
+        while (true) {
+            size_t header_end = buf.find("\r\n\r\n");
+            if (header_end != std::string::npos) {
+                size_t pos = buf.find("ontent-Length: ");
+                size_t length = pos < header_end ? std::strtoul(buf.c_str() + pos + 15, nullptr, 10) : 0;
+                if (buf.size() >= header_end + 4 + length) {
+                    return buf;
+                }
+            }
+            size_t n = 0;
+            if (SSL_read_ex(m_ssl, chunk, sizeof(chunk), &n) != 1) {
+                return {};
+            }
+            buf.append(chunk, n);
+        }
+    }
+
+    std::string get() {
+        if (!write_all("GET / HTTP/1.1\r\nHost: localhost\r\n\r\n")) {
+            return {};
+        }
+        return read_response();
+    }
+};
+
+// trusts exactly the self-signed certificate
+static SSL_CTX *client_context(std::string const &cert_file) {
+    SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+    EXPECT(ctx != nullptr);
+    EXPECT(SSL_CTX_load_verify_locations(ctx, cert_file.c_str(), nullptr) == 1);
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, nullptr);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT);
+    return ctx;
+}
+
+static void test_http1(SSL_CTX *ctx, int port) {
+    tls_client client(ctx, port, "\x08http/1.1");
+    EXPECT(client.m_ok);
+    EXPECT(SSL_get_verify_result(client.m_ssl) == X509_V_OK);
+    EXPECT(client.alpn() == "http/1.1");
+    // keep-alive: several requests on one connection
+    for (int i = 0; i < 3; i++) {
+        EXPECT(client.get().starts_with("HTTP/1.1 200"));
+    }
+    // a body much larger than one TLS record, echoed back
+    std::string body(1 << 20, 'b');
+    EXPECT(client.write_all("POST /echo HTTP/1.1\r\nHost: localhost\r\nContent-Length: "
+                            + std::to_string(body.size()) + "\r\n\r\n" + body));
+    auto res = client.read_response();
+    EXPECT(res.starts_with("HTTP/1.1 200"));
+    EXPECT(res.find(body) != std::string::npos);
+}
+
+// no ALPN at all is HTTP/1.1 too
+static void test_no_alpn(SSL_CTX *ctx, int port) {
+    tls_client client(ctx, port);
+    EXPECT(client.m_ok);
+    EXPECT(client.alpn().empty());
+    EXPECT(client.get().starts_with("HTTP/1.1 200"));
+}
+
+// ALPN "h2" goes straight to HTTP/2: the server's SETTINGS follow the preface
+static void test_alpn_h2(SSL_CTX *ctx, int port) {
+    tls_client client(ctx, port, "\x02h2\x08http/1.1");
+    EXPECT(client.m_ok);
+    EXPECT(client.alpn() == "h2");
+    using namespace std::string_view_literals;
+    EXPECT(client.write_all("PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"sv "\0\0\0\x04\0\0\0\0\0"sv));
+    unsigned char header[9];
+    size_t n = 0;
+    EXPECT(SSL_read_ex(client.m_ssl, header, sizeof(header), &n) == 1 && n == sizeof(header));
+    EXPECT(header[3] == 0x4);
+    EXPECT((header[4] & 0x1) == 0);
+}
+
+// the ticket of a first connection resumes a second one without a full handshake
+static void test_resumption(SSL_CTX *ctx, int port) {
+    SSL_SESSION *session = nullptr;
+    {
+        tls_client first(ctx, port, "\x08http/1.1");
+        EXPECT(first.m_ok);
+        // TLS 1.3 tickets arrive after the handshake, read along with the response
+        EXPECT(first.get().starts_with("HTTP/1.1 200"));
+        session = SSL_get1_session(first.m_ssl);
+    }
+    EXPECT(session != nullptr && SSL_SESSION_is_resumable(session));
+    tls_client second(ctx, port, "\x08http/1.1", session);
+    EXPECT(second.m_ok);
+    EXPECT(SSL_session_reused(second.m_ssl) == 1);
+    EXPECT(second.get().starts_with("HTTP/1.1 200"));
+    SSL_SESSION_free(session);
+}
+
+// plain text on the TLS port fails the handshake and the connection, not the server
+static void test_not_tls(SSL_CTX *ctx, int port) {
+    int fd = connect_to(port);
+    std::string_view request = "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    EXPECT(write(fd, request.data(), request.size()) == static_cast<ssize_t>(request.size()));
+    char buf[1024];
+    ssize_t n;
+    // at most an alert record, then EOF or a reset
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        EXPECT(buf[0] == 0x15);
+    }
+    close(fd);
+
+    // a client that does not trust the certificate gives up during the handshake
+    SSL_CTX *untrusting = SSL_CTX_new(TLS_client_method());
+    SSL_CTX_set_verify(untrusting, SSL_VERIFY_PEER, nullptr);
+    {
+        tls_client client(untrusting, port);
+        EXPECT(!client.m_ok);
+    }
+    SSL_CTX_free(untrusting);
+
+    tls_client client(ctx, port);
+    EXPECT(client.m_ok);
+    EXPECT(client.get().starts_with("HTTP/1.1 200"));
+}
+
+int main() {
+    // the server side writes to peers that may be gone, as in server.cpp
+    signal(SIGPIPE, SIG_IGN);
+    io_context ctx;
+    admission_control admission;
+    auto dir = std::string(std::getenv("TMPDIR") ? std::getenv("TMPDIR") : "/tmp");
+    auto cert_file = dir + "/co_http_tls_test_" + std::to_string(getpid()) + ".crt";
+    auto key_file = dir + "/co_http_tls_test_" + std::to_string(getpid()) + ".key";
+    make_self_signed(cert_file, key_file);
+
+    auto acceptor = http_acceptor::make();
+    acceptor->use_tls(tls_context::make(cert_file, key_file));
+    acceptor->do_start("127.0.0.1", "0");
+    // the handshake needs TCP_NODELAY, whatever the other options say
+    EXPECT(acceptor->m_options.m_nodelay && acceptor->m_per_connection);
+    struct sockaddr_in addr{};
+    socklen_t addrlen = sizeof(addr);
+    EXPECT(getsockname(acceptor->listen_fd(), reinterpret_cast<struct sockaddr *>(&addr), &addrlen) == 0);
+    int port = ntohs(addr.sin_port);
+
+    std::thread clients([&] {
+        SSL_CTX *client_ctx = client_context(cert_file);
+        test_http1(client_ctx, port);
+        test_no_alpn(client_ctx, port);
+        test_alpn_h2(client_ctx, port);
+        test_resumption(client_ctx, port);
+        test_not_tls(client_ctx, port);
+        SSL_CTX_free(client_ctx);
+        ctx.post([&] {
+            acceptor->stop();
+            ctx.stop();
+        });
+    });
+    ctx.join();
+    clients.join();
+    std::remove(cert_file.c_str());
+    std::remove(key_file.c_str());
+    std::println("tls: 全部通过");
+    return 0;
+}
@@ -0,0 +1,260 @@
+// Offline checks of the WebSocket frame parser, the vectorized unmask and
+// the close/UTF-8 validation.
+
+#include <cstdlib>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "io_context.hpp"
+#include "websocket.hpp"
+
+#define EXPECT(cond) do { \
+    if (!(cond)) { \
+        std::println("失败: {}:{}: {}", __FILE__, __LINE__, #cond); \
+        std::exit(1); \
+    } \
+} while (0)
+
+static constexpr uint8_t k_key[4] = {0x37, 0xfa, 0x21, 0x3d};
+
+// a client frame: always masked, rsv bits as given
+static std::string client_frame(websocket_opcode opcode, std::string_view payload, bool fin = true,
+                                bool masked = true, uint8_t rsv = 0) {
+    std::string out;
+    out.push_back(static_cast<char>((fin ? 0x80 : 0) | rsv | static_cast<uint8_t>(opcode)));
+    uint8_t mask_bit = masked ? 0x80 : 0;
+    size_t n = payload.size();
+    if (n < 126) {
+        out.push_back(static_cast<char>(mask_bit | n));
+    }
+    else if (n <= 0xffff) {
+        out.push_back(static_cast<char>(mask_bit | 126));
+        out.push_back(static_cast<char>(n >> 8));
+        out.push_back(static_cast<char>(n));
+    }
+    else {
+        out.push_back(static_cast<char>(mask_bit | 127));
+        for (int shift = 56; shift >= 0; shift -= 8) {
+            out.push_back(static_cast<char>(uint64_t(n) >> shift));
+        }
+    }
+    if (masked) {
+        out.append(reinterpret_cast<char const *>(k_key), 4);
+    }
+    for (size_t i = 0; i < n; i++) {
+        out.push_back(static_cast<char>(payload[i] ^ (masked ? k_key[i % 4] : 0)));
+    }
+    return out;
+}
+
+struct parsed {
+    std::vector<std::pair<websocket_opcode, std::string>> m_frames;
+    uint16_t m_error = 0;
+};
+
+// feeds bytes in pieces of step bytes (0 = all at once)
+static parsed parse(websocket_frame_parser &parser, std::string bytes, size_t step = 0) {
+    parsed out;
+    auto on_frame = [&] (websocket_opcode opcode, bytes_view payload) {
+        out.m_frames.emplace_back(opcode, std::string(payload.data(), payload.size()));
+    };
+    if (step == 0) {
+        step = bytes.size();
+    }
+    for (size_t pos = 0; pos < bytes.size() && out.m_error == 0; pos += step) {
+        size_t n = std::min(step, bytes.size() - pos);
+        out.m_error = parser.push_chunk(bytes_view{bytes.data() + pos, n}, on_frame);
+    }
+    return out;
+}
+
+static parsed parse(std::string bytes, size_t step = 0) {
+    websocket_frame_parser parser;
+    return parse(parser, std::move(bytes), step);
+}
+
+static uint16_t code(websocket_close c) {
+    return static_cast<uint16_t>(c);
+}
+
+static void test_single_frames() {
+    std::string big(70000, 'b');
+    auto input = client_frame(websocket_opcode::text, "hello")
+               + client_frame(websocket_opcode::binary, std::string(300, 'm'))
+               + client_frame(websocket_opcode::binary, big)
+               + client_frame(websocket_opcode::text, "");
+    // however the bytes are split, the same messages come out
+    for (size_t step: {size_t(0), size_t(1), size_t(3), size_t(7), size_t(4096)}) {
+        auto out = parse(input, step);
+        EXPECT(out.m_error == 0);
+        EXPECT(out.m_frames.size() == 4);
+        EXPECT(out.m_frames[0].first == websocket_opcode::text && out.m_frames[0].second == "hello");
+        EXPECT(out.m_frames[1].second == std::string(300, 'm'));
+        EXPECT(out.m_frames[2].first == websocket_opcode::binary && out.m_frames[2].second == big);
+        EXPECT(out.m_frames[3].second.empty());
+    }
+}
+
+static void test_fragmentation() {
+    auto input = client_frame(websocket_opcode::text, "frag", false)
+               + client_frame(websocket_opcode::continuation, "men", false)
+               + client_frame(websocket_opcode::continuation, "ted");
+    for (size_t step: {size_t(0), size_t(1), size_t(5)}) {
+        auto out = parse(input, step);
+        EXPECT(out.m_error == 0);
+        EXPECT(out.m_frames.size() == 1);
+        EXPECT(out.m_frames[0].first == websocket_opcode::text && out.m_frames[0].second == "fragmented");
+    }
+
+    // a UTF-8 sequence may be split across fragments; only the whole message counts
+    std::string euro = "\xe2\x82\xac";
+    auto out = parse(client_frame(websocket_opcode::text, euro.substr(0, 2), false)
+                   + client_frame(websocket_opcode::continuation, euro.substr(2)));
+    EXPECT(out.m_error == 0 && out.m_frames.size() == 1 && out.m_frames[0].second == euro);
+    out = parse(client_frame(websocket_opcode::text, euro.substr(0, 2), false)
+              + client_frame(websocket_opcode::continuation, "x"));
+    EXPECT(out.m_error == code(websocket_close::invalid_payload));
+
+    // continuation without a message, or a new message inside one
+    EXPECT(parse(client_frame(websocket_opcode::continuation, "x")).m_error == code(websocket_close::protocol_error));
+    EXPECT(parse(client_frame(websocket_opcode::text, "a", false) + client_frame(websocket_opcode::binary, "b"))
+           .m_error == code(websocket_close::protocol_error));
+}
+
+// RFC 6455 5.4: control frames may be injected in the middle of a message
+static void test_control_between_fragments() {
+    auto input = client_frame(websocket_opcode::binary, "one,", false)
+               + client_frame(websocket_opcode::ping, "p1")
+               + client_frame(websocket_opcode::continuation, "two,", false)
+               + client_frame(websocket_opcode::pong, "")
+               + client_frame(websocket_opcode::continuation, "three")
+               + client_frame(websocket_opcode::close, "\x03\xe8" "bye");
+    for (size_t step: {size_t(0), size_t(1), size_t(2)}) {
+        auto out = parse(input, step);
+        EXPECT(out.m_error == 0);
+        EXPECT(out.m_frames.size() == 4);
+        EXPECT(out.m_frames[0].first == websocket_opcode::ping && out.m_frames[0].second == "p1");
+        EXPECT(out.m_frames[1].first == websocket_opcode::pong);
+        EXPECT(out.m_frames[2].first == websocket_opcode::binary && out.m_frames[2].second == "one,two,three");
+        EXPECT(out.m_frames[3].first == websocket_opcode::close && out.m_frames[3].second == "\x03\xe8" "bye");
+    }
+
+    // control frames are never fragmented and carry at most 125 bytes
+    EXPECT(parse(client_frame(websocket_opcode::ping, "x", false)).m_error == code(websocket_close::protocol_error));
+    EXPECT(parse(client_frame(websocket_opcode::ping, std::string(126, 'x'))).m_error
+           == code(websocket_close::protocol_error));
+}
+
+static void test_too_big() {
+    websocket_frame_parser parser;
+    parser.m_max_message = 1000;
+    // a single frame over the limit is refused from its header alone
+    auto header = client_frame(websocket_opcode::binary, std::string(1001, 'x')).substr(0, 4);
+    EXPECT(parse(parser, header).m_error == code(websocket_close::too_big));
+    // sticky: nothing more is parsed
+    EXPECT(parse(parser, client_frame(websocket_opcode::text, "ok")).m_error == code(websocket_close::too_big));
+
+    // fragments that add up past the limit
+    websocket_frame_parser fragments;
+    fragments.m_max_message = 1000;
+    auto out = parse(fragments, client_frame(websocket_opcode::binary, std::string(600, 'x'), false)
+                              + client_frame(websocket_opcode::continuation, std::string(600, 'y')));
+    EXPECT(out.m_error == code(websocket_close::too_big) && out.m_frames.empty());
+
+    // exactly the limit is fine, also reassembled
+    websocket_frame_parser exact;
+    exact.m_max_message = 1000;
+    out = parse(exact, client_frame(websocket_opcode::binary, std::string(1000, 'x'))
+                     + client_frame(websocket_opcode::binary, std::string(500, 'x'), false)
+                     + client_frame(websocket_opcode::continuation, std::string(500, 'y')), 97);
+    EXPECT(out.m_error == 0 && out.m_frames.size() == 2);
+
+    // a 64-bit length that would wrap
+    std::string huge = "\x82\xff\xff\xff\xff\xff\xff\xff\xff\xff";
+    EXPECT(parse(huge).m_error == code(websocket_close::too_big));
+}
+
+static void test_protocol_errors() {
+    EXPECT(parse(client_frame(websocket_opcode::text, "x", true, false)).m_error == code(websocket_close::protocol_error));
+    EXPECT(parse(client_frame(websocket_opcode::text, "x", true, true, 0x40)).m_error
+           == code(websocket_close::protocol_error));
+    EXPECT(parse(client_frame(static_cast<websocket_opcode>(0x3), "x")).m_error == code(websocket_close::protocol_error));
+    EXPECT(parse(client_frame(static_cast<websocket_opcode>(0xb), "x")).m_error == code(websocket_close::protocol_error));
+
+    // close payloads: empty, or a code that may be sent plus UTF-8
+    EXPECT(parse(client_frame(websocket_opcode::close, "")).m_error == 0);
+    EXPECT(parse(client_frame(websocket_opcode::close, "\x03")).m_error == code(websocket_close::protocol_error));
+    EXPECT(parse(client_frame(websocket_opcode::close, "\x03\xed")).m_error == code(websocket_close::protocol_error));
+    EXPECT(parse(client_frame(websocket_opcode::close, "\x0b\xb8")).m_error == 0);
+    EXPECT(parse(client_frame(websocket_opcode::close, "\x03\xe8\xff")).m_error == code(websocket_close::invalid_payload));
+    EXPECT(parse(client_frame(websocket_opcode::text, "ok\xc0\xaf")).m_error == code(websocket_close::invalid_payload));
+}
+
+static void test_close_codes() {
+    for (uint16_t c: {1000, 1001, 1002, 1003, 1007, 1011, 1014, 3000, 4999}) {
+        EXPECT(websocket_valid_close_code(c));
+    }
+    for (uint16_t c: {0, 999, 1004, 1005, 1006, 1015, 1016, 2999, 5000}) {
+        EXPECT(!websocket_valid_close_code(c));
+    }
+}
+
+static bool utf8(std::string_view s) {
+    return websocket_valid_utf8(bytes_const_view{s.data(), s.size()});
+}
+
+static void test_utf8() {
+    EXPECT(utf8(""));
+    EXPECT(utf8("plain ascii, longer than eight bytes"));
+    EXPECT(utf8("h\xc3\xa9llo \xe2\x82\xac \xf0\x90\x8d\x88"));
+    EXPECT(utf8("\xef\xbf\xbf\xf4\x8f\xbf\xbf"));
+    // overlong forms, surrogates, past U+10FFFF, stray and cut-off bytes
+    EXPECT(!utf8("\xc0\xaf"));
+    EXPECT(!utf8("\xe0\x80\xaf"));
+    EXPECT(!utf8("\xf0\x80\x80\xaf"));
+    EXPECT(!utf8("\xed\xa0\x80"));
+    EXPECT(!utf8("\xf4\x90\x80\x80"));
+    EXPECT(!utf8("\xf5\x80\x80\x80"));
+    EXPECT(!utf8("\x80"));
+    EXPECT(!utf8("abcdefgh\xe2\x82"));
+    EXPECT(!utf8("\xe2\x28\xa1"));
+    // a bad byte right after an ASCII run of eight
+    EXPECT(!utf8("abcdefgh\xff"));
+}
+
+static void unmask_scalar(char *data, size_t size, uint8_t const (&key)[4]) {
+    for (size_t i = 0; i < size; i++) {
+        data[i] ^= static_cast<char>(key[i % 4]);
+    }
+}
+
+// every length around the vector widths, at every alignment of the start
+static void test_unmask() {
+    std::string source(300, '\0');
+    for (size_t i = 0; i < source.size(); i++) {
+        source[i] = static_cast<char>(i * 131 + 7);
+    }
+    for (size_t offset = 0; offset < 32; offset++) {
+        for (size_t size = 0; size + offset <= source.size(); size += size < 80 ? 1 : 37) {
+            std::string fast = source;
+            std::string slow = source;
+            websocket_unmask(fast.data() + offset, size, k_key);
+            unmask_scalar(slow.data() + offset, size, k_key);
+            EXPECT(fast == slow);
+        }
+    }
+}
+
+int main() {
+    test_single_frames();
+    test_fragmentation();
+    test_control_between_fragments();
+    test_too_big();
+    test_protocol_errors();
+    test_close_codes();
+    test_utf8();
+    test_unmask();
+    std::println("websocket: 全部通过");
+    return 0;
+}